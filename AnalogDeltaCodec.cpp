@@ -0,0 +1,131 @@
+#include "AnalogDeltaCodec.h"
+#include <string.h>
+
+static const uint8_t kSeqMask = kAnalogDeltaKeyframe - 1;
+
+bool AnalogDeltaEncoder::setup(unsigned int keyframeInterval, unsigned int threshold)
+{
+	if(!keyframeInterval)
+		return false;
+	this->keyframeInterval = keyframeInterval;
+	this->threshold = threshold;
+	resync();
+	return true;
+}
+
+void AnalogDeltaEncoder::resync()
+{
+	needsKeyframe = true;
+}
+
+size_t AnalogDeltaEncoder::encode(unsigned char octave, uint32_t timestamp, const int16_t* values, unsigned char* payload)
+{
+	size_t len = 0;
+	payload[len++] = octave;
+	memcpy(&payload[len], &timestamp, sizeof(timestamp));
+	len += sizeof(timestamp);
+	uint8_t next = (seq + 1) & kSeqMask;
+	if(needsKeyframe || ++framesSinceKeyframe >= keyframeInterval)
+	{
+		seq = next;
+		payload[len++] = seq | kAnalogDeltaKeyframe;
+		memcpy(&payload[len], values, sizeof(sent));
+		len += sizeof(sent);
+		memcpy(sent, values, sizeof(sent));
+		framesSinceKeyframe = 0;
+		needsKeyframe = false;
+		return len;
+	}
+	payload[len++] = next;
+	unsigned char* map = &payload[len];
+	memset(map, 0, kAnalogDeltaMapBytes);
+	len += kAnalogDeltaMapBytes;
+	for(unsigned int n = 0; n < kAnalogDeltaKeys; ++n)
+	{
+		int diff = values[n] - sent[n];
+		if((unsigned int)(diff < 0 ? -diff : diff) <= threshold)
+			continue;
+		map[n / 8] |= 1 << (n % 8);
+		if(diff > kAnalogDeltaEscape && diff <= 127)
+		{
+			payload[len++] = (int8_t)diff;
+		} else {
+			payload[len++] = (uint8_t)kAnalogDeltaEscape;
+			memcpy(&payload[len], &values[n], sizeof(values[n]));
+			len += sizeof(values[n]);
+		}
+		sent[n] = values[n];
+	}
+	if(kAnalogDeltaHeaderBytes + kAnalogDeltaMapBytes == len)
+		return 0; // nothing changed
+	seq = next;
+	return len;
+}
+
+bool AnalogDeltaDecoder::decode(const unsigned char* payload, size_t length, unsigned char& octave, uint32_t& timestamp, int16_t* values)
+{
+	if(length < kAnalogDeltaHeaderBytes)
+	{
+		++errors;
+		return false;
+	}
+	size_t len = 0;
+	octave = payload[len++];
+	memcpy(&timestamp, &payload[len], sizeof(timestamp));
+	len += sizeof(timestamp);
+	uint8_t seq = payload[len++];
+	Block& block = blocks[octave];
+	if(seq & kAnalogDeltaKeyframe)
+	{
+		if(length != len + sizeof(block.values))
+		{
+			block.synced = false;
+			++errors;
+			return false;
+		}
+		memcpy(block.values, &payload[len], sizeof(block.values));
+	} else {
+		if(!block.synced || seq != ((block.seq + 1) & kSeqMask) || length < len + kAnalogDeltaMapBytes)
+		{
+			block.synced = false;
+			++errors;
+			return false;
+		}
+		const unsigned char* map = &payload[len];
+		len += kAnalogDeltaMapBytes;
+		int16_t decoded[kAnalogDeltaKeys];
+		memcpy(decoded, block.values, sizeof(decoded));
+		for(unsigned int n = 0; n < kAnalogDeltaKeys; ++n)
+		{
+			if(!(map[n / 8] & (1 << (n % 8))))
+				continue;
+			if(len >= length)
+			{
+				len = length + 1;
+				break;
+			}
+			int8_t diff = payload[len++];
+			if(kAnalogDeltaEscape != diff)
+			{
+				decoded[n] += diff;
+			} else if(len + sizeof(decoded[n]) <= length) {
+				memcpy(&decoded[n], &payload[len], sizeof(decoded[n]));
+				len += sizeof(decoded[n]);
+			} else {
+				len = length + 1;
+				break;
+			}
+		}
+		if(len != length)
+		{
+			block.synced = false;
+			++errors;
+			return false;
+		}
+		memcpy(block.values, decoded, sizeof(decoded));
+	}
+	block.seq = seq & kSeqMask;
+	block.synced = true;
+	memcpy(values, block.values, sizeof(block.values));
+	return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Compact analog frames, kFrameTypeAnalogDelta
+//
+// Like kFrameTypeAnalog, each frame carries the 25 keys of a two-octave
+// block, but only the keys that changed since the previous frame of the
+// same block are sent, as small differences. Payload, following the frame
+// type byte and before escaping:
+// [Octave] [TS0] [TS1] [TS2] [TS3] [Seq]
+// Seq: kAnalogDeltaKeyframe is set for keyframes, the lower bits count the
+// frames of this block, so that the decoder can tell when it missed one.
+// A keyframe is followed by the 25 int16 values, as in kFrameTypeAnalog.
+// Other frames are followed by a bitmap of the keys that changed, [Map0]
+// ... [Map3], key 0 in the lowest bit of Map0, then one entry per changed
+// key, in key order: the int8 difference from the previous value, or
+// kAnalogDeltaEscape followed by the int16 value. Multi-byte fields are
+// little-endian. Frames are escaped as usual, see touchkeyFrameWrite().
+// No frame is sent for a block that did not change, so an
+// idle keyboard only sends the keyframes, which come periodically so that
+// a decoder that joined late or missed a frame gets back in sync.
+
+const unsigned int kAnalogDeltaKeys = 25;
+const unsigned int kAnalogDeltaMapBytes = (kAnalogDeltaKeys + 7) / 8;
+const unsigned int kAnalogDeltaHeaderBytes = 6;
+const int8_t kAnalogDeltaEscape = -128;
+const uint8_t kAnalogDeltaKeyframe = 0x80;
+// Longest payload: a delta frame where every key is sent in full
+const unsigned int kAnalogDeltaMaxPayload = kAnalogDeltaHeaderBytes + kAnalogDeltaMapBytes + 3 * kAnalogDeltaKeys;
+
+// AnalogDeltaEncoder
+//
+// Encodes the frames of one two-octave block.
+class AnalogDeltaEncoder
+{
+public:
+	AnalogDeltaEncoder() {};
+	// keyframeInterval: a keyframe is sent at least every so many frames.
+	// threshold: changes of up to this many counts are not sent, which keeps
+	// sensor noise off the link. 0 is lossless
+	bool setup(unsigned int keyframeInterval = 100, unsigned int threshold = 0);
+	// Encode the kAnalogDeltaKeys values of a frame into payload, which must
+	// hold kAnalogDeltaMaxPayload bytes. Returns the length of the payload,
+	// or 0 if nothing changed and there is no frame to send
+	size_t encode(unsigned char octave, uint32_t timestamp, const int16_t* values, unsigned char* payload);
+	void setThreshold(unsigned int threshold) { this->threshold = threshold; }
+	// Make the next frame a keyframe, e.g.: because the latest one was not sent
+	void resync();
+private:
+	int16_t sent[kAnalogDeltaKeys] = {}; // the values as known to the decoder
+	unsigned int keyframeInterval = 100;
+	unsigned int threshold = 0;
+	unsigned int framesSinceKeyframe = 0;
+	uint8_t seq = 0;
+	bool needsKeyframe = true;
+};
+
+// AnalogDeltaDecoder
+//
+// Decodes the payloads of kFrameTypeAnalogDelta frames, keeping track of
+// each block separately.
+class AnalogDeltaDecoder
+{
+public:
+	AnalogDeltaDecoder() {};
+	// payload as unescaped, starting after the frame type byte. Returns true
+	// and fills octave, timestamp and the kAnalogDeltaKeys values if the
+	// frame could be decoded. Returns false for malformed frames and for
+	// delta frames that do not follow the previous frame of their block:
+	// that block is then ignored until its next keyframe.
+	bool decode(const unsigned char* payload, size_t length, unsigned char& octave, uint32_t& timestamp, int16_t* values);
+	// How many frames could not be decoded
+	size_t getErrors() { return errors; }
+private:
+	struct Block {
+		int16_t values[kAnalogDeltaKeys];
+		uint8_t seq;
+		bool synced = false;
+	};
+	Block blocks[256];
+	size_t errors = 0;
+};
@@ -0,0 +1,207 @@
+#include "EventLoop.h"
+#include "XenomaiWraps.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <string>
+#ifndef HOST_BUILD
+#include <rtdm/ipc.h>
+#endif /* HOST_BUILD */
+
+EventLoop::~EventLoop()
+{
+	cleanup();
+}
+
+bool EventLoop::setup(bool catchSignals)
+{
+	cleanup();
+	stopped = false;
+	eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(eventFd < 0)
+	{
+		fprintf(stderr, "Error creating the eventfd: %s\n", strerror(errno));
+		return false;
+	}
+	fds.push_back({eventFd, POLLIN, 0});
+	sources.push_back({nullptr, nullptr});
+#ifndef HOST_BUILD
+	// the label names the non-real-time end in the registry
+	static std::atomic<unsigned int> numLoops{0};
+	struct rtipc_port_label label;
+	snprintf(label.label, sizeof(label.label), "EventLoop-%d-%u", getpid(), numLoops++);
+	struct sockaddr_ipc address = {};
+	address.sipc_family = AF_RTIPC;
+	address.sipc_port = -1;
+	rtSocket = RT_CALL(socket)(AF_RTIPC, SOCK_DGRAM, IPCPROTO_XDDP);
+	std::string path = std::string("/proc/xenomai/registry/rtipc/xddp/") + label.label;
+	if(rtSocket < 0
+		|| RT_CALL(setsockopt)(rtSocket, SOL_XDDP, XDDP_LABEL, &label, sizeof(label))
+		|| RT_CALL(bind)(rtSocket, (struct sockaddr*)&address, sizeof(address)))
+	{
+		fprintf(stderr, "Warning: cannot create the XDDP socket (%s): notifyRt() "
+				"falls back to the eventfd, which leaves primary mode\n", strerror(errno));
+	} else if((rtFd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Warning: cannot open %s (%s): notifyRt() "
+				"falls back to the eventfd, which leaves primary mode\n", path.c_str(), strerror(errno));
+	}
+	if(rtFd >= 0)
+	{
+		fds.push_back({rtFd, POLLIN, 0});
+		sources.push_back({nullptr, nullptr});
+	} else if(rtSocket >= 0) {
+		RT_CALL(close)(rtSocket);
+		rtSocket = -1;
+	}
+#endif /* HOST_BUILD */
+	if(catchSignals)
+	{
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+		signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if(signalFd < 0)
+		{
+			fprintf(stderr, "Error creating the signalfd: %s\n", strerror(errno));
+			cleanup();
+			return false;
+		}
+		fds.push_back({signalFd, POLLIN, 0});
+		sources.push_back({nullptr, nullptr});
+	}
+	return true;
+}
+
+bool EventLoop::addFd(int fd, short events, Handler handler, void* arg)
+{
+	if(fd < 0 || !handler)
+		return false;
+	fds.push_back({fd, events, 0});
+	sources.push_back({handler, arg});
+	return true;
+}
+
+void EventLoop::setNotifyHandler(void (*handler)(void* arg), void* arg)
+{
+	notifyHandler = handler;
+	notifyArg = arg;
+}
+
+void EventLoop::notify()
+{
+	if(armed.exchange(false, std::memory_order_acq_rel))
+	{
+		uint64_t one = 1;
+		if(write(eventFd, &one, sizeof(one)) < 0 && EAGAIN != errno)
+			fprintf(stderr, "Error writing to the eventfd: %s\n", strerror(errno));
+	}
+}
+
+void EventLoop::notifyRt()
+{
+#ifdef HOST_BUILD
+	notify();
+#else /* HOST_BUILD */
+	if(rtSocket < 0)
+		notify(); // no XDDP socket, see setup()
+	else if(armed.exchange(false, std::memory_order_acq_rel))
+	{
+		// nothing to report from here: if this fails the loop wakes up at
+		// the next notification
+		char one = 1;
+		RT_CALL(sendto)(rtSocket, &one, sizeof(one), 0, NULL, 0);
+	}
+#endif /* HOST_BUILD */
+}
+
+void EventLoop::stop()
+{
+	stopped = true;
+	uint64_t one = 1;
+	if(eventFd >= 0)
+		(void)!write(eventFd, &one, sizeof(one));
+}
+
+bool EventLoop::runOnce(int timeoutMs)
+{
+	if(stopped)
+		return false;
+	// arm before calling the handler: whatever is notified after this
+	// point wakes up the poll() below
+	armed.store(true, std::memory_order_release);
+	if(notifyHandler)
+		notifyHandler(notifyArg);
+	int ret = poll(fds.data(), fds.size(), timeoutMs);
+	armed.store(false, std::memory_order_release);
+	if(ret < 0)
+	{
+		if(EINTR != errno)
+		{
+			fprintf(stderr, "Error from poll: %s\n", strerror(errno));
+			stop();
+		}
+		return !stopped;
+	}
+	// handlers may add sources: only go through the ones polled
+	size_t numFds = fds.size();
+	for(size_t n = 0; n < numFds && ret > 0; ++n)
+	{
+		short revents = fds[n].revents;
+		if(!revents)
+			continue;
+		--ret;
+		int fd = fds[n].fd;
+		if(fd == eventFd)
+		{
+			uint64_t count;
+			(void)!read(eventFd, &count, sizeof(count));
+		} else if(fd == rtFd) {
+			char messages[64];
+			while(read(rtFd, messages, sizeof(messages)) > 0)
+				;
+		} else if(fd == signalFd) {
+			struct signalfd_siginfo info;
+			if(read(signalFd, &info, sizeof(info)) == sizeof(info))
+			{
+				printf("Received %s, stopping\n", strsignal(info.ssi_signo));
+				stopped = true;
+			}
+		} else {
+			sources[n].handler(sources[n].arg, fd, revents);
+		}
+	}
+	return !stopped;
+}
+
+void EventLoop::run()
+{
+	while(runOnce(-1))
+		;
+}
+
+void EventLoop::cleanup()
+{
+	if(eventFd >= 0)
+		close(eventFd);
+	if(signalFd >= 0)
+		close(signalFd);
+	if(rtFd >= 0)
+		close(rtFd);
+	if(rtSocket >= 0)
+		RT_CALL(close)(rtSocket);
+	eventFd = -1;
+	signalFd = -1;
+	rtFd = -1;
+	rtSocket = -1;
+	fds.clear();
+	sources.clear();
+}
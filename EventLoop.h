@@ -0,0 +1,64 @@
+#pragma once
+#include <poll.h>
+#include <atomic>
+#include <vector>
+
+// EventLoop
+//
+// A poll() reactor for the non-real-time side of a program. It waits on
+// any number of file descriptors (e.g.: the serial port), on SIGINT and
+// SIGTERM through a signalfd and on an eventfd that other threads write
+// to with notify(), and calls the handler of whatever is ready. Nothing
+// runs until there is something to do.
+//
+// notify() only writes the eventfd if the loop is about to wait or
+// waiting, so a producer that calls it for every item makes at most one
+// system call per wake-up of the loop. On the board, a Linux system call
+// moves a Xenomai thread to secondary mode: real-time threads call
+// notifyRt() instead, which sends a message on an XDDP socket, whose other
+// end the loop polls. That is a Cobalt call, which stays in primary mode.
+// If the socket cannot be set up (e.g.: no XDDP support in the kernel),
+// setup() warns and notifyRt() falls back to notify().
+class EventLoop
+{
+public:
+	typedef void (*Handler)(void* arg, int fd, short revents);
+	EventLoop() {};
+	~EventLoop();
+	// Creates the eventfd and, if catchSignals, the signalfd. The signals are
+	// blocked in the calling thread: call this before starting any other
+	// thread, so that they inherit the mask and the signals reach the loop.
+	bool setup(bool catchSignals = true);
+	// Call handler with the revents of fd when any of events is ready
+	bool addFd(int fd, short events, Handler handler, void* arg);
+	// Called at every wake-up of the loop, whether or not notify() was called
+	void setNotifyHandler(void (*handler)(void* arg), void* arg);
+	// Wake the loop. Can be called from any non-real-time thread
+	void notify();
+	// The same, from a real-time thread. In host builds, the same as notify()
+	void notifyRt();
+	// Handle events until stop() is called or a signal is received
+	void run();
+	// Handle events for up to timeoutMs (-1: until there are some). Returns
+	// false once the loop has been stopped
+	bool runOnce(int timeoutMs);
+	// Can be called from any thread
+	void stop();
+	bool shouldStop() { return stopped; }
+	void cleanup();
+private:
+	struct Source {
+		Handler handler;
+		void* arg;
+	};
+	std::vector<struct pollfd> fds;	// the eventfd, the signalfd, then the others
+	std::vector<Source> sources;	// one per element of fds
+	void (*notifyHandler)(void*) = nullptr;
+	void* notifyArg = nullptr;
+	int eventFd = -1;
+	int signalFd = -1;
+	int rtSocket = -1;	// the real-time end of the XDDP socket
+	int rtFd = -1;		// its non-real-time end
+	std::atomic<bool> armed{false};	// the loop is waiting and needs a write to wake up
+	std::atomic<bool> stopped{false};
+};
@@ -0,0 +1,251 @@
+#include "KeyCapture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+static size_t sampleBytes(int sampleFormat)
+{
+	return kKeyCaptureFormatFloat == sampleFormat ? sizeof(float) : sizeof(int16_t);
+}
+
+uint32_t calibrationIdFromFile(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(!file)
+		return 0;
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	int c;
+	while((c = fgetc(file)) != EOF)
+	{
+		hash ^= (uint8_t)c;
+		hash *= 16777619u;
+	}
+	fclose(file);
+	return hash;
+}
+
+KeyCaptureWriter::~KeyCaptureWriter()
+{
+	cleanup();
+}
+
+bool KeyCaptureWriter::setup(const char* path, unsigned int numKeys, int lowestNote, float scanRate,
+		uint32_t calibrationId, int sampleFormat, unsigned int framesPerBlock)
+{
+	cleanup();
+	if(0 == numKeys || 0 == framesPerBlock)
+		return false;
+	fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	KeyCaptureHeader header = {};
+	header.magic = kKeyCaptureMagic;
+	header.version = kKeyCaptureVersion;
+	header.sampleFormat = sampleFormat;
+	header.numKeys = numKeys;
+	header.lowestNote = lowestNote;
+	header.scanRate = scanRate;
+	header.calibrationId = calibrationId;
+	if(::write(fd, &header, sizeof(header)) != sizeof(header))
+	{
+		fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+		cleanup();
+		return false;
+	}
+	this->numKeys = numKeys;
+	this->framesPerBlock = framesPerBlock;
+	this->sampleFormat = sampleFormat;
+	frameBytes = numKeys * sampleBytes(sampleFormat);
+	for(auto& block : blocks)
+		block.resize(frameBytes * framesPerBlock);
+	activeBlock = 0;
+	activeFrames = 0;
+	pendingBlock = -1;
+	shouldStop = false;
+	droppedFrames = 0;
+	if(pthread_create(&writeThread, NULL, writeThreadLoop, this))
+	{
+		fprintf(stderr, "Error creating the capture thread\n");
+		cleanup();
+		return false;
+	}
+	threadRunning = true;
+	return true;
+}
+
+bool KeyCaptureWriter::write(const float* frame)
+{
+	if(fd < 0)
+		return false;
+	if(activeFrames == framesPerBlock)
+	{
+		// hand over the full block, unless the other one is still being written
+		if(pendingBlock.load(std::memory_order_acquire) >= 0)
+		{
+			droppedFrames.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		pendingBlock.store(activeBlock, std::memory_order_release);
+		activeBlock ^= 1;
+		activeFrames = 0;
+	}
+	char* dest = blocks[activeBlock].data() + activeFrames * frameBytes;
+	if(kKeyCaptureFormatFloat == sampleFormat)
+	{
+		memcpy(dest, frame, frameBytes);
+	} else {
+		int16_t* samples = (int16_t*)dest;
+		for(unsigned int n = 0; n < numKeys; ++n)
+		{
+			float value = std::min(32767.f, std::max(-32768.f, frame[n] * kKeyCaptureInt16Scale));
+			samples[n] = (int16_t)value;
+		}
+	}
+	++activeFrames;
+	return true;
+}
+
+void KeyCaptureWriter::writeBlock(unsigned int block, size_t numFrames)
+{
+	const char* data = blocks[block].data();
+	size_t length = numFrames * frameBytes;
+	while(length)
+	{
+		ssize_t ret = ::write(fd, data, length);
+		if(ret < 0)
+		{
+			if(EINTR == errno)
+				continue;
+			fprintf(stderr, "Error writing capture: %s\n", strerror(errno));
+			return;
+		}
+		data += ret;
+		length -= ret;
+	}
+}
+
+void* KeyCaptureWriter::writeThreadLoop(void* arg)
+{
+	KeyCaptureWriter* that = (KeyCaptureWriter*)arg;
+	while(!that->shouldStop)
+	{
+		int block = that->pendingBlock.load(std::memory_order_acquire);
+		if(block >= 0)
+		{
+			that->writeBlock(block, that->framesPerBlock);
+			that->pendingBlock.store(-1, std::memory_order_release);
+		}
+		usleep(10000);
+	}
+	return NULL;
+}
+
+void KeyCaptureWriter::cleanup()
+{
+	if(threadRunning)
+	{
+		shouldStop = true;
+		pthread_join(writeThread, NULL);
+		threadRunning = false;
+		// the real-time thread is no longer writing: flush what is left
+		int block = pendingBlock.load();
+		if(block >= 0)
+			writeBlock(block, framesPerBlock);
+		pendingBlock = -1;
+		writeBlock(activeBlock, activeFrames);
+		activeFrames = 0;
+		if(droppedFrames)
+			fprintf(stderr, "Capture: %zu frames dropped\n", droppedFrames.load());
+	}
+	if(fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+size_t KeyCaptureWriter::getDroppedFrames()
+{
+	return droppedFrames.load(std::memory_order_relaxed);
+}
+
+KeyCaptureReader::~KeyCaptureReader()
+{
+	close();
+}
+
+bool KeyCaptureReader::open(const char* path)
+{
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KeyCaptureHeader))
+	{
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// the mapping stays valid after the file is closed
+	::close(fd);
+	if(MAP_FAILED == map)
+		return false;
+	data = (const char*)map;
+	length = st.st_size;
+	header = (const KeyCaptureHeader*)data;
+	if(header->magic != kKeyCaptureMagic || header->version != kKeyCaptureVersion || 0 == header->numKeys
+		|| (header->sampleFormat != kKeyCaptureFormatInt16 && header->sampleFormat != kKeyCaptureFormatFloat))
+	{
+		close();
+		return false;
+	}
+	frameBytes = header->numKeys * sampleBytes(header->sampleFormat);
+	numFrames = (length - sizeof(KeyCaptureHeader)) / frameBytes;
+	madvise(map, length, MADV_SEQUENTIAL);
+	return true;
+}
+
+void KeyCaptureReader::close()
+{
+	if(data)
+		munmap((void*)data, length);
+	data = nullptr;
+	header = nullptr;
+	length = 0;
+	numFrames = 0;
+}
+
+const float* KeyCaptureReader::getFloatFrame(size_t frame)
+{
+	if(frame >= numFrames || kKeyCaptureFormatFloat != header->sampleFormat)
+		return nullptr;
+	return (const float*)(data + sizeof(KeyCaptureHeader) + frame * frameBytes);
+}
+
+const int16_t* KeyCaptureReader::getInt16Frame(size_t frame)
+{
+	if(frame >= numFrames || kKeyCaptureFormatInt16 != header->sampleFormat)
+		return nullptr;
+	return (const int16_t*)(data + sizeof(KeyCaptureHeader) + frame * frameBytes);
+}
+
+void KeyCaptureReader::getFrame(size_t frame, float* out)
+{
+	if(const float* samples = getFloatFrame(frame))
+	{
+		memcpy(out, samples, frameBytes);
+	} else if(const int16_t* samples = getInt16Frame(frame)) {
+		for(unsigned int n = 0; n < header->numKeys; ++n)
+			out[n] = samples[n] / kKeyCaptureInt16Scale;
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+// Capture files store raw scans of the whole keyboard: a KeyCaptureHeader
+// followed by frame-major samples, i.e.: numKeys samples for each frame,
+// one frame every 1/scanRate seconds. Samples are either floats or int16
+// scaled by kKeyCaptureInt16Scale. All fields are little-endian.
+
+enum {
+	kKeyCaptureFormatInt16 = 0,
+	kKeyCaptureFormatFloat = 1,
+};
+
+const uint32_t kKeyCaptureMagic = 0x5041434b; // "KCAP"
+const uint16_t kKeyCaptureVersion = 1;
+const float kKeyCaptureInt16Scale = 4096; // int16 value of a fully pressed key
+
+struct KeyCaptureHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sampleFormat;
+	uint32_t numKeys;
+	int32_t lowestNote;
+	float scanRate;				// frames per second
+	uint32_t calibrationId;		// identifies the calibration in use, see calibrationIdFromFile()
+	uint32_t reserved[2];
+};
+static_assert(sizeof(KeyCaptureHeader) == 32, "KeyCaptureHeader must not be padded");
+
+// Hash of the contents of a calibration file, for KeyCaptureHeader::calibrationId.
+// Returns 0 if the file cannot be read.
+uint32_t calibrationIdFromFile(const char* path);
+
+// KeyCaptureWriter
+//
+// Writes a capture file from the real-time thread without blocking it:
+// frames are copied into one of two blocks, and a background thread writes
+// out a block once it is full. If the background thread has not finished
+// writing the previous block by the time the current one fills up, frames
+// are dropped and counted.
+class KeyCaptureWriter
+{
+public:
+	KeyCaptureWriter() {};
+	~KeyCaptureWriter();
+	bool setup(const char* path, unsigned int numKeys, int lowestNote, float scanRate,
+			uint32_t calibrationId, int sampleFormat = kKeyCaptureFormatInt16,
+			unsigned int framesPerBlock = 1024);
+	// Call from the real-time thread. frame holds numKeys positions.
+	bool write(const float* frame);
+	// Write out what is left and close the file. Call once write() is
+	// no longer being called.
+	void cleanup();
+	size_t getDroppedFrames();
+private:
+	static void* writeThreadLoop(void* arg);
+	void writeBlock(unsigned int block, size_t numFrames);
+	int fd = -1;
+	pthread_t writeThread;
+	bool threadRunning = false;
+	std::vector<char> blocks[2];
+	size_t frameBytes = 0;
+	unsigned int numKeys = 0;
+	unsigned int framesPerBlock = 0;
+	int sampleFormat = kKeyCaptureFormatInt16;
+	unsigned int activeBlock = 0;	// only accessed by the real-time thread
+	unsigned int activeFrames = 0;	// only accessed by the real-time thread
+	std::atomic<int> pendingBlock{-1};	// full block waiting to be written
+	std::atomic<bool> shouldStop{false};
+	std::atomic<size_t> droppedFrames{0};
+};
+
+// KeyCaptureReader
+//
+// Maps a capture file in memory, so that frames can be replayed or
+// scrubbed without copying them.
+class KeyCaptureReader
+{
+public:
+	KeyCaptureReader() {};
+	~KeyCaptureReader();
+	// Returns false if the file cannot be mapped or is not a capture file
+	bool open(const char* path);
+	void close();
+	const KeyCaptureHeader& getHeader() { return *header; }
+	unsigned int getNumKeys() { return header->numKeys; }
+	size_t getNumFrames() { return numFrames; }
+	// Direct access to the samples of a frame, for the matching sampleFormat
+	const float* getFloatFrame(size_t frame);
+	const int16_t* getInt16Frame(size_t frame);
+	// Convert any frame to positions. out holds getNumKeys() values
+	void getFrame(size_t frame, float* out);
+private:
+	const char* data = nullptr;
+	size_t length = 0;
+	const KeyCaptureHeader* header = nullptr;
+	size_t frameBytes = 0;
+	size_t numFrames = 0;
+};
@@ -0,0 +1,242 @@
+#include "KeyMask.h"
+#include <algorithm>
+
+// Which of the vector paths below get built. Define KEY_MASK_SCALAR to
+// build none of them, so that the plain loops can be tested on their own
+#ifndef KEY_MASK_SCALAR
+#if defined(__AVX__)
+#define KEY_MASK_AVX
+#endif /* __AVX__ */
+#if defined(__SSE__)
+#define KEY_MASK_SSE
+#endif /* __SSE__ */
+#if defined(__SSE2__)
+#define KEY_MASK_SSE2
+#endif /* __SSE2__ */
+#if !defined(__SSE__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define KEY_MASK_NEON
+#endif /* __ARM_NEON */
+#endif /* KEY_MASK_SCALAR */
+
+#if defined(KEY_MASK_SSE)
+#include <immintrin.h>
+#elif defined(KEY_MASK_NEON)
+#include <arm_neon.h>
+#endif
+
+void keyMaskScreen(const float* frame, unsigned int numKeys, float threshold, key_mask_word* mask)
+{
+	for(unsigned int w = 0; w < keyMaskWords(numKeys); ++w)
+		mask[w] = 0;
+	unsigned int n = 0;
+	// the vector widths divide kKeyMaskWordBits, so a vector never
+	// straddles two words
+#if defined(KEY_MASK_AVX)
+	const __m256 threshold8 = _mm256_set1_ps(threshold);
+	for(; n + 8 <= numKeys; n += 8)
+	{
+		__m256 above = _mm256_cmp_ps(_mm256_loadu_ps(frame + n), threshold8, _CMP_GT_OQ);
+		mask[n / kKeyMaskWordBits] |= (key_mask_word)_mm256_movemask_ps(above) << (n % kKeyMaskWordBits);
+	}
+#endif /* KEY_MASK_AVX */
+#if defined(KEY_MASK_SSE)
+	const __m128 threshold4 = _mm_set1_ps(threshold);
+	for(; n + 4 <= numKeys; n += 4)
+	{
+		__m128 above = _mm_cmpgt_ps(_mm_loadu_ps(frame + n), threshold4);
+		mask[n / kKeyMaskWordBits] |= (key_mask_word)_mm_movemask_ps(above) << (n % kKeyMaskWordBits);
+	}
+#elif defined(KEY_MASK_NEON)
+	const float32x4_t threshold4 = vdupq_n_f32(threshold);
+	static const uint32_t laneBitsData[4] = { 1, 2, 4, 8 };
+	const uint32x4_t laneBits = vld1q_u32(laneBitsData);
+	for(; n + 4 <= numKeys; n += 4)
+	{
+		uint32x4_t above = vandq_u32(vcgtq_f32(vld1q_f32(frame + n), threshold4), laneBits);
+		// horizontal add of the four lane bits (vaddvq is not available on ARMv7)
+		uint32x2_t sum = vpadd_u32(vget_low_u32(above), vget_high_u32(above));
+		sum = vpadd_u32(sum, sum);
+		mask[n / kKeyMaskWordBits] |= vget_lane_u32(sum, 0) << (n % kKeyMaskWordBits);
+	}
+#endif /* KEY_MASK_SSE / KEY_MASK_NEON */
+	for(; n < numKeys; ++n)
+	{
+		if(frame[n] > threshold)
+			mask[n / kKeyMaskWordBits] |= (key_mask_word)1 << (n % kKeyMaskWordBits);
+	}
+}
+
+void keyMaskScreen(const int16_t* frame, unsigned int numKeys, int16_t threshold, key_mask_word* mask)
+{
+	for(unsigned int w = 0; w < keyMaskWords(numKeys); ++w)
+		mask[w] = 0;
+	unsigned int n = 0;
+#if defined(KEY_MASK_SSE2)
+	const __m128i threshold8 = _mm_set1_epi16(threshold);
+	for(; n + 8 <= numKeys; n += 8)
+	{
+		__m128i above = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(frame + n)), threshold8);
+		// narrow the 16-bit lanes to bytes, so that the low 8 bits of the movemask are one per key
+		key_mask_word bits = _mm_movemask_epi8(_mm_packs_epi16(above, _mm_setzero_si128()));
+		mask[n / kKeyMaskWordBits] |= bits << (n % kKeyMaskWordBits);
+	}
+#elif defined(KEY_MASK_NEON)
+	const int16x8_t threshold8 = vdupq_n_s16(threshold);
+	static const uint16_t laneBitsData[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint16x8_t laneBits = vld1q_u16(laneBitsData);
+	for(; n + 8 <= numKeys; n += 8)
+	{
+		uint16x8_t above = vandq_u16(vcgtq_s16(vld1q_s16(frame + n), threshold8), laneBits);
+		uint16x4_t sum = vpadd_u16(vget_low_u16(above), vget_high_u16(above));
+		sum = vpadd_u16(sum, sum);
+		sum = vpadd_u16(sum, sum);
+		mask[n / kKeyMaskWordBits] |= (key_mask_word)vget_lane_u16(sum, 0) << (n % kKeyMaskWordBits);
+	}
+#endif /* KEY_MASK_SSE2 / KEY_MASK_NEON */
+	for(; n < numKeys; ++n)
+	{
+		if(frame[n] > threshold)
+			mask[n / kKeyMaskWordBits] |= (key_mask_word)1 << (n % kKeyMaskWordBits);
+	}
+}
+
+// The bits of mask for the keys from n, a multiple of width, to
+// n + width, excluding those below first
+static inline key_mask_word keyMaskLanes(const key_mask_word* mask, unsigned int n, unsigned int width, unsigned int first)
+{
+	key_mask_word bits = (mask[n / kKeyMaskWordBits] >> (n % kKeyMaskWordBits)) & (((key_mask_word)1 << width) - 1);
+	if(first > n)
+		bits &= ~(key_mask_word)0 << (first - n);
+	return bits;
+}
+
+// Once the highest position is known, the key it belongs to: there are few
+// keys in the mask, so this is only a scan of its bits
+template <typename T>
+static int keyMaskFind(const T* frame, const key_mask_word* mask, unsigned int first, unsigned int last, T max)
+{
+	for(unsigned int w = first / kKeyMaskWordBits; w < keyMaskWords(last); ++w)
+	{
+		key_mask_word bits = mask[w] & keyMaskRange(w, first, last);
+		while(bits)
+		{
+			unsigned int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+			bits &= bits - 1;
+			if(frame[n] == max)
+				return n;
+		}
+	}
+	return -1;
+}
+
+int keyMaskMax(const float* frame, const key_mask_word* mask, unsigned int first, unsigned int last, float floor)
+{
+	if(first >= last)
+		return -1;
+	float max = floor;
+	unsigned int n = first;
+	// vectors start at a multiple of their width, so that they never
+	// straddle two words, with the lanes below first masked out
+#if defined(KEY_MASK_SSE2)
+	const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128 floor4 = _mm_set1_ps(floor);
+	__m128 max4 = floor4;
+	for(n = first & ~3u; n + 4 <= last; n += 4)
+	{
+		__m128i bits = _mm_set1_epi32(keyMaskLanes(mask, n, 4, first));
+		__m128 lanes = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, laneBits), laneBits));
+		__m128 values = _mm_or_ps(_mm_and_ps(lanes, _mm_loadu_ps(frame + n)), _mm_andnot_ps(lanes, floor4));
+		max4 = _mm_max_ps(max4, values);
+	}
+	max4 = _mm_max_ps(max4, _mm_shuffle_ps(max4, max4, _MM_SHUFFLE(1, 0, 3, 2)));
+	max4 = _mm_max_ps(max4, _mm_shuffle_ps(max4, max4, _MM_SHUFFLE(2, 3, 0, 1)));
+	max = _mm_cvtss_f32(max4);
+#elif defined(KEY_MASK_NEON)
+	static const uint32_t laneBitsData[4] = { 1, 2, 4, 8 };
+	const uint32x4_t laneBits = vld1q_u32(laneBitsData);
+	const float32x4_t floor4 = vdupq_n_f32(floor);
+	float32x4_t max4 = floor4;
+	for(n = first & ~3u; n + 4 <= last; n += 4)
+	{
+		uint32x4_t bits = vdupq_n_u32(keyMaskLanes(mask, n, 4, first));
+		uint32x4_t lanes = vceqq_u32(vandq_u32(bits, laneBits), laneBits);
+		max4 = vmaxq_f32(max4, vbslq_f32(lanes, vld1q_f32(frame + n), floor4));
+	}
+	float32x2_t max2 = vpmax_f32(vget_low_f32(max4), vget_high_f32(max4));
+	max2 = vpmax_f32(max2, max2);
+	max = vget_lane_f32(max2, 0);
+#endif /* KEY_MASK_SSE2 / KEY_MASK_NEON */
+	for(n = std::max(n, first); n < last; ++n)
+	{
+		if(keyMaskGet(mask, n) && frame[n] > max)
+			max = frame[n];
+	}
+	if(!(max > floor))
+		return -1;
+	return keyMaskFind(frame, mask, first, last, max);
+}
+
+int keyMaskMax(const int16_t* frame, const key_mask_word* mask, unsigned int first, unsigned int last, int16_t floor)
+{
+	if(first >= last)
+		return -1;
+	int16_t max = floor;
+	unsigned int n = first;
+#if defined(KEY_MASK_SSE2)
+	const __m128i laneBits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m128i floor8 = _mm_set1_epi16(floor);
+	__m128i max8 = floor8;
+	for(n = first & ~7u; n + 8 <= last; n += 8)
+	{
+		__m128i bits = _mm_set1_epi16(keyMaskLanes(mask, n, 8, first));
+		__m128i lanes = _mm_cmpeq_epi16(_mm_and_si128(bits, laneBits), laneBits);
+		__m128i values = _mm_or_si128(_mm_and_si128(lanes, _mm_loadu_si128((const __m128i*)(frame + n))), _mm_andnot_si128(lanes, floor8));
+		max8 = _mm_max_epi16(max8, values);
+	}
+	max8 = _mm_max_epi16(max8, _mm_shuffle_epi32(max8, _MM_SHUFFLE(1, 0, 3, 2)));
+	max8 = _mm_max_epi16(max8, _mm_shuffle_epi32(max8, _MM_SHUFFLE(2, 3, 0, 1)));
+	max8 = _mm_max_epi16(max8, _mm_shufflelo_epi16(max8, _MM_SHUFFLE(2, 3, 0, 1)));
+	max = _mm_extract_epi16(max8, 0);
+#elif defined(KEY_MASK_NEON)
+	static const uint16_t laneBitsData[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint16x8_t laneBits = vld1q_u16(laneBitsData);
+	const int16x8_t floor8 = vdupq_n_s16(floor);
+	int16x8_t max8 = floor8;
+	for(n = first & ~7u; n + 8 <= last; n += 8)
+	{
+		uint16x8_t bits = vdupq_n_u16(keyMaskLanes(mask, n, 8, first));
+		uint16x8_t lanes = vceqq_u16(vandq_u16(bits, laneBits), laneBits);
+		max8 = vmaxq_s16(max8, vbslq_s16(lanes, vld1q_s16(frame + n), floor8));
+	}
+	int16x4_t max4 = vpmax_s16(vget_low_s16(max8), vget_high_s16(max8));
+	max4 = vpmax_s16(max4, max4);
+	max4 = vpmax_s16(max4, max4);
+	max = vget_lane_s16(max4, 0);
+#endif /* KEY_MASK_SSE2 / KEY_MASK_NEON */
+	for(n = std::max(n, first); n < last; ++n)
+	{
+		if(keyMaskGet(mask, n) && frame[n] > max)
+			max = frame[n];
+	}
+	if(!(max > floor))
+		return -1;
+	return keyMaskFind(frame, mask, first, last, max);
+}
+
+const char* keyMaskVectorPaths()
+{
+	return ""
+#if defined(KEY_MASK_AVX)
+		"AVX "
+#endif /* KEY_MASK_AVX */
+#if defined(KEY_MASK_SSE2)
+		"SSE2"
+#elif defined(KEY_MASK_SSE)
+		"SSE"
+#elif defined(KEY_MASK_NEON)
+		"NEON"
+#else
+		"none"
+#endif
+	;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+
+// Bitmasks with one bit per key, 32 keys per word, used to iterate only
+// over the keys that need processing in a frame.
+typedef uint32_t key_mask_word;
+const unsigned int kKeyMaskWordBits = 32;
+
+static inline unsigned int keyMaskWords(unsigned int numKeys)
+{
+	return (numKeys + kKeyMaskWordBits - 1) / kKeyMaskWordBits;
+}
+
+static inline void keyMaskSet(key_mask_word* mask, unsigned int n, bool value)
+{
+	key_mask_word bit = (key_mask_word)1 << (n % kKeyMaskWordBits);
+	if(value)
+		mask[n / kKeyMaskWordBits] |= bit;
+	else
+		mask[n / kKeyMaskWordBits] &= ~bit;
+}
+
+static inline bool keyMaskGet(const key_mask_word* mask, unsigned int n)
+{
+	return mask[n / kKeyMaskWordBits] & ((key_mask_word)1 << (n % kKeyMaskWordBits));
+}
+
+// The bits of word w that correspond to keys within [first, last)
+static inline key_mask_word keyMaskRange(unsigned int w, unsigned int first, unsigned int last)
+{
+	unsigned int begin = w * kKeyMaskWordBits;
+	unsigned int end = begin + kKeyMaskWordBits;
+	key_mask_word bits = ~(key_mask_word)0;
+	if(first > begin)
+		bits &= first >= end ? 0 : ~(key_mask_word)0 << (first - begin);
+	if(last < end)
+		bits &= last <= begin ? 0 : ~(key_mask_word)0 >> (end - last);
+	return bits;
+}
+
+// Index within the word of the lowest set bit. bits must not be 0
+static inline unsigned int keyMaskLowestBit(key_mask_word bits)
+{
+	return __builtin_ctz(bits);
+}
+
+// Set the bits of the keys whose position in frame is above threshold and
+// clear all others. Vectorized with NEON or SSE/AVX where available.
+void keyMaskScreen(const float* frame, unsigned int numKeys, float threshold, key_mask_word* mask);
+// The same, for frames of int16 samples (fixed-point builds)
+void keyMaskScreen(const int16_t* frame, unsigned int numKeys, int16_t threshold, key_mask_word* mask);
+// Among the keys in [first, last) whose bit is set in mask, the first one
+// with the highest position in frame, if that is above floor, or -1.
+// Vectorized as keyMaskScreen()
+int keyMaskMax(const float* frame, const key_mask_word* mask, unsigned int first, unsigned int last, float floor);
+// The same, for frames of int16 samples (fixed-point builds)
+int keyMaskMax(const int16_t* frame, const key_mask_word* mask, unsigned int first, unsigned int last, int16_t floor);
+// The instruction sets the functions above were vectorized with, for
+// reporting: "none" with KEY_MASK_SCALAR or where none is available
+const char* keyMaskVectorPaths();
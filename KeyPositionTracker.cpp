@@ -20,55 +20,68 @@
   KeyPositionTracker.cpp: parses continuous key position and detects the
   state of the key.
 */
+#ifndef HOST_BUILD
 #include <Scope.h>
 extern Scope scope;
-float gMaxThreshold;
-float gMinThreshold;
-float gPercussed;
-
+#endif /* HOST_BUILD */
 #include "KeyPositionTracker.h"
-#include <iostream>
-extern "C" int rt_printf(const char *format, ...);
-int gPrint = 0;
+#include <string.h>
+#include "Trace.h"
+
+constexpr uint8_t KeyBuffers::kMaxAge;
 
 bool KeyBuffers::setup(unsigned int numKeys, unsigned int bufferLength)
 {
-	if(numKeys == 0 || bufferLength == 0)
+	if(numKeys == 0 || bufferLength <= kPositionTrackerSamplesToAverageForStartVelocity)
 		return false;
-	positionBuffer.resize(numKeys);
-	timestamps.resize(numKeys);
-	for(auto &p : positionBuffer)
-		p.resize(bufferLength);
-	for(auto &p : timestamps)
-		p.resize(bufferLength);
+#ifdef KEY_BUFFERS_POWER_OF_TWO
+	unsigned int length = 1;
+	while(length < bufferLength)
+		length <<= 1;
+	bufferLength = length;
+	mask = bufferLength - 1;
+#endif /* KEY_BUFFERS_POWER_OF_TWO */
+	this->numKeys = numKeys;
+	positionBuffer.resize(numKeys * bufferLength);
+	timestamps.resize(bufferLength);
+	for(auto* ages : { &velocityHistory.slow, &velocityHistory.slowBeforeSpike,
+			&velocityHistory.slowBeforeSpikeBeforeSlow, &velocityHistory.notReleasing })
+		ages->assign(numKeys, kMaxAge);
+	velocities.resize(numKeys);
 	return true;
 }
 
 void KeyBuffers::postCallback(void* arg, float* buffer, unsigned int length)
 {
 	KeyBuffers* that = (KeyBuffers*)arg;
-	static int count = 0;
-	that->postCallback(buffer, length, count/1000.f);
-	++count;
+	that->postCallback(buffer, length, that->frameCount++);
 }
 
-void KeyBuffers::postCallback(float* buffer, unsigned int length, timestamp_type timestamp)
+void KeyBuffers::postCallback(const float* buffer, unsigned int length, frame_type timestamp)
 {
-	for(unsigned int n = 0; n < std::min(positionBuffer.size(), length); ++n)
-	{
-		positionBuffer[n][writeIdx] = buffer[n];
-		//positionBuffer[n][writeIdx] = ((int)ts % 1000)/1000.f;
-		/*
+	key_sample* frame = nextFrame();
+	unsigned int count = std::min(numKeys, length);
+#ifdef FIXED_POINT_PIANO_SAMPLES
+	for(unsigned int n = 0; n < count; ++n)
+		frame[n] = float_to_key_sample(buffer[n]);
+#else /* FIXED_POINT_PIANO_SAMPLES */
+	memcpy(frame, buffer, count * sizeof(buffer[0]));
+#endif /* FIXED_POINT_PIANO_SAMPLES */
+	commitFrame(timestamp);
+}
+
+void KeyBuffers::commitFrame(frame_type timestamp)
+{
+	/*
 TODO: fix this instead of using static ts
-		if(full)
-			ts = firstSampleIndex + positionBuffer[0].size();
-		else
-			ts = writeIdx;
-			*/
-		timestamps[n][writeIdx] = timestamp;
-	}
+	if(full)
+		ts = firstSampleIndex + timestamps.size();
+	else
+		ts = writeIdx;
+		*/
+	timestamps[writeIdx] = timestamp;
 	++writeIdx;
-	if(writeIdx >= positionBuffer[0].size())
+	if(writeIdx >= timestamps.size())
 	{
 		writeIdx = 0;
 		full = true;
@@ -77,6 +90,55 @@ TODO: fix this instead of using static ts
 	{
 		++firstSampleIndex;
 	}
+	updateVelocityHistory();
+}
+
+void KeyBuffers::updateVelocityHistory()
+{
+	// the frame just stored, and the one its velocity is measured against
+	ssize_t size = timestamps.size();
+	ssize_t latest = (writeIdx ? writeIdx : size) - 1;
+	ssize_t older = latest - kPositionTrackerSamplesToAverageForStartVelocity;
+	if(older < 0)
+		older += size;
+	const key_sample* frame = frameAt(latest);
+	const key_sample* olderFrame = frameAt(older);
+	frame_diff_type diffTimestamp = timestamps[latest] - timestamps[older];
+	uint8_t* slow = velocityHistory.slow.data();
+	uint8_t* slowBeforeSpike = velocityHistory.slowBeforeSpike.data();
+	uint8_t* slowBeforeSpikeBeforeSlow = velocityHistory.slowBeforeSpikeBeforeSlow.data();
+	uint8_t* notReleasing = velocityHistory.notReleasing.data();
+	key_velocity* velocity = velocities.data();
+	// two branchless passes, with a local count (the stores below could
+	// alias numKeys), so that both vectorize
+	const unsigned int count = numKeys;
+	// the same velocity findKeyPressStart() and findKeyReleaseStart() used
+	// to compute for each sample they went through
+	for(unsigned int n = 0; n < count; ++n)
+	{
+		key_position diffPosition = (key_position)frame[n] - (key_position)olderFrame[n];
+		velocity[n] = calculate_key_velocity(diffPosition, diffTimestamp);
+	}
+	for(unsigned int n = 0; n < count; ++n)
+	{
+		uint8_t slowAge = slow[n] + (slow[n] < kMaxAge);
+		uint8_t slowBeforeSpikeAge = slowBeforeSpike[n] + (slowBeforeSpike[n] < kMaxAge);
+		uint8_t slowBeforeSpikeBeforeSlowAge = slowBeforeSpikeBeforeSlow[n] + (slowBeforeSpikeBeforeSlow[n] < kMaxAge);
+		uint8_t notReleasingAge = notReleasing[n] + (notReleasing[n] < kMaxAge);
+		if(velocity[n] > kPositionTrackerStartVelocitySpikeThreshold)
+			slowBeforeSpikeAge = slowAge;
+		if(velocity[n] < kPositionTrackerStartVelocityThreshold)
+		{
+			slowAge = 0;
+			slowBeforeSpikeBeforeSlowAge = slowBeforeSpikeAge;
+		}
+		if(velocity[n] > kPositionTrackerReleaseVelocityThreshold)
+			notReleasingAge = 0;
+		slow[n] = slowAge;
+		slowBeforeSpike[n] = slowBeforeSpikeAge;
+		slowBeforeSpikeBeforeSlow[n] = slowBeforeSpikeBeforeSlowAge;
+		notReleasing[n] = notReleasingAge;
+	}
 }
 
 const std::array<std::string, KeyPositionTrackerNotification::kNotificationTypeNewMaximum + 1> KeyPositionTrackerNotification::desc = {{
@@ -102,14 +164,14 @@ KeyPositionTracker::KeyPositionTracker(capacity_type capacity, /*Node<key_positi
 }*/
 
 // Calculate (MIDI-style) key press velocity from continuous key position
-std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity() {
+std::pair<frame_type, key_velocity> KeyPositionTracker::pressVelocity() {
     return pressVelocity(pressVelocityEscapementPosition_);
 }
 
-std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity(key_position escapementPosition) {
+std::pair<frame_type, key_velocity> KeyPositionTracker::pressVelocity(key_position escapementPosition) {
     // Check that we have a valid start point from which to calculate
-    if(missing_value<timestamp_type>::isMissing(startTimestamp_)) {
-        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+    if(missing_value<frame_type>::isMissing(startTimestamp_)) {
+        return std::pair<frame_type, key_velocity>(missing_value<frame_type>::missing(),
                                                        missing_value<key_velocity>::missing());
     }
     
@@ -126,32 +188,32 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity(key_po
         if(keyBuffer_[index] > escapementPosition) {
             // Found the place the position crosses the indicated threshold
             // Now find the exact (interpolated) timestamp and velocity
-            timestamp_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
+            frame_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
             
             // Velocity is calculated by an average of 2 samples before and 1 after
             key_position diffPosition = keyBuffer_[index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement] - keyBuffer_[index - 2];
-            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
+            frame_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
             key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
             
-            return std::pair<timestamp_type, key_velocity>(exactPressTimestamp, velocity);
+            return std::pair<frame_type, key_velocity>(exactPressTimestamp, velocity);
         }
         index++;
     }
     
     // Didn't find anything matching that threshold
-    return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+    return std::pair<frame_type, key_velocity>(missing_value<frame_type>::missing(),
                                                    missing_value<key_velocity>::missing());
 }
 
 // Calculate (MIDI-style) key release velocity from continuous key position
-std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity() {
+std::pair<frame_type, key_velocity> KeyPositionTracker::releaseVelocity() {
     return releaseVelocity(releaseVelocityEscapementPosition_);
 }
 
-std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_position returnPosition) {
+std::pair<frame_type, key_velocity> KeyPositionTracker::releaseVelocity(key_position returnPosition) {
     // Check that we have a valid start point from which to calculate
-    if(missing_value<timestamp_type>::isMissing(releaseBeginTimestamp_)) {
-        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+    if(missing_value<frame_type>::isMissing(releaseBeginTimestamp_)) {
+        return std::pair<frame_type, key_velocity>(missing_value<frame_type>::missing(),
                                                        missing_value<key_velocity>::missing());
     }
     
@@ -169,107 +231,131 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_
         if(keyBuffer_[index] < returnPosition) {
             // Found the place the position crosses the indicated threshold
             // Now find the exact (interpolated) timestamp and velocity
-            timestamp_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
+            frame_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
             
             // Velocity is calculated by an average of 2 samples before and 1 after
             key_position diffPosition = keyBuffer_[index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement] - keyBuffer_[index - 2];
-            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
+            frame_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
             key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
             
             //std::cout << "found release velocity " << velocity << "(diffp " << diffPosition << ", diffT " << diffTimestamp << ")" << std::endl;
             
-            return std::pair<timestamp_type, key_velocity>(exactPressTimestamp, velocity);
+            return std::pair<frame_type, key_velocity>(exactPressTimestamp, velocity);
         }
         index++;
     }
     
     // Didn't find anything matching that threshold
-    return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+    return std::pair<frame_type, key_velocity>(missing_value<frame_type>::missing(),
                                                    missing_value<key_velocity>::missing());
 }
 
 const int kSamplesNeededForPercussiveness = 6;
+// Samples that go into the percussiveness features: the one at which they
+// are scheduled and the kSamplesNeededForPercussiveness that follow
+const unsigned int kSamplesInPercussivenessWindow = kSamplesNeededForPercussiveness + 1;
+
+void KeyPositionTracker::PercussivenessAccumulator::reset() {
+    samples = 0;
+    maximumVelocity = scale_key_velocity(0);
+    maximumVelocityOffset = 0;
+    largestVelocityDifference = scale_key_velocity(0);
+    largestVelocityDifferenceOffset = 0;
+    area = areaSinceMaximum = scale_key_velocity(0);
+    areaPrecedingSpike = areaFollowingSpike = scale_key_velocity(0);
+}
+
+void KeyPositionTracker::PercussivenessAccumulator::add(key_velocity velocity) {
+    // Look for maximum of velocity. The rebound found so far, if any, now
+    // precedes the maximum and there is no area following it
+    if(velocity > maximumVelocity) {
+        maximumVelocity = velocity;
+        maximumVelocityOffset = samples;
+        areaPrecedingSpike = area;
+        areaSinceMaximum = areaFollowingSpike = scale_key_velocity(0);
+    }
+    
+    // And given the difference between the max and the current sample,
+    // look for the largest rebound (velocity hitting a peak and falling)
+    if(maximumVelocity - velocity > largestVelocityDifference) {
+        largestVelocityDifference = maximumVelocity - velocity;
+        largestVelocityDifferenceOffset = samples;
+        areaFollowingSpike = areaSinceMaximum;
+    }
+    
+    area += velocity;
+    areaSinceMaximum += velocity;
+    ++samples;
+}
+
+key_velocity KeyPositionTracker::velocityAt(key_buffer_index index) {
+    key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
+    frame_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
+    return calculate_key_velocity(diffPosition, diffTimestamp);
+}
+
+// Called on every sample while percussiveness is pending, so that the
+// features are ready by the time they become available
+void KeyPositionTracker::accumulatePercussiveness() {
+    PercussivenessAccumulator& accumulator = percussivenessAccumulator_;
+    if(accumulator.samples >= kSamplesInPercussivenessWindow) {
+        // The window has moved past the samples we have: pressPercussiveness() will rescan
+        accumulator.samples = kSamplesInPercussivenessWindow + 1;
+        return;
+    }
+    accumulator.add(velocityAt(keyBuffer_.endIndex() - 1));
+}
+
 // Calculate and return features about the percussiveness of the key press
 KeyPositionTracker::PercussivenessFeatures KeyPositionTracker::pressPercussiveness() {
     PercussivenessFeatures features;
     features.hasBeenRead = false;
-    key_buffer_index index;
-    key_velocity maximumVelocity, largestVelocityDifference;
-    key_buffer_index maximumVelocityIndex, largestVelocityDifferenceIndex;
     
-    startIndex_ = keyBuffer_.endIndex() - kSamplesNeededForPercussiveness - 1;
+    startIndex_ = keyBuffer_.endIndex() - kSamplesInPercussivenessWindow;
     // Check that we have a valid start point from which to calculate
-    if(missing_value<timestamp_type>::isMissing(startTimestamp_) || keyBuffer_.beginIndex() > startIndex_ - 1) {
+    if(missing_value<frame_type>::isMissing(startTimestamp_) || keyBuffer_.beginIndex() > startIndex_ - 1) {
         //std::cout << "*** no start time\n";
         features.percussiveness = missing_value<float>::missing();
         return features;
     }
     
-    // From the start of the key press, look for an initial maximum in velocity
-    index = startIndex_;
-    
-    maximumVelocity = scale_key_velocity(0);
-    maximumVelocityIndex = startIndex_;
-    largestVelocityDifference = scale_key_velocity(0);
-    largestVelocityDifferenceIndex = startIndex_;
-    
     //std::cout << "*** start index " << index << std::endl;
-    if(gPrint > 1)
-    	rt_printf("*** start index %d\n", index);
-
+    traceAt<2>(kTracePressStart, key_, startIndex_);
     
-    while(index < keyBuffer_.endIndex()) {
-        if(pressIndex_ != 0 && index >= pressIndex_)
-            break;
-        
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        // Look for maximum of velocity
-        if(velocity > maximumVelocity) {
-            maximumVelocity = velocity;
-            maximumVelocityIndex = index;
-            //std::cout << "*** found new max velocity " << maximumVelocity << " at index " << index << std::endl;
-	    if(gPrint > 1)
-                rt_printf("*** found new max velocity %f at index %u\n", maximumVelocity, index);
+    // From the start of the key press, look for an initial maximum in
+    // velocity. Normally the samples from startIndex_ onwards were
+    // accumulated as they arrived; go through the buffer again if the
+    // features are read at a different time, or if the press completed
+    // within the window, as the search stops there.
+    PercussivenessAccumulator& accumulator = percussivenessAccumulator_;
+    if(accumulator.samples != kSamplesInPercussivenessWindow
+       || (pressIndex_ != 0 && pressIndex_ < keyBuffer_.endIndex())) {
+        accumulator.reset();
+        for(key_buffer_index index = startIndex_; index < keyBuffer_.endIndex(); index++) {
+            if(pressIndex_ != 0 && index >= pressIndex_)
+                break;
+            accumulator.add(velocityAt(index));
         }
-        
-        // And given the difference between the max and the current sample,
-        // look for the largest rebound (velocity hitting a peak and falling)
-        if(maximumVelocity - velocity > largestVelocityDifference) {
-            largestVelocityDifference = maximumVelocity - velocity;
-            largestVelocityDifferenceIndex = index;
-
-            //std::cout << "*** found new diff velocity " << largestVelocityDifference << " at index " << index << std::endl;
-	    if(gPrint > 1)
-		    rt_printf("*** found new diff velocity %f at index %u\n", largestVelocityDifference, index);
-        }
-        
-        // Only look at the early part of the key press: if the key position
-        // makes it more than a certain amount down, assume the initial spike
-        // has passed and finish up. But always allow at least 5 points for the
-        // fastest key presses to be considered.
-        //if(index - startIndex_ >= 4 && keyBuffer_[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation) {
-		//rt_printf("dafuck %d\n", index-startIndex_);
-            //break;
-        //}
-        
-        index++;
     }
+    key_velocity maximumVelocity = accumulator.maximumVelocity;
+    key_velocity largestVelocityDifference = accumulator.largestVelocityDifference;
+    key_buffer_index maximumVelocityIndex = startIndex_ + accumulator.maximumVelocityOffset;
+    key_buffer_index largestVelocityDifferenceIndex = startIndex_ + accumulator.largestVelocityDifferenceOffset;
+    traceAt<2>(kTraceVelocitySpike, key_, maximumVelocityIndex, key_velocity_to_float(maximumVelocity),
+            key_velocity_to_float(largestVelocityDifference));
 
 	bool notPercussive = false;
     if(maximumVelocity < kPositionTrackerMaxVelocityPercussiveThreshold)
     {
 	    notPercussive = true;
-	    rt_printf("notPercussive ");
+	    trace<1>(kTraceNotPercussive, key_, key_velocity_to_float(maximumVelocity));
     }
     // Now transfer what we've found to the data structure
     features.velocitySpikeMaximum = Event(maximumVelocityIndex, maximumVelocity, keyBuffer_.timestampAt(maximumVelocityIndex));
     features.velocitySpikeMinimum = Event(largestVelocityDifferenceIndex, maximumVelocity - largestVelocityDifference,
                                           keyBuffer_.timestampAt(largestVelocityDifferenceIndex));
     features.timeFromStartToSpike = keyBuffer_.timestampAt(maximumVelocityIndex) - keyBuffer_.timestampAt(startIndex_);
-    features.velocityAverageAroundSpike = (2.f * maximumVelocity - largestVelocityDifference) / 2;
+    features.velocityAverageAroundSpike = key_velocity_to_float((2.f * maximumVelocity - largestVelocityDifference) / 2);
     
     // Check if we found a meaningful difference. If not, percussiveness is set to 0
     if(largestVelocityDifference == scale_key_velocity(0)
@@ -278,31 +364,21 @@ KeyPositionTracker::PercussivenessFeatures KeyPositionTracker::pressPercussivene
         features.percussiveness = 0.0;
         features.areaPrecedingSpike = scale_key_velocity(0);
         features.areaFollowingSpike = scale_key_velocity(0);
-	    gPercussed = 1;
+	    percussed_ = 1;
         return features;
     } else {
-	    gPercussed = -1;
+	    percussed_ = -1;
     }
     
-    // Calculate the area under the velocity curve before and after the maximum
-    features.areaPrecedingSpike = scale_key_velocity(0);
-    for(index = startIndex_; index < maximumVelocityIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaPrecedingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
-    features.areaFollowingSpike = scale_key_velocity(0);
-    for(index = maximumVelocityIndex; index < largestVelocityDifferenceIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaFollowingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
+    // The area under the velocity curve before and after the maximum
+    features.areaPrecedingSpike = accumulator.areaPrecedingSpike;
+    features.areaFollowingSpike = accumulator.areaFollowingSpike;
     
     //std::cout << "area before = " << features.areaPrecedingSpike << " after = " << features.areaFollowingSpike << std::endl;
-    if(gPrint > 1)
-    	rt_printf("area before = %f , after = %f\n", features.areaPrecedingSpike, features.areaFollowingSpike);
+    trace<2>(kTraceSpikeArea, key_, key_velocity_to_float(features.areaPrecedingSpike), key_velocity_to_float(features.areaFollowingSpike));
     
-    features.percussiveness = features.velocitySpikeMaximum.position;
+    // velocitySpikeMaximum.position holds a velocity
+    features.percussiveness = key_velocity_to_float(features.velocitySpikeMaximum.position);
     
     return features;
 }
@@ -333,35 +409,35 @@ void KeyPositionTracker::reset() {
 	//Node<KeyPositionTrackerNotification>::clear();
 	empty_ = true; // kind of equivalent to clear() above if we are not a circular buffer. This should be unset by "insert"
     
+    trace<1>(kTraceReset, key_, currentState_);
     currentState_ = kPositionTrackerStateUnknown;
-    rt_fprintf(stderr, "\n%d %s\n", currentState_, statesDesc[currentState_].c_str());
     currentlyAvailableFeatures_ = KeyPositionTrackerNotification::kFeaturesNone;
     currentMinIndex_ = currentMaxIndex_ = startIndex_ = pressIndex_ = 0;
     releaseBeginIndex_ = releaseEndIndex_ = 0;
     lastMinMaxPosition_ = startPosition_ = pressPosition_ = missing_value<key_position>::missing();
     releaseBeginPosition_ = releaseEndPosition_ = missing_value<key_position>::missing();
     currentMinPosition_ = currentMaxPosition_ = missing_value<key_position>::missing();
-    startTimestamp_ = pressTimestamp_ = missing_value<timestamp_type>::missing();
-    currentMinTimestamp_ = currentMaxTimestamp_ = missing_value<timestamp_type>::missing();
-    releaseBeginTimestamp_ = releaseEndTimestamp_ = missing_value<timestamp_type>::missing();
+    startTimestamp_ = pressTimestamp_ = missing_value<frame_type>::missing();
+    currentMinTimestamp_ = currentMaxTimestamp_ = missing_value<frame_type>::missing();
+    releaseBeginTimestamp_ = releaseEndTimestamp_ = missing_value<frame_type>::missing();
     pressVelocityEscapementPosition_ = kPositionTrackerDefaultPositionForPressVelocityCalculation;
     releaseVelocityEscapementPosition_ = kPositionTrackerDefaultPositionForReleaseVelocityCalculation;
     pressVelocityAvailableIndex_ = releaseVelocityAvailableIndex_ = percussivenessAvailableIndex_ = 0;
+    percussivenessAccumulator_.reset();
     releaseVelocityWaitingForThresholdCross_ = false;
     releaseMaxPosition_ = missing_value<key_position>::missing();
-    releaseMaxTimestamp_  = missing_value<timestamp_type>::missing();
+    releaseMaxTimestamp_  = missing_value<frame_type>::missing();
 }
 
 // Evaluator function. Update the current state
-void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type timestamp) {
-	gPercussed = 0;
+void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ frame_type timestamp) {
+	percussed_ = 0;
 
 	//if(who != &keyBuffer_)
 		//return;
     
     key_position currentKeyPosition = keyBuffer_.latest();
 
-#define kDefaultKeyIdleThreshold (scale_key_position(0.03))
     if(kPositionTrackerStateReleaseFinished == currentState_)
     {
         // account for bounces: following key release we may have
@@ -369,7 +445,7 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
         // we set a dynamic threshold to be always slightly above the
         // latest max (due to the latest oscillation), or - if there is
         // no bounce, or enough time has passed - a fixed threshold
-        timestamp_type refTimestamp;
+        frame_type refTimestamp;
         key_position thresholdMagnitude;
         if(missing_value<key_position>::isMissing(releaseMaxPosition_))
         {
@@ -381,8 +457,11 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
             thresholdMagnitude = releaseMaxPosition_ + kPositionTrackerReleaseMaxysteresis;
             refTimestamp = releaseMaxTimestamp_;
         }
-        float decay = 0.4;
-        thresholdMagnitude *= 1.f - (timestamp - refTimestamp)/decay;
+        // decay linearly to 0, in integer frames. Once at 0 the threshold is
+        // below kPositionTrackerReleaseMinDynamicOnsetThreshold anyhow
+        const frame_diff_type decay = kPositionTrackerReleaseOnsetThresholdDecay;
+        frame_diff_type remaining = std::max<frame_diff_type>(0, decay - (frame_diff_type)(timestamp - refTimestamp));
+        thresholdMagnitude = thresholdMagnitude * remaining / decay;
         dynamicOnsetThreshold_ = thresholdMagnitude;
 	bool shouldReset = false;
 	if(dynamicOnsetThreshold_ < kPositionTrackerReleaseMinDynamicOnsetThreshold)
@@ -390,10 +469,10 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
 		// the latest max was small enough: the bouncing oscillation
 		// has probably ended.
 		// Let's just check if we are back to the rest position:
-		if(currentKeyPosition < kDefaultKeyIdleThreshold)
+		if(currentKeyPosition < kPositionTrackerBackToIdleThreshold)
 		{
 			shouldReset = true;
-			rt_fprintf(stderr, "key back to idle\n");
+			traceAt<1>(kTraceBackToIdle, key_, timestamp, key_position_to_float(currentKeyPosition));
 		}
 	} else {
 		// we are still bouncing
@@ -403,7 +482,7 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
 			// press must have started
 		    // this really seems like a brand new key press: the
 		    // old one is done and we reset the state machine
-		    rt_fprintf(stderr, "key restarting\n");
+		    traceAt<1>(kTraceRestart, key_, timestamp, key_position_to_float(currentKeyPosition), key_position_to_float(dynamicOnsetThreshold_));
 		    shouldReset = true;
 		}
 	}
@@ -421,7 +500,6 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
 		changeState(kPositionTrackerStatePartialPressAwaitingMax, timestamp);
 	    } else {
 		    if(kPositionTrackerStateUnknown != currentState_) {
-			    rt_printf("unknown\n");
 			    changeState(kPositionTrackerStateUnknown, timestamp);
 		    }
 	    }
@@ -444,21 +522,13 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
 
 
 	//std::cout << timestamp << ": " << currentKeyPosition << "\n";
-    if(currentState_ == kPositionTrackerStatePressInProgress)
-    {
-	if(gPrint > 4)
-	{
-		std::cout << "o" << timestamp << ": " << currentKeyPosition << "\n";
-	}
-    } else 
-    {
-	if(gPrint > 4)
-	{
-		std::cout << "_" << timestamp << ": " << currentKeyPosition << "\n";
-	}
-    }
+    traceAt<3>(kTraceSample, key_, timestamp, key_position_to_float(currentKeyPosition),
+            currentState_ == kPositionTrackerStatePressInProgress);
     key_buffer_index currentBufferIndex = keyBuffer_.endIndex() - 1;
     
+    if(percussivenessAvailableIndex_ != 0)
+        accumulatePercussiveness();
+    
     // First, check queued actions to see if we can calculate a new feature
     // ** Press Velocity **
     if(pressVelocityAvailableIndex_ != 0) {
@@ -498,20 +568,20 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
     if(currentState_ == kPositionTrackerStatePartialPressAwaitingMax ||
        currentState_ == kPositionTrackerStatePartialPressFoundMax) {
         // These are collectively the pre-press states
-        if(currentKeyPosition >= kPositionTrackerPressPosition + kPositionTrackerPressHysteresis) {
+        if(currentKeyPosition >= kPositionTrackerPressOnThreshold) {
 		//rt_printf("%f statepressin progress from partial\n", timestamp);
             // Key has gone far enough down to be considered pressed, but hasn't necessarily
             // made it down yet.
             pressIndex_ = 0;
             pressPosition_ = missing_value<key_position>::missing();
-            pressTimestamp_ = missing_value<timestamp_type>::missing();
+            pressTimestamp_ = missing_value<frame_type>::missing();
             
             changeState(kPositionTrackerStatePressInProgress, timestamp);
         }
     }
     else if(currentState_ == kPositionTrackerStateReleaseInProgress ||
             currentState_ == kPositionTrackerStateReleaseFinished) {
-        if(currentKeyPosition >= kPositionTrackerPressPosition + kPositionTrackerPressHysteresis) {
+        if(currentKeyPosition >= kPositionTrackerPressOnThreshold) {
 		//rt_printf("%f statepressin progress\n", timestamp);
             // Key was releasing but is now back down. Need to reprime the start
             // position information, which will be taken as the last minimum.
@@ -520,14 +590,14 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
             startTimestamp_ = currentMinTimestamp_;
             pressIndex_ = 0;
             pressPosition_ = missing_value<key_position>::missing();
-            pressTimestamp_ = missing_value<timestamp_type>::missing();
+            pressTimestamp_ = missing_value<frame_type>::missing();
             
             changeState(kPositionTrackerStatePressInProgress, timestamp);
         }
     }
     else if(currentState_ == kPositionTrackerStatePressInProgress) {
         // Press has started, wait to find its max position before labeling the key as "down"
-        if(currentKeyPosition < kPositionTrackerPressPosition - kPositionTrackerPressHysteresis) {
+        if(currentKeyPosition < kPositionTrackerPressOffThreshold) {
             // Key is on its way back up: find where release began
             findKeyReleaseStart(timestamp);
 
@@ -535,7 +605,7 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
         }
     }
     else if(currentState_ == kPositionTrackerStateDown) {
-        if(currentKeyPosition < kPositionTrackerPressPosition - kPositionTrackerPressHysteresis) {
+        if(currentKeyPosition < kPositionTrackerPressOffThreshold) {
             // Key is on its way back up: find where release began
             findKeyReleaseStart(timestamp);
             
@@ -572,8 +642,8 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
         if(currentMaxPosition_ - lastMinMaxPosition_ >= kPositionTrackerMinMaxSpacingThreshold && currentBufferIndex != currentMaxIndex_) {
             // We need to come down off the current maximum before we can be sure that we've found the right location.
             // Implement a sliding threshold that gets lower the farther away from the maximum we get
-            key_position triggerThreshold = kPositionTrackerMinMaxSpacingThreshold / (key_position)(currentBufferIndex - currentMaxIndex_);
-	    gMaxThreshold = currentMaxPosition_ - triggerThreshold;
+            key_position triggerThreshold = divide_key_position(kPositionTrackerMinMaxSpacing, currentBufferIndex - currentMaxIndex_);
+	    maxThreshold_ = currentMaxPosition_ - triggerThreshold;
             
             if(currentKeyPosition < currentMaxPosition_ - triggerThreshold) {
                 // Found the local maximum and the position has already retreated from it
@@ -589,24 +659,26 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
                     
                     // Insert the state change into the buffer timestamped according to
                     // when the maximum arrived, unless that would put it earlier than what's already there
-                    timestamp_type stateChangeTimestamp = latestTimestamp() > currentMaxTimestamp_ ? latestTimestamp() : currentMaxTimestamp_;
+                    frame_type stateChangeTimestamp = latestTimestamp() > currentMaxTimestamp_ ? latestTimestamp() : currentMaxTimestamp_;
                     changeState(kPositionTrackerStateDown, stateChangeTimestamp);
                 }
                 else if(currentState_ == kPositionTrackerStatePartialPressAwaitingMax) {
                     // Otherwise if we were waiting for a maximum to occur that was
                     // short of a full press, this might be it if it is of sufficient size
-			//gPercussed = 1.0;
+			//percussed_ = 1.0;
                     if(currentMaxPosition_ >= kPositionTrackerFirstMaxThreshold
 				    ) {
-			    //gPercussed = 0.75;
+			    //percussed_ = 0.75;
 			key_velocity diffPosition = keyBuffer_[currentMaxIndex_ - 1] - keyBuffer_[currentMaxIndex_ - 2];
-			timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(currentMaxIndex_ - 1) - keyBuffer_.timestampAt(currentMaxIndex_ - 2);
+			frame_diff_type diffTimestamp = keyBuffer_.timestampAt(currentMaxIndex_ - 1) - keyBuffer_.timestampAt(currentMaxIndex_ - 2);
 			key_velocity instantaneousVelocity = calculate_key_velocity(diffPosition, diffTimestamp);
 			if(instantaneousVelocity > kPositionTrackerPeakInstantaneousVelocityMinThreshold)
 			{
-				//gPercussed = 0.5;
+				//percussed_ = 0.5;
 				percussivenessAvailableIndex_ = currentBufferIndex + kSamplesNeededForPercussiveness;
-				timestamp_type stateChangeTimestamp = latestTimestamp() > currentMaxTimestamp_ ? latestTimestamp() : currentMaxTimestamp_;
+				percussivenessAccumulator_.reset();
+				accumulatePercussiveness();
+				frame_type stateChangeTimestamp = latestTimestamp() > currentMaxTimestamp_ ? latestTimestamp() : currentMaxTimestamp_;
 				changeState(kPositionTrackerStatePartialPressFoundMax, stateChangeTimestamp);
 			}
                     } else {
@@ -633,9 +705,9 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
         if(lastMinMaxPosition_ - currentMinPosition_ >= kPositionTrackerMinMaxSpacingThreshold && currentBufferIndex != currentMinIndex_) {
             // We need to come up from the current minimum before we can be sure that we've found the right location.
             // Implement a sliding threshold that gets lower the farther away from the minimum we get
-            key_position triggerThreshold = kPositionTrackerMinMaxSpacingThreshold / (key_position)(currentBufferIndex - currentMinIndex_);
+            key_position triggerThreshold = divide_key_position(kPositionTrackerMinMaxSpacing, currentBufferIndex - currentMinIndex_);
 
-	    gMinThreshold = currentMinPosition_ + triggerThreshold;
+	    minThreshold_ = currentMinPosition_ + triggerThreshold;
             if(currentKeyPosition > currentMinPosition_ + triggerThreshold) {
                 // Found the local minimum and the position has already retreated from it
                 lastMinMaxPosition_ = currentMinPosition_;
@@ -655,7 +727,7 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
                         releaseEndPosition_ = currentMinPosition_;
                         releaseEndTimestamp_ = currentMinTimestamp_;
                         
-                        timestamp_type stateChangeTimestamp = latestTimestamp() > currentMinTimestamp_ ? latestTimestamp() : currentMinTimestamp_;
+                        frame_type stateChangeTimestamp = latestTimestamp() > currentMinTimestamp_ ? latestTimestamp() : currentMinTimestamp_;
                         changeState(kPositionTrackerStateReleaseFinished, stateChangeTimestamp);
                     }
                 }
@@ -667,28 +739,30 @@ void KeyPositionTracker::triggerReceived(/*TriggerSource* who,*/ timestamp_type
             }
         }
     }
-    static float oldPosition = currentKeyPosition;
-    static float oldVelocity = 0;
-    float velocity = currentKeyPosition - oldPosition;
-oldPosition = currentKeyPosition;
-float acc = velocity - oldVelocity;
-oldVelocity = velocity;
+#ifndef HOST_BUILD
+    // Scope is not thread-safe: skipped when KeyboardTracker shards the keys
+    if(!scopeLogging_)
+        return;
+    float velocity = key_position_to_float(currentKeyPosition) - oldPosition_;
+oldPosition_ = key_position_to_float(currentKeyPosition);
+float acc = velocity - oldVelocity_;
+oldVelocity_ = velocity;
 float percVelThreshold = 1.3;
 float newPerc = percussivenessFeatures_.percussiveness;
 float avVel = percussivenessFeatures_.velocityAverageAroundSpike;
     float myArr[] = {
-	    currentKeyPosition, //1 red
-	    gPercussed*0.5f, //2 blue
+	    key_position_to_float(currentKeyPosition), //1 red
+	    percussed_*0.5f, //2 blue
              velocity, // 3 green
 	    currentState_/(float)kPositionTrackerStateReleaseFinished, //4 pink
-	     currentMaxPosition_, // 5 light blue
+	     key_position_to_float(currentMaxPosition_), // 5 light blue
 	     acc, // 6 purple
-	     releaseMaxPosition_, //7 red
+	     key_position_to_float(releaseMaxPosition_), //7 red
 	     percussivenessFeatures_.percussiveness // 8 blue
 	    //lastMinMaxPosition_, //2 blue
 	    //currentMaxPosition_, //3 green
 	    //currentMinPosition_, //5 light blue
-	    //gMaxThreshold, //6 purple
+	    //maxThreshold_, //6 purple
 	     //-newPerc/avVel, //10 heavy pink
 	     //newPerc / avVel > percVelThreshold ? -2.f*newPerc : 0 // 10 heavy pink
     };
@@ -698,16 +772,17 @@ float avVel = percussivenessFeatures_.velocityAverageAroundSpike;
     }
     myArr[3] = currentState_/(float)kPositionTrackerStateReleaseFinished;
     scope.log(myArr);
+#endif /* HOST_BUILD */
 }
 
 // Change the current state of the tracker and generate a notification
-void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
+void KeyPositionTracker::changeState(int newState, frame_type timestamp) {
     KeyPositionTracker::key_buffer_index index;
     KeyPositionTracker::key_buffer_index mostRecentIndex = 0;
     
     if(keyBuffer_.empty())
         mostRecentIndex = keyBuffer_.endIndex() - 1;
-    rt_fprintf(stderr, "%d %s\n", newState, statesDesc[newState].c_str());
+    traceAt<1>(kTraceStateChange, key_, timestamp, newState);
     
     // Manage features based on state
     switch(newState) {
@@ -732,7 +807,7 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
             // we need to calculate velocity?
             index = findMostRecentKeyPositionCrossing(pressVelocityEscapementPosition_, false, 1000);
             if(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement <= mostRecentIndex) {
-		    std::cout << "NOOOOOOOOOOOOO\n";
+		    traceAt<1>(kTraceVelocityAvailable, key_, index);
                 // Here, we already have the velocity information
                 currentlyAvailableFeatures_ |= KeyPositionTrackerNotification::kFeaturePressVelocity;
                 notifyFeature(KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity, timestamp);
@@ -784,7 +859,7 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
 }
 
 // Notify listeners that a given feature has become available
-void KeyPositionTracker::notifyFeature(int notificationType, timestamp_type timestamp) {
+void KeyPositionTracker::notifyFeature(int notificationType, frame_type timestamp) {
     // Can now calculate press velocity
     KeyPositionTrackerNotification notification;
     
@@ -798,26 +873,20 @@ void KeyPositionTracker::notifyFeature(int notificationType, timestamp_type time
 // When starting from a blank state, retroactively locate
 // the start of the key press so it can be used to calculate
 // features of key motion
-void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
+void KeyPositionTracker::findKeyPressStart(frame_type timestamp) {
     if(keyBuffer_.size() < kPositionTrackerSamplesToAverageForStartVelocity + 1)
         return;
     
-    key_buffer_index index = keyBuffer_.endIndex() - 1;
-    int searchBackCounter = 0;
-    
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchForStartLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        if(velocity < kPositionTrackerStartVelocityThreshold) {
-            break;
-        }
-        
-        searchBackCounter++;
-        index--;
-    }
+    // The N-sample velocity of each sample was compared to the thresholds as it
+    // arrived (see KeyBuffers::VelocityHistory): look up the most recent sample
+    // within the search period whose velocity is below the minimum threshold.
+    const KeyBuffers::VelocityHistory& history = keyBuffer_.velocityHistory();
+    ssize_t latestIndex = keyBuffer_.endIndex() - 1;
+    ssize_t lowestIndex = keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity;
+    ssize_t searchFrom = std::max(lowestIndex, latestIndex - kPositionTrackerSamplesToSearchForStartLocation);
+    ssize_t slowIndex = keyBuffer_.indexOfAge(history.slow);
+    bool haveFoundMinimumVelocity = slowIndex >= searchFrom;
+    key_buffer_index index = haveFoundMinimumVelocity ? slowIndex : searchFrom - 1;
     
     // Having either found the minimum velocity or reached the beginning of the search period,
     // store the key start information. Since the velocity is calculated over a window, choose
@@ -831,30 +900,41 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
     // After saving that information, look further back for a specified number of samples to see if there
     // is another mini-spike at the beginning of the key press. This can happen with highly percussive presses.
     // If so, the start is actually the earlier time.
+    bool haveFoundNewMinimum = false;
     
-    // Leave index where it was...
-    searchBackCounter = 0;
-    bool haveFoundVelocitySpike = false, haveFoundNewMinimum = false;
-    
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchBeyondStartLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        if(velocity > kPositionTrackerStartVelocitySpikeThreshold) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
-            haveFoundVelocitySpike = true;
-        }
-        
-        if(velocity < kPositionTrackerStartVelocityThreshold && haveFoundVelocitySpike) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
+    if(haveFoundMinimumVelocity) {
+        // Going back from index, the first spike is the latest one before it, and
+        // the new minimum is the latest sample below the threshold before that spike
+        ssize_t minimumIndex = keyBuffer_.indexOfAge(history.slowBeforeSpikeBeforeSlow);
+        if(minimumIndex >= std::max(lowestIndex, (ssize_t)index - kPositionTrackerSamplesToSearchBeyondStartLocation)) {
+            index = minimumIndex;
             haveFoundNewMinimum = true;
-            break;
         }
+    } else {
+        // The history only covers the samples before the latest slow one: search
+        // back from the beginning of the search period. This only happens after
+        // a long stretch of fast motion.
+        int searchBackCounter = 0;
+        bool haveFoundVelocitySpike = false;
         
-        searchBackCounter++;
-        index--;
+        while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchBeyondStartLocation) {
+            // Take the N-sample velocity average and compare to a minimum threshold
+            key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
+            frame_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
+            key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+            
+            if(velocity > kPositionTrackerStartVelocitySpikeThreshold) {
+                haveFoundVelocitySpike = true;
+            }
+            
+            if(velocity < kPositionTrackerStartVelocityThreshold && haveFoundVelocitySpike) {
+                haveFoundNewMinimum = true;
+                break;
+            }
+            
+            searchBackCounter++;
+            index--;
+        }
     }
     
     if(haveFoundNewMinimum) {
@@ -862,35 +942,25 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
         startIndex_ = index - kPositionTrackerSamplesToAverageForStartVelocity/2;
         startPosition_ = keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity/2];
         startTimestamp_ = keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity/2);
-rt_printf("haveFoundNewMinimum resets lastMinMaxPosition_: %f (was %f)\n", startPosition_, lastMinMaxPosition_);
+        trace<1>(kTraceNewMinimum, key_, key_position_to_float(startPosition_), key_position_to_float(lastMinMaxPosition_));
         lastMinMaxPosition_ = startPosition_;
         
-        std::cout << "Found previous location\n";
+        traceAt<1>(kTracePreviousLocation, key_, index);
     }
 }
 
 // When a key is released, retroactively locate where the release started
-void KeyPositionTracker::findKeyReleaseStart(timestamp_type timestamp) {
+void KeyPositionTracker::findKeyReleaseStart(frame_type timestamp) {
     if(keyBuffer_.size() < kPositionTrackerSamplesToAverageForStartVelocity + 1)
         return;
     
-    key_buffer_index index = keyBuffer_.endIndex() - 1;
-    int searchBackCounter = 0;
-    
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchForReleaseLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        if(velocity > kPositionTrackerReleaseVelocityThreshold) {
-            //std::cout << "Found release at index " << index << " (vel = " << velocity << ")\n";
-            break;
-        }
-        
-        searchBackCounter++;
-        index--;
-    }
+    // Look up the most recent sample within the search period whose N-sample
+    // velocity is above the release threshold (see KeyBuffers::VelocityHistory)
+    ssize_t latestIndex = keyBuffer_.endIndex() - 1;
+    ssize_t lowestIndex = keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity;
+    ssize_t searchFrom = std::max(lowestIndex, latestIndex - kPositionTrackerSamplesToSearchForReleaseLocation);
+    ssize_t notReleasingIndex = keyBuffer_.indexOfAge(keyBuffer_.velocityHistory().notReleasing);
+    key_buffer_index index = notReleasingIndex >= searchFrom ? notReleasingIndex : searchFrom - 1;
     
     // Having either found the minimum velocity or reached the beginning of the search period,
     // store the key release information.
@@ -903,7 +973,7 @@ void KeyPositionTracker::findKeyReleaseStart(timestamp_type timestamp) {
     // Clear the release end position so there's no possibility of an inconsistent state
     releaseEndIndex_ = 0;
     releaseEndPosition_ = missing_value<key_position>::missing();
-    releaseEndTimestamp_ = missing_value<timestamp_type>::missing();
+    releaseEndTimestamp_ = missing_value<frame_type>::missing();
 }
 
 // Find the index at which the key position crosses the given threshold. Returns 0 if not found.
@@ -935,7 +1005,7 @@ KeyPositionTracker::key_buffer_index KeyPositionTracker::findMostRecentKeyPositi
     return 0;
 }
 
-void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, timestamp_type timestamp) {
+void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, frame_type timestamp) {
     KeyPositionTracker::key_buffer_index index;
 
     // Find the sample where the key position crosses the release threshold. What is returned
@@ -962,31 +1032,28 @@ void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_b
         releaseVelocityWaitingForThresholdCross_ = false;
     }
 }
-void KeyPositionTracker::insert(KeyPositionTrackerNotification notification, timestamp_type timestamp)
+void KeyPositionTracker::insert(KeyPositionTrackerNotification notification, frame_type timestamp)
 {
 	empty_ = false;
-    //std::cout << "---Notification: " << KeyPositionTrackerNotification::desc[notification.type] << ", state: " << statesDesc[notification.state] << " at " << timestamp;
-    if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity)
-    {
-	    if(gPrint > 1)
-		    rt_printf("   v %7.5f\n", pressVelocity().second);
-    } else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailablePercussiveness)
-    {
+	notification.key = key_;
+	notification.timestamp = timestamp;
+	notification.velocity = missing_value<key_velocity>::missing();
+	notification.percussiveness = missing_value<float>::missing();
+	if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity)
+	{
+		notification.velocity = pressVelocity().second;
+	} else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableReleaseVelocity)
+	{
+		notification.velocity = releaseVelocity().second;
+	} else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailablePercussiveness)
+	{
 		percussivenessFeatures_ = pressPercussiveness();
-		auto& p = percussivenessFeatures_;
-		if(gPrint > 0) {
-			if(!missing_value<float>::isMissing(p.percussiveness)) {
-				rt_printf("p: %7.5f, ", p.percussiveness);
-				rt_printf("velspikemax: %10.5f, ", p.velocitySpikeMaximum.position);
-				rt_printf("velspikemin: %10.5f, ", p.velocitySpikeMinimum.position);
-				rt_printf("timeFromSTartToSpike: %10.5f, ", p.timeFromStartToSpike);
-				rt_printf("areaPrecedingSpike: %10.5f, ", p.areaPrecedingSpike);
-				rt_printf("areaFollowingSpike: %10.5f, ", p.areaFollowingSpike);
-				rt_printf("\n");
-			}
-		}
-    }
-    latestTimestamp_ = timestamp;
+		notification.percussiveness = percussivenessFeatures_.percussiveness;
+	}
+	// formatting and I/O are left to whoever drains the queue
+	if(notificationQueue_)
+		notificationQueue_->push(notification);
+	latestTimestamp_ = timestamp;
 }
 
 KeyPositionTracker::Event KeyPositionTracker::getPercussiveness()
@@ -995,12 +1062,12 @@ KeyPositionTracker::Event KeyPositionTracker::getPercussiveness()
 	if(percussivenessFeatures_.hasBeenRead == false && percussivenessFeatures_.percussiveness)
 	{
 		event = percussivenessFeatures_.velocitySpikeMaximum;
-		rt_printf("sharing percussivness: %f\n", event.position);
+		trace<1>(kTracePercussivenessRead, key_, key_velocity_to_float(event.position));
 		percussivenessFeatures_.hasBeenRead = true;
 	} else {
 		event.index = missing_value<key_buffer_index>::missing();
 		event.position = missing_value<key_position>::missing();
-		event.timestamp = missing_value<timestamp_type>::missing();
+		event.timestamp = missing_value<frame_type>::missing();
 	}
 	return event;
 }
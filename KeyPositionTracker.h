@@ -30,12 +30,20 @@
 //#include "../Utility/Node.h"
 //#include "../Utility/Accumulator.h"
 #include "PianoTypes.h"
+#include "SpscQueue.h"
 #include <array>
 #include <vector>
-#include <iostream>
+#include <string>
 
 typedef size_t capacity_type;
 
+// Round the length of KeyBuffers up to a power of two, so that KeyBuffer can
+// wrap its indices with a mask instead of a modulo. Define KEY_BUFFERS_MODULO
+// (e.g.: with -D) to keep the requested length and use a modulo instead.
+#ifndef KEY_BUFFERS_MODULO
+#define KEY_BUFFERS_POWER_OF_TWO
+#endif /* KEY_BUFFERS_MODULO */
+
 // Three states of idle detector
 enum {
 	kPositionTrackerStateUnknown = 0,
@@ -57,19 +65,39 @@ const std::array<std::string, kPositionTrackerStateReleaseFinished + 1> statesDe
     "kPositionTrackerStateReleaseFinished",
 }};
 
+// Timestamps are frames (see frame_type), and velocities are in positions
+// per frame. Time constants are given in frames at this scan rate.
+const unsigned int kKeyScanFrameRate = 1000;
+
+// Convert a frame to seconds, for presenting times outside of the tracker
+static inline double framesToSeconds(frame_type frame)
+{
+	return frame / (double)kKeyScanFrameRate;
+}
+
 // Constants for key state detection
 constexpr key_position kPositionTrackerPressPosition = scale_key_position(0.75);
 constexpr key_position kPositionTrackerPressHysteresis = scale_key_position(0.05);
-const key_position kPositionTrackerMinMaxSpacingThreshold = scale_key_position(0.002);
-const key_position kPositionTrackerFirstMaxThreshold = scale_key_position(0.02);
+// kPositionTrackerPressPosition +/- kPositionTrackerPressHysteresis, as
+// thresholds for the >= and < compares that enter and leave a press
+constexpr key_position kPositionTrackerPressOnThreshold = key_threshold_up(0.75 + 0.05);
+constexpr key_position kPositionTrackerPressOffThreshold = key_threshold_up(0.75 - 0.05);
+const key_position kPositionTrackerMinMaxSpacingThreshold = key_threshold_up(0.002);
+// The same spacing, divided down for the sliding threshold past a min or max
+const key_position kPositionTrackerMinMaxSpacing = key_threshold_down(0.002);
+const key_position kPositionTrackerFirstMaxThreshold = key_threshold_up(0.02);
 //const key_position kPositionTrackerFirstMaxThreshold = scale_key_position(0.02);
-const key_position kPositionTrackerReleaseFinishPosition = scale_key_position(0.2);
+const key_position kPositionTrackerReleaseFinishPosition = key_threshold_up(0.2);
 const key_position kPositionTrackerOnsetStartPositionMax = scale_key_position(0.3);
 constexpr float kPositionTrackerMaxCoefficientForNewPress = 1.1;
-const key_position kPositionTrackerReleaseMaxysteresis = scale_key_position(0.003);
-const key_position kPositionTrackerReleaseInitialMax = scale_key_position(0.4);
-const key_position kPositionTrackerReleaseMinDynamicOnsetThreshold = scale_key_position(0.02);
-const key_position kPositionTrackerPeakInstantaneousVelocityMinThreshold = scale_key_position(0.005);
+const key_position kPositionTrackerReleaseMaxysteresis = key_threshold_down(0.003);
+const key_position kPositionTrackerReleaseInitialMax = key_threshold_down(0.4);
+const key_position kPositionTrackerReleaseMinDynamicOnsetThreshold = key_threshold_up(0.02);
+const key_velocity kPositionTrackerPeakInstantaneousVelocityMinThreshold = scale_key_velocity(0.005);
+// Below this position a key is considered at rest. The second one is the
+// same position for < compares
+const key_position kDefaultKeyIdleThreshold = key_threshold_down(0.03);
+const key_position kPositionTrackerBackToIdleThreshold = key_threshold_up(0.03);
 
 // How far back to search at the beginning to find the real start or release of a key press
 const int kPositionTrackerSamplesToSearchForStartLocation = 50;
@@ -79,58 +107,114 @@ const int kPositionTrackerSamplesToAverageForStartVelocity = 3;
 const key_velocity kPositionTrackerStartVelocityThreshold = scale_key_velocity(0.5);
 const key_velocity kPositionTrackerStartVelocitySpikeThreshold = scale_key_velocity(2.5);
 const key_velocity kPositionTrackerReleaseVelocityThreshold = scale_key_velocity(-0.2);
-const key_velocity kPositionTrackerMaxVelocityPercussiveThreshold = 0.006;
+const key_velocity kPositionTrackerMaxVelocityPercussiveThreshold = scale_key_velocity(0.006);
+// Frames after a release (or a bounce) over which the threshold for detecting a
+// new press decays to 0. This used to be a decay of 0.4 with frame numbers as
+// timestamps: the threshold only held on the frame of the release or bounce
+// itself, which 1 frame keeps exactly
+const frame_diff_type kPositionTrackerReleaseOnsetThresholdDecay = 1;
 
 // Constants for feature calculations. The first one is the approximate location of the escapement
 // (empirically measured on one piano, so only approximate), used for velocity calculations
-const key_position kPositionTrackerDefaultPositionForPressVelocityCalculation = scale_key_position(0.65);
-const key_position kPositionTrackerDefaultPositionForReleaseVelocityCalculation = scale_key_position(0.5);
+const key_position kPositionTrackerDefaultPositionForPressVelocityCalculation = key_threshold_down(0.65);
+const key_position kPositionTrackerDefaultPositionForReleaseVelocityCalculation = key_threshold_up(0.5);
 const key_position kPositionTrackerPositionThresholdForPercussivenessCalculation = scale_key_position(0.4);
 const int kPositionTrackerSamplesNeededForPressVelocityAfterEscapement = 1;
 const int kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement = 1;
 
+// KeyBuffers
+//
+// Ring buffer holding the recent history of all keys. Storage is frame-major:
+// each frame is a contiguous block of numKeys positions, and has a single
+// timestamp shared by all keys, so that a frame can be stored with one copy.
+// Positions are stored as key_sample: int16 in the fixed-point build, where
+// the incoming frames are converted on the way in.
+//
+// As each frame arrives, KeyBuffers also updates a short history of the
+// kPositionTrackerSamplesToAverageForStartVelocity-sample velocity of every
+// key, so that KeyPositionTracker can locate the start of a press or of a
+// release without scanning the buffer backwards. This has to happen here:
+// the trackers of idle keys are not called.
+
 class KeyBuffers
 {
 public:
+	// How many frames ago the velocity of each key last matched the
+	// thresholds used when looking for the start of a press or release, one
+	// entry per key. Ages saturate at kMaxAge, which is beyond any search period.
+	struct VelocityHistory {
+		std::vector<uint8_t> slow;						// below kPositionTrackerStartVelocityThreshold
+		std::vector<uint8_t> slowBeforeSpike;			// latest slow frame before the latest frame above kPositionTrackerStartVelocitySpikeThreshold
+		std::vector<uint8_t> slowBeforeSpikeBeforeSlow;	// slowBeforeSpike, as it was at the latest slow frame
+		std::vector<uint8_t> notReleasing;				// above kPositionTrackerReleaseVelocityThreshold
+	};
+	static constexpr uint8_t kMaxAge = 255;
 	bool setup(unsigned int numKeys, unsigned int bufferLength);
-	void postCallback(float* buffer, unsigned int length, timestamp_type timestamp);
+	// Store a frame of positions. length may be less than numKeys
+	void postCallback(const float* buffer, unsigned int length, frame_type timestamp);
+	// Alternatively, write the positions of all keys straight into the
+	// slot returned by nextFrame(), then store them with commitFrame()
+	key_sample* nextFrame() { return positionBuffer.data() + writeIdx * numKeys; }
+	void commitFrame(frame_type timestamp);
+	// Timestamps the frames with frameCount
 	static void postCallback(void* arg, float* buffer, unsigned int length);
-	std::vector<std::vector<timestamp_type>> timestamps;
-	std::vector<std::vector<float>> positionBuffer;
+	const key_sample* frameAt(ssize_t pos) const { return positionBuffer.data() + pos * numKeys; }
+	// The frame stored by the latest call to postCallback()
+	const key_sample* latestFrame() const { return frameAt((writeIdx ? writeIdx : timestamps.size()) - 1); }
+	std::vector<frame_type> timestamps; // one per frame
+	std::vector<key_sample> positionBuffer; // bufferLength frames of numKeys positions
+	unsigned int numKeys = 0;
+	size_t mask = 0; // bufferLength - 1, when KEY_BUFFERS_POWER_OF_TWO
 	ssize_t writeIdx = 0;
 	ssize_t firstSampleIndex = 0;
 	bool full = false;
+	frame_type frameCount = 0; // frames received by the static postCallback()
+	VelocityHistory velocityHistory;
+private:
+	void updateVelocityHistory();
+	std::vector<key_velocity> velocities; // scratch for updateVelocityHistory()
 };
 
+// KeyBuffer
+//
+// View of the history of a single key within KeyBuffers.
+
 class KeyBuffer
 {
 private:
-	const std::vector<float>& buffer_;
-	const std::vector<timestamp_type>& timestamps_;
-	const ssize_t& firstSampleIndex_;
-	const ssize_t& writeIdx_;
+	const KeyBuffers& buffers_;
+	unsigned int key_;
 public:
-	KeyBuffer(const std::vector<float>& buffer, const std::vector<timestamp_type>& timestamps, const ssize_t& firstSampleIndex, const ssize_t& writeIdx) :
-		buffer_(buffer),
-		timestamps_(timestamps),
-		firstSampleIndex_(firstSampleIndex),
-		writeIdx_(writeIdx)
+	KeyBuffer(const KeyBuffers& buffers, unsigned int key) :
+		buffers_(buffers),
+		key_(key)
 	{}
 
-	ssize_t beginIndex() { return firstSampleIndex_; } // Index of the first sample we still have in the buffer
-	ssize_t endIndex() { return firstSampleIndex_ + buffer_.size() - 1; } // Index just past the end of the buffer
-	ssize_t posOf(size_t index) { return &(*this)[index] - buffer_.data();}
-	const float& operator[](size_t index) {
-		return buffer_[(writeIdx_ + index - firstSampleIndex_ + 1) % buffer_.size() ];
+	ssize_t beginIndex() { return buffers_.firstSampleIndex; } // Index of the first sample we still have in the buffer
+	ssize_t endIndex() { return buffers_.firstSampleIndex + size() - 1; } // Index just past the end of the buffer
+	ssize_t posOf(size_t index) {
+#ifdef KEY_BUFFERS_POWER_OF_TWO
+		return (buffers_.writeIdx + index - buffers_.firstSampleIndex + 1) & buffers_.mask;
+#else /* KEY_BUFFERS_POWER_OF_TWO */
+		return (buffers_.writeIdx + index - buffers_.firstSampleIndex + 1) % size();
+#endif /* KEY_BUFFERS_POWER_OF_TWO */
+	}
+	key_position operator[](size_t index) {
+		return buffers_.frameAt(posOf(index))[key_];
 	}
 
-	timestamp_type timestampAt(size_t index) { return timestamps_[posOf(index)]; }
-	ssize_t size() { return buffer_.size(); }; // Size: how many elements are currently in the buffer
+	frame_type timestampAt(size_t index) { return buffers_.timestamps[posOf(index)]; }
+	ssize_t size() { return buffers_.timestamps.size(); }; // Size: how many elements are currently in the buffer
 	bool empty() { return false; }
 	bool full() { return true; }
 // Two more convenience methods to avoid confusion about what front and back mean!
-	auto& earliest() { return (*this)[firstSampleIndex_];}
-	auto& latest() { return (*this)[endIndex() - 1];}
+	key_position earliest() { return (*this)[buffers_.firstSampleIndex];}
+	key_position latest() { return buffers_.latestFrame()[key_];}
+	// Index of the sample of the given age in KeyBuffers::VelocityHistory
+	ssize_t indexOfAge(const std::vector<uint8_t>& ages) {
+		return endIndex() - 1 - ages[key_];
+	}
+	const KeyBuffers::VelocityHistory& velocityHistory() { return buffers_.velocityHistory; }
 };
 // KeyPositionTrackerNotification
 //
@@ -156,11 +240,17 @@ public:
         kFeaturePercussiveness = 0x0004
     };
     
+    int key;                        // Index of the key, as given to setNotificationQueue()
     int type;
     int state;
     int features;
+    frame_type timestamp;           // Frame at which it happened
+    key_velocity velocity;          // Press or release velocity, for the matching feature notifications
+    float percussiveness;           // For kNotificationTypeFeatureAvailablePercussiveness
 };
 
+typedef SpscQueue<KeyPositionTrackerNotification> KeyPositionTrackerNotificationQueue;
+
 // KeyPositionTracker
 //
 // This class implements a state machine for a key that is currently active (not idle),
@@ -184,9 +274,9 @@ public:
     class Event {
     public:
         Event() : index(0), position(missing_value<key_position>::missing()),
-        timestamp(missing_value<timestamp_type>::missing()) {}
+        timestamp(missing_value<frame_type>::missing()) {}
         
-        Event(key_buffer_index i, key_position p, timestamp_type t)
+        Event(key_buffer_index i, key_position p, frame_type t)
         : index(i), position(p), timestamp(t) {}
         
         Event(const Event& obj)
@@ -201,7 +291,7 @@ public:
         
         key_buffer_index index;
         key_position position;
-        timestamp_type timestamp;
+        frame_type timestamp;
     };
     
     // Collection of features related to whether a key is percussively played or not
@@ -210,11 +300,27 @@ public:
         Event velocitySpikeMaximum;             // Maximum and minimum points of the initial
         Event velocitySpikeMinimum;             // velocity spike on a percussive press
 	float velocityAverageAroundSpike;       // velocity spike on a percussive press
-        timestamp_type timeFromStartToSpike;    // How long it took to reach the velocity spike
+        frame_type timeFromStartToSpike;        // How long it took to reach the velocity spike
         key_velocity areaPrecedingSpike;        // Total sum of velocity values from start to max
         key_velocity areaFollowingSpike;        // Total sum of velocity values from max to min
         bool hasBeenRead;
     };
+
+    // Running maxima and areas behind PercussivenessFeatures, built one
+    // velocity sample at a time. Offsets count samples from the first one added.
+    struct PercussivenessAccumulator {
+        unsigned int samples;                   // How many samples were added
+        key_velocity maximumVelocity;           // Initial maximum in velocity
+        unsigned int maximumVelocityOffset;
+        key_velocity largestVelocityDifference; // Largest rebound after the maximum
+        unsigned int largestVelocityDifferenceOffset;
+        key_velocity area;                      // Sum of all samples
+        key_velocity areaSinceMaximum;          // Sum of the samples from the maximum
+        key_velocity areaPrecedingSpike;        // Sum from the first sample to the maximum
+        key_velocity areaFollowingSpike;        // Sum from the maximum to the rebound
+        void reset();
+        void add(key_velocity velocity);
+    };
     
 public:
 	// ***** Constructors *****
@@ -240,6 +346,19 @@ public:
         return currentState_;
     }
     
+    // Whether the tracker is in kPositionTrackerStateUnknown with nothing pending
+    bool resting() {
+        return empty_ && kPositionTrackerStateUnknown == currentState_;
+    }
+    
+    // Whether the key is at rest: a new sample at this position would not
+    // make the tracker leave kPositionTrackerStateUnknown, so
+    // triggerReceived() can be skipped. Running minima and maxima then
+    // start from the first sample where the key is no longer idle.
+    bool idle(key_position position) {
+        return resting() && position <= kDefaultKeyIdleThreshold;
+    }
+    
     // Information about important recent points
     Event currentMax() {
         return Event(currentMaxIndex_, currentMaxPosition_, currentMaxTimestamp_);
@@ -264,18 +383,18 @@ public:
     
     // Velocity for onset and release. The values without an argument use the stored
     // current escapement point (which is also used for notification of availability).
-    std::pair<timestamp_type, key_velocity> pressVelocity();
-    std::pair<timestamp_type, key_velocity> releaseVelocity();
+    std::pair<frame_type, key_velocity> pressVelocity();
+    std::pair<frame_type, key_velocity> releaseVelocity();
     
-    std::pair<timestamp_type, key_velocity> pressVelocity(key_position escapementPosition);
-    std::pair<timestamp_type, key_velocity> releaseVelocity(key_position returnPosition);
+    std::pair<frame_type, key_velocity> pressVelocity(key_position escapementPosition);
+    std::pair<frame_type, key_velocity> releaseVelocity(key_position returnPosition);
     
     // Set the threshold where we look for press velocity calculations. It
     // can be anything up to the press position threshold on the upward side
     // and anything down to the final release position on the downward side.
     void setPressVelocityEscapementPosition(key_position pos) {
-        if(pos > kPositionTrackerPressPosition + kPositionTrackerPressHysteresis)
-            pressVelocityEscapementPosition_ = kPositionTrackerPressPosition + kPositionTrackerPressHysteresis;
+        if(pos > key_threshold_down(0.75 + 0.05))
+            pressVelocityEscapementPosition_ = key_threshold_down(0.75 + 0.05);
         else
             pressVelocityEscapementPosition_ = pos;
     }
@@ -292,6 +411,21 @@ public:
     
 	// ***** Modifiers *****
     
+    // Push every notification to the given queue, tagged with the key index.
+    // The tracker is the only producer, so the queue may be drained by a
+    // non-real-time thread.
+    void setNotificationQueue(KeyPositionTrackerNotificationQueue* queue, int key) {
+        notificationQueue_ = queue;
+        key_ = key;
+    }
+    
+    // Whether triggerReceived() logs to the scope on board builds. The scope
+    // is not thread-safe, so KeyboardTracker turns this off when it splits
+    // the keys across threads.
+    void setScopeLogging(bool enabled) {
+        scopeLogging_ = enabled;
+    }
+    
     // Register for updates from the key positon buffer
     void engage();
     
@@ -305,57 +439,66 @@ public:
 	
     // This method receives triggers whenever a new sample enters the buffer. It updates
     // the state depending on the profile of the key position.
-	void triggerReceived(/*TriggerSource* who,*/ timestamp_type timestamp);
+	void triggerReceived(/*TriggerSource* who,*/ frame_type timestamp);
 	
 private:
     // ***** Internal Helper Methods *****
     
     // Change the current state
-    void changeState(int newState, timestamp_type timestamp);
+    void changeState(int newState, frame_type timestamp);
     
     // Insert a new feature notification
-    void notifyFeature(int notificationType, timestamp_type timestamp);
+    void notifyFeature(int notificationType, frame_type timestamp);
+    
+    // Velocity of a single sample with respect to the previous one
+    key_velocity velocityAt(key_buffer_index index);
+    
+    // Add the latest sample to the pending percussiveness features
+    void accumulatePercussiveness();
     
     // Work backwards in the key position buffer to find the start/release of a press
-    void findKeyPressStart(timestamp_type timestamp);
-    void findKeyReleaseStart(timestamp_type timestamp);
+    void findKeyPressStart(frame_type timestamp);
+    void findKeyReleaseStart(frame_type timestamp);
     
     // Generic method to find the most recent crossing of a given point
     key_buffer_index findMostRecentKeyPositionCrossing(key_position threshold, bool greaterThan, int maxDistance);
     
     // Look for the crossing of the release velocity threshold to prepare to send the feature
-    void prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, timestamp_type timestamp);
+    void prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, frame_type timestamp);
     
 	// ***** Member Variables *****
 	
     //Node<key_position>& keyBuffer_;		// Raw key position data
     KeyBuffer& keyBuffer_; // Raw key position data
     bool engaged_;                      // Whether we're actively listening to incoming updates
-    int currentState_;                  // Our current state
+    int currentState_ = kPositionTrackerStateUnknown; // Our current state
     int currentlyAvailableFeatures_;    // Which features can be calculated for the current press
     
     // Position tracking information for significant points (minima and maxima)
     key_position startPosition_;                                // Position of where the key press started
-    timestamp_type startTimestamp_;                             // Timestamp of where the key press started
+    frame_type startTimestamp_;                                 // Timestamp of where the key press started
     key_buffer_index startIndex_;                               // Index in the buffer where the start occurred
     key_position pressPosition_;                                // Position of where the key is fully pressed
-    timestamp_type pressTimestamp_;                             // Timestamp of where the key is fully pressed
+    frame_type pressTimestamp_;                                 // Timestamp of where the key is fully pressed
     key_buffer_index pressIndex_;                               // Index in the buffer where the press occurred
     key_position releaseBeginPosition_;                         // Position of where the key release began
-    timestamp_type releaseBeginTimestamp_;                      // Timestamp of where the key release began
+    frame_type releaseBeginTimestamp_;                          // Timestamp of where the key release began
     key_buffer_index releaseBeginIndex_;                        // Index in the buffer of where the key release began
     key_position releaseEndPosition_;                           // Position of where the key release ended
-    timestamp_type releaseEndTimestamp_;                        // Timestamp of where the key release ended
+    frame_type releaseEndTimestamp_;                            // Timestamp of where the key release ended
     key_buffer_index releaseEndIndex_;                          // Index in the buffer of where the key release ended
     key_position currentMinPosition_, currentMaxPosition_;      // Running min and max key position
 public: // public for debugging
     key_position releaseMaxPosition_;                    // Keeps track of the bounces during release
-    timestamp_type releaseMaxTimestamp_;                 // Keeps track of the bounces during release
-    timestamp_type releaseFinishedTimestamp_;                   // When did the release finish?
+    frame_type releaseMaxTimestamp_;                     // Keeps track of the bounces during release
+    frame_type releaseFinishedTimestamp_;                       // When did the release finish?
     key_position releaseFinishedPosition_; // what position when we detected release finished
     key_position dynamicOnsetThreshold_; // not needed internally, but useful for debugging
+    float maxThreshold_ = 0, minThreshold_ = 0; // sliding thresholds for the latest max and min
+    float percussed_ = 0; // outcome of the latest percussiveness calculation
+    float oldPosition_ = 0, oldVelocity_ = 0; // for the scope
 private:
-    timestamp_type currentMinTimestamp_, currentMaxTimestamp_;  // Times for the above positions
+    frame_type currentMinTimestamp_, currentMaxTimestamp_;      // Times for the above positions
     key_buffer_index currentMinIndex_, currentMaxIndex_;        // Indices in the buffer for the recent min/max
     key_position lastMinMaxPosition_;                           // Position of the last significant point
     
@@ -366,6 +509,7 @@ private:
     key_buffer_index releaseVelocityAvailableIndex_;            // When we can calculate release velocity
     bool releaseVelocityWaitingForThresholdCross_;              // Set to true if we need to look for release escapement cross
     key_buffer_index percussivenessAvailableIndex_;             // When we can calculate percussiveness features
+    PercussivenessAccumulator percussivenessAccumulator_;       // Samples since percussiveness was scheduled
     
     /*
     typedef struct {
@@ -397,14 +541,21 @@ private:
 	*/
     void registerForTrigger(KeyBuffer* b){};
     void unregisterForTrigger(KeyBuffer* b){};
-    timestamp_type latestTimestamp() { return latestTimestamp_; };
-    timestamp_type latestTimestamp_ = 0;
+    frame_type latestTimestamp() { return latestTimestamp_; };
+    frame_type latestTimestamp_ = 0;
     bool empty_;
     bool empty() {return empty_;};
-    void insert(KeyPositionTrackerNotification notification, timestamp_type timestamp);
+    void insert(KeyPositionTrackerNotification notification, frame_type timestamp);
     PercussivenessFeatures percussivenessFeatures_;
+    KeyPositionTrackerNotificationQueue* notificationQueue_ = nullptr;
+    int key_ = 0;
+    bool scopeLogging_ = true;
 public:
     Event getPercussiveness();
+    // Whether getPercussiveness() has an event to return
+    bool hasPercussiveness() {
+        return percussivenessFeatures_.hasBeenRead == false && percussivenessFeatures_.percussiveness;
+    }
 };
 
 
@@ -1,31 +1,86 @@
 #include "KeyboardState.h"
+#include "Trace.h"
 
 #include <limits>
 #include <algorithm>
 
-const float KeyboardState::bendOnThreshold;
 const float KeyboardState::bendPrimaryDisengageThreshold;
-const int KeyboardState::bendMaxDistance;
-const float KeyboardState::highestPositionHysteresisStart;
-const float KeyboardState::highestPositionHysteresisDecay;
-const float KeyboardState::pressingKeyOnThreshold;
+#ifdef KEYBOARD_STATE_CONSTANT_PARAMETERS
+constexpr KeyboardStateParameters KeyboardState::kParameters;
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
 
-KeyboardState::KeyboardState(unsigned int numKeys)
+KeyboardState::KeyboardState(unsigned int numKeys, unsigned int numVoices)
 {
-	setup(numKeys);
+	setup(numKeys, numVoices);
 }
 
-bool KeyboardState::setup(unsigned int numKeys)
+bool KeyboardState::setup(unsigned int numKeys, unsigned int numVoices)
 {
 	timestamp = 0;
 	this->numKeys = numKeys;
 	pastStates.resize(numKeys, kPositionTrackerStateUnknown);
 	states.resize(numKeys, kPositionTrackerStateUnknown);
-	timestampsDown.resize(numKeys, timestamp);
-	timestampsProgress.resize(numKeys, timestamp);
+	timestampsDown.setup(numKeys);
+	timestampsProgress.setup(numKeys);
+	unsettledKeys.resize(keyMaskWords(numKeys), 0);
+	onsetKeys.assign(keyMaskWords(numKeys), 0);
+	pressingKeys.assign(keyMaskWords(numKeys), 0);
+	percussiveKeys.assign(keyMaskWords(numKeys), 0);
+	bendCandidates.assign(keyMaskWords(numKeys), 0);
+	voiceKeys.assign(keyMaskWords(numKeys), 0);
+	polyphonic = numVoices > 0;
+	// all allocated here: render() only updates them
+	voices.assign(polyphonic ? numVoices : 1, Voice());
+	if(!polyphonic)
+		voices[0].key = 0;
 	return true;
 }
 
+void KeyboardState::Timestamps::setup(unsigned int numKeys)
+{
+	timestamps.resize(numKeys, 0);
+	setKeys.assign(keyMaskWords(numKeys), 0);
+	for(unsigned int n = 0; n < numKeys; ++n)
+		keyMaskSet(setKeys.data(), n, 0 != timestamps[n]);
+	findMostRecent();
+}
+
+void KeyboardState::Timestamps::set(unsigned int n, unsigned int timestamp)
+{
+	unsigned int previous = timestamps[n];
+	if(previous == timestamp)
+		return;
+	timestamps[n] = timestamp;
+	keyMaskSet(setKeys.data(), n, 0 != timestamp);
+	if(n == mostRecent)
+	{
+		// it can only lose its place by going back in time
+		if(timestamp < previous)
+			findMostRecent();
+	} else if(timestamp > timestamps[mostRecent]
+		|| (timestamp == timestamps[mostRecent] && n < mostRecent))
+	{
+		mostRecent = n;
+	}
+}
+
+void KeyboardState::Timestamps::findMostRecent()
+{
+	// with no timestamp set, std::max_element() finds the first key
+	mostRecent = 0;
+	for(unsigned int w = 0; w < setKeys.size(); ++w)
+	{
+		key_mask_word bits = setKeys[w];
+		while(bits)
+		{
+			unsigned int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+			bits &= bits - 1;
+			if(timestamps[n] > timestamps[mostRecent])
+				mostRecent = n;
+		}
+	}
+}
+
 static bool isPressed(int state)
 {
 	return kPositionTrackerStateDown == state;
@@ -50,105 +105,260 @@ static bool isReleasing(int state)
 	return kPositionTrackerStateReleaseInProgress == state;
 }
 
-void KeyboardState::render(float* buffer, std::vector<KeyPositionTracker>& keyPositionTrackers, int first, int last)
+void KeyboardState::renderKey(const key_sample* buffer, unsigned int n, KeyPositionTracker& tracker)
 {
-	if(last < 0 || last > numKeys)
+	int state = tracker.currentState();
+	bool wasHeld = isHeld(n);
+	if(kPositionTrackerStateDown == state
+		&& kPositionTrackerStateDown != pastStates[n]) 
 	{
-		last = numKeys;
+		timestampsDown.set(n, timestamp);
 	}
-	for(unsigned int n = first; n < last; ++n)
+	else if(kPositionTrackerStateDown == pastStates[n]
+		&& kPositionTrackerStateDown != state) 
 	{
-		auto state = keyPositionTrackers[n].currentState();
-		if(kPositionTrackerStateDown == state
-			&& kPositionTrackerStateDown != pastStates[n]) 
+#ifdef DEBEND
+		for(auto& voice : voices)
 		{
-			timestampsDown[n] = timestamp;
+			if(n == voice.lastBentFrom)
+				voice.lastBentFrom = -1;
 		}
-		else if(kPositionTrackerStateDown == pastStates[n]
-			&& kPositionTrackerStateDown != state) 
-		{
-#ifdef DEBEND
-			if(n == lastBentFrom)
-				lastBentFrom = -1;
 #endif /* DEBEND */
-			timestampsDown[n] = 0;
-		}
+		timestampsDown.set(n, 0);
+	}
 
-		if(buffer[n] > pressingKeyOnThreshold && isPressing(state) && 0 == timestampsProgress[n])
+	if(buffer[n] > key_threshold_down(params().pressingKeyOnThreshold) && isPressing(state) && 0 == timestampsProgress[n])
+	{
+		timestampsProgress.set(n, timestamp);
+	} else if(buffer[n] <= key_threshold_down(params().pressingKeyOnThreshold - 0.05) && 0 != timestampsProgress[n])
+	{
+		timestampsProgress.set(n, 0);
+	}
+	if(polyphonic && !wasHeld && isHeld(n))
+		keyMaskSet(onsetKeys.data(), n, true);
+	pastStates[n] = states[n];
+	states[n] = state;
+	keyMaskSet(pressingKeys.data(), n, isPressing(state));
+	// a tracker only comes up with percussiveness while its key is active
+	keyMaskSet(percussiveKeys.data(), n, tracker.hasPercussiveness());
+	// once this holds, calling this again for a resting key is a no-op
+	bool settled = kPositionTrackerStateUnknown == states[n]
+		&& kPositionTrackerStateUnknown == pastStates[n]
+		&& 0 == timestampsDown[n] && 0 == timestampsProgress[n];
+	keyMaskSet(unsettledKeys.data(), n, !settled);
+}
+
+// Polyphonic mode: free the voices of the keys that have been released and
+// give one to each key that started being held this frame, in order of
+// key, unless it is being pressed next to a held key, i.e.: bending it.
+void KeyboardState::allocateVoices(int first, int last)
+{
+	for(auto& voice : voices)
+	{
+		// a voice may have moved to a key that is still on its way down
+		int state = voice.key >= 0 ? states[voice.key] : kPositionTrackerStateUnknown;
+		if(voice.key >= 0 && !isHeld(voice.key) && !isPressing(state) && !isReleasing(state))
 		{
-			timestampsProgress[n] = timestamp;
-		} else if(buffer[n] <= pressingKeyOnThreshold - 0.05 && 0 != timestampsProgress[n])
+			keyMaskSet(voiceKeys.data(), voice.key, false);
+			voice = Voice();
+		}
+	}
+	for(unsigned int w = first / kKeyMaskWordBits; w < keyMaskWords(last); ++w)
+	{
+		key_mask_word bits = onsetKeys[w] & keyMaskRange(w, first, last);
+		onsetKeys[w] &= ~bits;
+		while(bits)
 		{
-			timestampsProgress[n] = 0;
+			int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+			bits &= bits - 1;
+			Voice* target = nullptr;
+			bool bending = false;
+			for(auto& voice : voices)
+			{
+				if(voice.key == n)
+				{
+					// pressed again while releasing
+					voice.onset = timestamp;
+					bending = true;
+					break;
+				}
+				if(voice.key >= 0 && isPressed(states[voice.key]) && std::abs(voice.key - n) <= params().bendMaxDistance)
+					bending = true;
+				// the first idle voice or, failing that, the oldest one
+				if(!target || (target->key >= 0 && (voice.key < 0 || voice.onset < target->onset)))
+					target = &voice;
+			}
+			if(bending || !target)
+				continue;
+			if(target->key >= 0)
+				keyMaskSet(voiceKeys.data(), target->key, false);
+			*target = Voice();
+			target->key = n;
+			target->onset = timestamp;
+			keyMaskSet(voiceKeys.data(), n, true);
 		}
-		pastStates[n] = states[n];
-		states[n] = state;
 	}
-	float* foundMax = std::max_element(buffer + first, buffer + last);
-	int primaryKey = foundMax - buffer;
-	auto* mostRecentDown = std::max_element(timestampsDown.data(), timestampsDown.data() + timestampsDown.size());
+}
 
-	auto* mostRecentProgress = std::max_element(timestampsProgress.data(), timestampsProgress.data() + timestampsProgress.size());
+void KeyboardState::render(const key_sample* buffer, std::vector<KeyPositionTracker>& keyPositionTrackers, int first, int last, const key_mask_word* activeKeys)
+{
+#ifndef KEYBOARD_STATE_CONSTANT_PARAMETERS
+	// release: done with the buffer that setParameters() writes next
+	int next = nextParameters.exchange(-1, std::memory_order_acq_rel);
+	if(next >= 0)
+		activeParameters = next;
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	if(last < 0 || last > numKeys)
+	{
+		last = numKeys;
+	}
+	if(activeKeys)
+	{
+		for(unsigned int w = first / kKeyMaskWordBits; w < keyMaskWords(last); ++w)
+		{
+			key_mask_word bits = (activeKeys[w] | unsettledKeys[w]) & keyMaskRange(w, first, last);
+			while(bits)
+			{
+				unsigned int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+				bits &= bits - 1;
+				renderKey(buffer, n, keyPositionTrackers[n]);
+			}
+		}
+	} else {
+		for(unsigned int n = first; n < last; ++n)
+			renderKey(buffer, n, keyPositionTrackers[n]);
+	}
+	if(polyphonic)
+	{
+		allocateVoices(first, last);
+		++timestamp;
+		for(auto& voice : voices)
+		{
+			if(voice.key < first || voice.key >= last)
+				continue;
+			// only look for the keys the other voices are not playing
+			keyMaskSet(voiceKeys.data(), voice.key, false);
+			renderVoice(voice, voice.key, buffer, keyPositionTrackers, first, last);
+			keyMaskSet(voiceKeys.data(), voice.key, true);
+		}
+		return;
+	}
+	Voice& voice = voices[0];
+	int monoKey = voice.key;
+	int primaryKey;
+	int mostRecentDownKey = timestampsDown.getMostRecent();
+	unsigned int mostRecentDown = timestampsDown[mostRecentDownKey];
 	// if there is at least one key that is in "key down" state,
 	// then that will be our primaryKey, instead, unless there is a key
 	// that most recently entered the "press in progress" state that is
 	// outside the bending range
-	if(*mostRecentDown != 0)
+	if(mostRecentDown != 0)
 	{
-		int mostRecentProgressKey = mostRecentProgress - timestampsProgress.data();
-		int mostRecentDownKey = mostRecentDown - timestampsDown.data();
-		if(0 != *mostRecentProgress && *mostRecentProgress > *mostRecentDown
-			&& std::abs(mostRecentProgressKey - mostRecentDownKey) > bendMaxDistance)
+		int mostRecentProgressKey = timestampsProgress.getMostRecent();
+		unsigned int mostRecentProgress = timestampsProgress[mostRecentProgressKey];
+		if(0 != mostRecentProgress && mostRecentProgress > mostRecentDown
+			&& std::abs(mostRecentProgressKey - mostRecentDownKey) > params().bendMaxDistance)
 		{
 			primaryKey = mostRecentProgressKey;
 		} else {
 			primaryKey = mostRecentDownKey;
 		}
+	} else {
+		// otherwise, the key that is furthest down. Every position changes
+		// every frame, so this one has to be searched for
+		const key_sample* foundMax = std::max_element(buffer + first, buffer + last);
+		primaryKey = foundMax - buffer;
 	}
 	if(primaryKey != monoKey)
 	{
-		if(buffer[monoKey] > 0.1 && buffer[primaryKey] > 0.1)
+		if(buffer[monoKey] > key_threshold_down(0.1) && buffer[primaryKey] > key_threshold_down(0.1))
 		{
 			// adding hysteresis to make sure we don't switch too often because of noise
-			if(pressingKeyOnThreshold + highestPositionHysteresis > buffer[primaryKey])
+			if(params().pressingKeyOnThreshold + highestPositionHysteresis > key_position_to_float(buffer[primaryKey]))
 			{
-				highestPositionHysteresis = highestPositionHysteresisStart;
+				highestPositionHysteresis = params().highestPositionHysteresisStart;
 				primaryKey = monoKey;
 			}
 		}
 	}
-	highestPositionHysteresis *= highestPositionHysteresisDecay;
+	highestPositionHysteresis *= params().highestPositionHysteresisDecay;
+	++timestamp;
+	renderVoice(voice, primaryKey, buffer, keyPositionTrackers, first, last);
+}
 
+void KeyboardState::renderVoice(Voice& voice, int primaryKey, const key_sample* buffer, std::vector<KeyPositionTracker>& keyPositionTrackers, int first, int last)
+{
 	// looking for neighbouring keys being pressed down, to detect "bending" gesture
-	int secondaryFirst = std::max(first, primaryKey - bendMaxDistance);
-	int secondaryLast = std::min(last, primaryKey + bendMaxDistance + 1);
+	int secondaryFirst = std::max(first, primaryKey - params().bendMaxDistance);
+	int secondaryLast = std::min(last, primaryKey + params().bendMaxDistance + 1);
 	int secondaryKey = 0;
-	float secondaryPos = std::numeric_limits<float>::min();
-	for(int n = secondaryFirst; n < secondaryLast; ++n)
+#ifdef FIXED_POINT_PIANO_SAMPLES
+	key_position secondaryPos = 0;
+#else /* FIXED_POINT_PIANO_SAMPLES */
+	key_position secondaryPos = std::numeric_limits<float>::min();
+#endif /* FIXED_POINT_PIANO_SAMPLES */
+	// In one pass over the mask words of the neighbourhood: the keys it
+	// may bend to, i.e.: those that are pressing and, if it has bent, the
+	// one to debend to, but not those of other voices. And the
+	// percussiveness events, from the lowest key on, until one is above
+	// the threshold, which moves with the time since the last one and its
+	// intensity
+	int timeDiff = timestamp - voice.lastPercussivenessTimestamp;
+	float percThreshold = voice.percussiveness - timeDiff * 0.001f;
+	bool foundPercussiveness = false;
+	for(int w = secondaryFirst / kKeyMaskWordBits; w < (int)keyMaskWords(secondaryLast); ++w)
 	{
-		if(n != primaryKey && buffer[n] > secondaryPos)
+		key_mask_word range = keyMaskRange(w, secondaryFirst, secondaryLast);
+		bendCandidates[w] = pressingKeys[w] & range;
+		if(polyphonic)
+			bendCandidates[w] &= ~voiceKeys[w];
+		key_mask_word bits = percussiveKeys[w] & range;
+		while(bits && !foundPercussiveness)
 		{
-			// either it's an onset, or it's a potential debend
-			if(
-#ifdef DEBEND
-				(primaryKey == lastBentTo && n == lastBentFrom)
-				|| (primaryKey == lastBentFrom && n == lastBentTo)
-				||
-#endif /* DEBEND */
-				isPressing(states[n])
-			)
+			unsigned int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+			bits &= bits - 1;
+			auto event = keyPositionTrackers[n].getPercussiveness();
+			keyMaskSet(percussiveKeys.data(), n, false);
+			// event.position holds the velocity of the spike
+			if(!missing_value<key_position>::isMissing(event.position))
 			{
-				secondaryPos = buffer[n];
-				secondaryKey = n;
+				if(key_velocity_to_float(event.position) > percThreshold)
+				{
+					voice.percussiveness = key_velocity_to_float(event.position);
+					voice.lastPercussivenessTimestamp = timestamp;
+					foundPercussiveness = true;
+				}
 			}
 		}
 	}
+	if(secondaryFirst < secondaryLast)
+	{
+#ifdef DEBEND
+		int debendKey = -1;
+		if(primaryKey == voice.lastBentTo)
+			debendKey = voice.lastBentFrom;
+		else if(primaryKey == voice.lastBentFrom)
+			debendKey = voice.lastBentTo;
+		if(debendKey >= secondaryFirst && debendKey < secondaryLast
+			&& (!polyphonic || !keyMaskGet(voiceKeys.data(), debendKey)))
+			keyMaskSet(bendCandidates.data(), debendKey, true);
+#endif /* DEBEND */
+		if(primaryKey >= secondaryFirst && primaryKey < secondaryLast)
+			keyMaskSet(bendCandidates.data(), primaryKey, false);
+		// the one furthest down, with a masked vector max
+		int found = keyMaskMax(buffer, bendCandidates.data(), secondaryFirst, secondaryLast, secondaryPos);
+		if(found >= 0)
+		{
+			secondaryKey = found;
+			secondaryPos = buffer[found];
+		}
+	}
 	float bendValue = 0;
 	int distance = 0;
 	bool debend = false; //We leave this declared even if not DEBEND, to simplify below
 #ifdef DEBEND
-	rt_printf("primaryKey: %d, secondaryKey: %d\n", primaryKey, secondaryKey);
-	if(lastBentTo == primaryKey && lastBentFrom == secondaryKey)
+	trace<2>(kTraceBend, -1, primaryKey, secondaryKey);
+	if(voice.lastBentTo == primaryKey && voice.lastBentFrom == secondaryKey)
 	{
 		// we previously bent A to B, so that now B is down and it is the primaryKey.
 		// Let's instead consider it as if A was still the primary key, bending to B,
@@ -156,7 +366,7 @@ void KeyboardState::render(float* buffer, std::vector<KeyPositionTracker>& keyPo
 		debend = true;
 		std::swap(primaryKey, secondaryKey);
 		secondaryPos = buffer[secondaryKey];
-	} else if (lastBentTo == secondaryKey && lastBentFrom == primaryKey) {
+	} else if (voice.lastBentTo == secondaryKey && voice.lastBentFrom == primaryKey) {
 		// we previously bent A to B. Now B has released enough that A is the primaryKey again, let's keep
 		// track of the debend, so that even if B is
 		// "releaseInProgress", and it would normally not trigger a new
@@ -166,7 +376,7 @@ void KeyboardState::render(float* buffer, std::vector<KeyPositionTracker>& keyPo
 		debend = false;
 	}
 #endif /* DEBEND */
-	if(secondaryPos > bendOnThreshold)
+	if(secondaryPos > key_threshold_down(params().bendOnThreshold))
 	{
 		int secondaryState = states[secondaryKey];
 		int primaryState = states[primaryKey];
@@ -176,14 +386,14 @@ void KeyboardState::render(float* buffer, std::vector<KeyPositionTracker>& keyPo
 		{
 			// the "bending" gesture is active
 			distance = secondaryKey - primaryKey;
-			float bendingRange = kPositionTrackerPressPosition + kPositionTrackerPressHysteresis - bendOnThreshold;
-			float bendCoeff = (secondaryPos - bendOnThreshold) / bendingRange;
+			float bendingRange = key_position_to_float(kPositionTrackerPressOnThreshold) - params().bendOnThreshold;
+			float bendCoeff = (key_position_to_float(secondaryPos) - params().bendOnThreshold) / bendingRange;
 			// clamp
 			bendCoeff = std::min(1.f, std::max(-1.f, bendCoeff));
 			bendValue = bendCoeff * distance;
 #ifdef DEBEND
-			lastBentTo = secondaryKey;
-			lastBentFrom = primaryKey;
+			voice.lastBentTo = secondaryKey;
+			voice.lastBentFrom = primaryKey;
 #endif /* DEBEND */
 		}
 		else if (
@@ -205,81 +415,103 @@ void KeyboardState::render(float* buffer, std::vector<KeyPositionTracker>& keyPo
 			primaryKey = secondaryKey;
 		}
 	}
-	bend = bendValue;
-	bendRange = distance;
-	monoKey = primaryKey;
-	otherKey = secondaryKey;
+	voice.bend = bendValue;
+	voice.bendRange = distance;
+	voice.key = primaryKey;
+	voice.otherKey = secondaryKey;
 	// crossfade the position values of the two keys, with offset and weight to make it less drastic
 	float bendIdx;
 	// gate off position of primaryKey if it's bouncing after release
-	float primaryPosition = states[primaryKey] != kPositionTrackerStateReleaseFinished ? buffer[primaryKey] : 0;
-	if(bendRange) {
-		bendIdx = bend / bendRange;
-		otherPosition = buffer[secondaryKey];
+	float primaryPosition = states[primaryKey] != kPositionTrackerStateReleaseFinished ? key_position_to_float(buffer[primaryKey]) : 0;
+	if(voice.bendRange) {
+		bendIdx = voice.bend / voice.bendRange;
+		voice.otherPosition = key_position_to_float(buffer[secondaryKey]);
 		float positionWeightPrimary = (1.f - bendIdx) * positionCrossFadeDip;
 		float positionWeightSecondary = bendIdx * positionCrossFadeDip;
-		position = primaryPosition * positionWeightPrimary + otherPosition * positionWeightSecondary + (1.f - positionCrossFadeDip);
+		voice.position = primaryPosition * positionWeightPrimary + voice.otherPosition * positionWeightSecondary + (1.f - positionCrossFadeDip);
 	} else {
-		position = primaryPosition;
-	}
-
-	++timestamp;
-
-// threshold new percussive events, with a moving threshold, depending on when
-// the previous most recent one was, and its intensity
-	int timeDiff = timestamp - lastPercussivenessTimestamp;
-	float percThreshold = percussiveness - timeDiff * 0.001f;
-	for(unsigned int n = secondaryFirst; n < secondaryLast; ++n)
-	{
-		auto event = keyPositionTrackers[n].getPercussiveness();
-		if(!missing_value<float>::isMissing(event.position))
-		{
-			if(event.position > percThreshold)
-			{
-				percussiveness = event.position;
-				lastPercussivenessTimestamp = timestamp;
-				//rt_printf("======= percKey: %d, %f\n", n, tempPerc);
-				break;
-			}
-		}
+		voice.position = primaryPosition;
 	}
 }
 
 int KeyboardState::getKey()
 {
-	return monoKey;
+	return voices[0].key;
 }
 
 int KeyboardState::getOtherKey()
 {
-	return otherKey;
+	return voices[0].otherKey;
 }
 
 float KeyboardState::getPosition()
 {
-	return position;
+	return voices[0].position;
 }
 
 float KeyboardState::getOtherPosition()
 {
-	return otherPosition;
+	return voices[0].otherPosition;
 }
 
 float KeyboardState::getBend()
 {
-	return bend;
+	return voices[0].bend;
 }
 
 float KeyboardState::getBendRange()
 {
-	return bendRange;
+	return voices[0].bendRange;
 }
 
 float KeyboardState::getPercussiveness()
 {
-	return percussiveness;
+	return voices[0].percussiveness;
 }
 void KeyboardState::setPositionCrossFadeDip(float newWeight)
 {
 	positionCrossFadeDip = std::max(0.f, std::min(1.f, newWeight));
 }
+
+#ifndef KEYBOARD_STATE_CONSTANT_PARAMETERS
+// also false for NaN
+static bool isPosition(float value)
+{
+	return value >= 0 && value < 1;
+}
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+
+bool KeyboardState::setParameters(const KeyboardStateParameters& newParameters)
+{
+#ifdef KEYBOARD_STATE_CONSTANT_PARAMETERS
+	return false;
+#else /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	// the bend goes from bendOnThreshold to the press position: it must be
+	// a range of positions, or the bend would divide by zero or be inverted
+	if(!isPosition(newParameters.bendOnThreshold)
+		|| newParameters.bendOnThreshold >= key_position_to_float(kPositionTrackerPressOnThreshold)
+		|| !isPosition(newParameters.pressingKeyOnThreshold)
+		|| !isPosition(newParameters.highestPositionHysteresisStart)
+		|| newParameters.bendMaxDistance < 0
+		|| !(newParameters.highestPositionHysteresisDecay >= 0 && newParameters.highestPositionHysteresisDecay <= 1))
+		return false;
+	// render() may still be about to switch to the last ones
+	if(nextParameters.load(std::memory_order_acquire) >= 0)
+		return false;
+	// once it has, it only reads those
+	unsigned int n = !publishedParameters;
+	parameterBuffers[n] = newParameters;
+	publishedParameters = n;
+	nextParameters.store(n, std::memory_order_release);
+	return true;
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+}
+
+KeyboardStateParameters KeyboardState::getParameters()
+{
+#ifdef KEYBOARD_STATE_CONSTANT_PARAMETERS
+	return kParameters;
+#else /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	return parameterBuffers[publishedParameters];
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+}
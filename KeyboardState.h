@@ -1,15 +1,60 @@
 #pragma once
 #include <KeyPositionTracker.h>
+#include "KeyMask.h"
+#include <atomic>
 #include <vector>
 
 #define DEBEND
+
+// The tunables of KeyboardState. Positions are normalised, 0 to 1
+struct KeyboardStateParameters
+{
+	float bendOnThreshold = 0.1; // a neighbouring key further down than this bends
+	int bendMaxDistance = 4; // in keys
+	float highestPositionHysteresisStart = 0.03; // after a change of primary key
+	float highestPositionHysteresisDecay = 0.95; // per frame
+	float pressingKeyOnThreshold = 0.4; // a key pressing further down than this is held
+};
+
+// Define KEYBOARD_STATE_CONSTANT_PARAMETERS to build with the default
+// parameters as compile-time constants, and setParameters() disabled.
 class KeyboardState
 {
 public:
+	// What one voice is playing: the key, and the neighbouring key it is
+	// bending to, if any
+	struct Voice
+	{
+		int key = -1; // -1: the voice is idle
+		int otherKey = 0;
+		float bend = 0;
+		float bendRange = 0;
+		float position = 0;
+		float otherPosition = 0;
+		float percussiveness = 0;
+	private:
+		friend class KeyboardState;
+		unsigned int onset = 0;
+		unsigned int lastPercussivenessTimestamp = 0;
+#ifdef DEBEND
+		int lastBentTo = -1;
+		int lastBentFrom = -1;
+#endif /* DEBEND */
+	};
 	KeyboardState() {};
-	KeyboardState(unsigned int numKeys);
-	bool setup(unsigned int numKeys);
-	void render(float* buffer, std::vector<KeyPositionTracker>& trackers, int first = 0, int last = -1);
+	KeyboardState(unsigned int numKeys, unsigned int numVoices = 0);
+	// With numVoices = 0, a single voice follows whichever key is most
+	// relevant (monophonic mode). Otherwise, each key pressed gets a voice
+	// of its own, for as long as it is held or releasing, and a key pressed
+	// next to a held one bends it instead. When all voices are busy, the
+	// one that started first is taken over.
+	bool setup(unsigned int numKeys, unsigned int numVoices = 0);
+	// activeKeys, if provided, is the mask of keys whose tracker may have
+	// changed state (see KeyboardTracker::getActiveKeys()). All other keys
+	// are assumed to be resting and are skipped once their state here has settled.
+	// buffer holds the latest position of each key, as stored in KeyBuffers
+	// (see KeyBuffers::latestFrame()).
+	void render(const key_sample* buffer, std::vector<KeyPositionTracker>& trackers, int first = 0, int last = -1, const key_mask_word* activeKeys = nullptr);
 	int getKey();
 	int getOtherKey();
 	float getPosition();
@@ -17,33 +62,73 @@ public:
 	float getBend();
 	float getBendRange();
 	float getPercussiveness();
+	// In polyphonic mode, the voices. In monophonic mode, the getters above
+	// are those of the only voice
+	unsigned int getNumVoices() { return voices.size(); }
+	const Voice& getVoice(unsigned int n) { return voices[n]; }
 	void setPositionCrossFadeDip(float newWeight);
+	// Can be called from one other thread while render() runs. The new
+	// parameters are used from the next call to render() on. Returns false
+	// if they are invalid, or if the previous ones have not been picked up
+	// yet: try again later. The thresholds and the hysteresis are positions,
+	// in [0, 1), and bendOnThreshold must be below the press position
+	bool setParameters(const KeyboardStateParameters& newParameters);
+	// The latest parameters set
+	KeyboardStateParameters getParameters();
 private:
+	// A timestamp per key, 0 if unset. The key with the most recent one is
+	// kept up to date as they change, at a cost that depends on how many
+	// are set, rather than searched for in all of them every frame.
+	class Timestamps
+	{
+	public:
+		void setup(unsigned int numKeys);
+		void set(unsigned int n, unsigned int timestamp);
+		unsigned int operator[](unsigned int n) const { return timestamps[n]; }
+		// The key with the highest timestamp, the lowest one among ties,
+		// as std::max_element() would find
+		unsigned int getMostRecent() const { return mostRecent; }
+	private:
+		void findMostRecent();
+		std::vector<unsigned int> timestamps;
+		std::vector<key_mask_word> setKeys;
+		unsigned int mostRecent = 0;
+	};
+#ifdef KEYBOARD_STATE_CONSTANT_PARAMETERS
+	static constexpr KeyboardStateParameters kParameters{};
+	const KeyboardStateParameters& params() const { return kParameters; }
+#else /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	// Double-buffered: render() uses parameterBuffers[activeParameters] and
+	// setParameters() writes the other one, then hands it over with
+	// nextParameters, which render() swaps in once per call.
+	const KeyboardStateParameters& params() const { return parameterBuffers[activeParameters]; }
+	KeyboardStateParameters parameterBuffers[2];
+	unsigned int activeParameters = 0; // render() only
+	unsigned int publishedParameters = 0; // setParameters() only
+	std::atomic<int> nextParameters{-1};
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	void renderKey(const key_sample* buffer, unsigned int n, KeyPositionTracker& tracker);
+	void allocateVoices(int first, int last);
+	void renderVoice(Voice& voice, int primaryKey, const key_sample* buffer, std::vector<KeyPositionTracker>& trackers, int first, int last);
+	bool isHeld(unsigned int n) { return 0 != timestampsDown[n] || 0 != timestampsProgress[n]; }
+	std::vector<key_mask_word> unsettledKeys;
+	std::vector<key_mask_word> onsetKeys; // started being held this frame
+	// Kept by renderKey(), so that the neighbourhood of a voice's key can be
+	// searched a mask word at a time
+	std::vector<key_mask_word> pressingKeys;
+	std::vector<key_mask_word> percussiveKeys; // may have a percussiveness event to read
+	std::vector<key_mask_word> bendCandidates; // scratch, for renderVoice()
+	std::vector<key_mask_word> voiceKeys; // played by a voice, polyphonic mode
+	std::vector<Voice> voices;
+	bool polyphonic = false;
 	std::vector<int> pastStates;
 	std::vector<int> states;
-	std::vector<unsigned int> timestampsDown;
-	std::vector<unsigned int> timestampsProgress;
+	Timestamps timestampsDown;
+	Timestamps timestampsProgress;
 	unsigned int numKeys;
-	int monoKey;
-	int otherKey;
-	float bend;
-	float position;
-	float otherPosition;
-	float percussiveness;
 	unsigned int timestamp;
-	float bendRange;
 	float highestPositionHysteresis = 0;
-	unsigned int lastPercussivenessTimestamp = 0;
-#ifdef DEBEND
-	int lastBentTo = -1;
-	int lastBentFrom = -1;
-#endif /* DEBEND */
 	// tunables
 	float positionCrossFadeDip = 0.1;
-	static constexpr float bendPrimaryDisengageThreshold = kPositionTrackerPressPosition - kPositionTrackerPressHysteresis;
-	static constexpr float bendOnThreshold = 0.1;
-	static constexpr int bendMaxDistance = 4;
-	static constexpr float highestPositionHysteresisStart = 0.03;
-	static constexpr float highestPositionHysteresisDecay = 0.95;
-	static constexpr float pressingKeyOnThreshold = 0.4;
+	static constexpr float bendPrimaryDisengageThreshold = key_position_to_float(kPositionTrackerPressOffThreshold);
 };
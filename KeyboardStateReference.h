@@ -0,0 +1,63 @@
+#pragma once
+#include <KeyPositionTracker.h>
+#include "KeyMask.h"
+#include <vector>
+
+#define DEBEND
+
+// KeyboardState as it was before it kept its state incrementally, gained a
+// polyphonic mode and run-time parameters: a plain search of all keys every
+// frame, with the default parameters. keyboard-state-test checks that the
+// monophonic output of KeyboardState is still the same as this. Do not use
+// it for anything else.
+class KeyboardStateReference
+{
+public:
+	KeyboardStateReference() {};
+	KeyboardStateReference(unsigned int numKeys);
+	bool setup(unsigned int numKeys);
+	// activeKeys, if provided, is the mask of keys whose tracker may have
+	// changed state (see KeyboardTracker::getActiveKeys()). All other keys
+	// are assumed to be resting and are skipped once their state here has settled.
+	// buffer holds the latest position of each key, as stored in KeyBuffers
+	// (see KeyBuffers::latestFrame()).
+	void render(const key_sample* buffer, std::vector<KeyPositionTracker>& trackers, int first = 0, int last = -1, const key_mask_word* activeKeys = nullptr);
+	int getKey();
+	int getOtherKey();
+	float getPosition();
+	float getOtherPosition();
+	float getBend();
+	float getBendRange();
+	float getPercussiveness();
+	void setPositionCrossFadeDip(float newWeight);
+private:
+	void renderKey(const key_sample* buffer, unsigned int n, int state);
+	std::vector<key_mask_word> unsettledKeys;
+	std::vector<int> pastStates;
+	std::vector<int> states;
+	std::vector<unsigned int> timestampsDown;
+	std::vector<unsigned int> timestampsProgress;
+	unsigned int numKeys;
+	int monoKey = 0;
+	int otherKey = 0;
+	float bend = 0;
+	float position = 0;
+	float otherPosition = 0;
+	float percussiveness = 0;
+	unsigned int timestamp;
+	float bendRange = 0;
+	float highestPositionHysteresis = 0;
+	unsigned int lastPercussivenessTimestamp = 0;
+#ifdef DEBEND
+	int lastBentTo = -1;
+	int lastBentFrom = -1;
+#endif /* DEBEND */
+	// tunables
+	float positionCrossFadeDip = 0.1;
+	static constexpr float bendPrimaryDisengageThreshold = key_position_to_float(kPositionTrackerPressOffThreshold);
+	static constexpr float bendOnThreshold = 0.1;
+	static constexpr int bendMaxDistance = 4;
+	static constexpr float highestPositionHysteresisStart = 0.03;
+	static constexpr float highestPositionHysteresisDecay = 0.95;
+	static constexpr float pressingKeyOnThreshold = 0.4;
+};
@@ -0,0 +1,392 @@
+// Regression tests of KeyboardState and of the mask searches it is built on.
+//
+// - The monophonic output of KeyboardState, with the default parameters, is
+//   compared frame by frame with KeyboardStateReference, the implementation
+//   it replaced, on synthetic gestures (see SyntheticGestures.h) and on any
+//   capture files (see KeyCapture.h) given on the command line, with and
+//   without the mask of active keys from KeyboardTracker.
+// - In polyphonic mode, scripted presses check that each key pressed gets a
+//   voice of its own, that the voice that started first is taken over when
+//   all are busy, that a key pressed next to a held one bends it, and that
+//   the voices are freed once the keys are released.
+// - setParameters() is called from a second thread while render() runs,
+//   with valid and invalid parameters.
+// - keyMaskMax() and keyMaskScreen() are compared with plain loops over all
+//   ranges of random frames and masks, for floats and int16 samples. This
+//   tests the vector paths KeyMask.cpp was built with, see
+//   keyboard-state-test-scalar in the Makefile for the plain ones.
+//
+// Usage: keyboard-state-test [<capture file>...]
+// Prints the first few failures of each test and returns non-zero if any.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#include "KeyboardTracker.h"
+#include "KeyboardState.h"
+#include "KeyboardStateReference.h"
+#include "KeyCapture.h"
+#include "SyntheticGestures.h"
+
+static unsigned int gFailures = 0;
+
+static bool check(bool condition, const char* test, const std::string& what)
+{
+	if(!condition)
+	{
+		if(++gFailures <= 20)
+			fprintf(stderr, "%s: %s\n", test, what.c_str());
+	}
+	return condition;
+}
+
+static std::string format(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static std::string format(const char* format, ...)
+{
+	char str[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(str, sizeof(str), format, args);
+	va_end(args);
+	return str;
+}
+
+static void drainNotifications(KeyboardTracker& keyboardTracker)
+{
+	KeyPositionTrackerNotification notification;
+	while(keyboardTracker.popNotification(notification))
+		;
+}
+
+// Monophonic output against KeyboardStateReference. Each gets a tracker of
+// its own, as they both consume the state changes of the trackers
+static size_t compareMonophonic(const char* name, unsigned int numKeys, const std::vector<float>& frames, bool useActiveKeys)
+{
+	size_t numFrames = frames.size() / numKeys;
+	KeyboardTracker keyboardTracker(numKeys, 1000);
+	KeyboardTracker referenceTracker(numKeys, 1000);
+	KeyboardState keyboardState(numKeys);
+	KeyboardStateReference reference(numKeys);
+	for(size_t n = 0; n < numFrames; ++n)
+	{
+		const float* frame = frames.data() + n * numKeys;
+		keyboardTracker.processFrame(frame, n);
+		referenceTracker.processFrame(frame, n);
+		keyboardState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, useActiveKeys ? keyboardTracker.getActiveKeys() : nullptr);
+		reference.render(referenceTracker.getBuffers().latestFrame(), referenceTracker.getTrackers(), 0, -1, useActiveKeys ? referenceTracker.getActiveKeys() : nullptr);
+		float values[] = { (float)keyboardState.getKey(), (float)keyboardState.getOtherKey(), keyboardState.getPosition(), keyboardState.getOtherPosition(), keyboardState.getBend(), keyboardState.getBendRange(), keyboardState.getPercussiveness() };
+		float expected[] = { (float)reference.getKey(), (float)reference.getOtherKey(), reference.getPosition(), reference.getOtherPosition(), reference.getBend(), reference.getBendRange(), reference.getPercussiveness() };
+		if(!check(0 == memcmp(values, expected, sizeof(values)), "monophonic",
+			format("%s, %u keys%s, frame %zu: key %g other %g position %g other %g bend %g range %g percussiveness %g, expected %g %g %g %g %g %g %g",
+				name, numKeys, useActiveKeys ? ", active keys" : "", n,
+				values[0], values[1], values[2], values[3], values[4], values[5], values[6],
+				expected[0], expected[1], expected[2], expected[3], expected[4], expected[5], expected[6])))
+			return n;
+		drainNotifications(keyboardTracker);
+		drainNotifications(referenceTracker);
+	}
+	return numFrames;
+}
+
+static void testMonophonic(int argc, char** argv)
+{
+	const size_t numFrames = 20000;
+	size_t frames = 0;
+	for(unsigned int numKeys : {25, 88})
+	{
+		for(int gesture = 0; gesture < kNumGestures; ++gesture)
+		{
+			SyntheticGestures gestures(numKeys, gesture);
+			std::vector<float> positions(numKeys * numFrames);
+			for(size_t n = 0; n < numFrames; ++n)
+				gestures.render(positions.data() + n * numKeys);
+			for(bool useActiveKeys : {false, true})
+				frames += compareMonophonic(kGestureNames[gesture], numKeys, positions, useActiveKeys);
+		}
+	}
+	for(int n = 1; n < argc; ++n)
+	{
+		KeyCaptureReader reader;
+		if(!check(reader.open(argv[n]), "monophonic", format("cannot read %s", argv[n])))
+			continue;
+		unsigned int numKeys = reader.getNumKeys();
+		std::vector<float> positions(numKeys * reader.getNumFrames());
+		for(size_t f = 0; f < reader.getNumFrames(); ++f)
+			reader.getFrame(f, positions.data() + f * numKeys);
+		for(bool useActiveKeys : {false, true})
+			frames += compareMonophonic(argv[n], numKeys, positions, useActiveKeys);
+	}
+	printf("monophonic: %zu frames compared\n", frames);
+}
+
+// A key going from rest to fully down, held, and back, in frames. It goes
+// slightly past the held position, as keys do, or the trackers would not
+// find the end of the press
+struct ScriptedPress
+{
+	unsigned int key;
+	size_t start;
+	size_t hold;
+	size_t attack = 20;
+	size_t release = 30;
+	float position(size_t frame) const
+	{
+		const float down = 0.95;
+		if(frame < start)
+			return 0;
+		frame -= start;
+		if(frame < attack)
+			return frame / (float)attack;
+		frame -= attack;
+		if(frame < hold)
+			return std::max(down, 1 - 0.01f * frame);
+		frame -= hold;
+		if(frame < release)
+			return down * (1 - frame / (float)release);
+		return 0;
+	}
+};
+
+// The keys the voices are playing, in voice order
+static std::string voiceKeys(KeyboardState& keyboardState)
+{
+	std::string keys;
+	for(unsigned int v = 0; v < keyboardState.getNumVoices(); ++v)
+		keys += (v ? " " : "") + std::to_string(keyboardState.getVoice(v).key);
+	return keys;
+}
+
+static void testPolyphonic()
+{
+	const unsigned int numKeys = 88;
+	const unsigned int numVoices = 4;
+	// the trackers only find the end of a press once their buffers have
+	// filled up, so all keys rest for that long first
+	const size_t rest = 1100;
+	// four keys held, one after the other, then a fifth one takes over the
+	// voice of the first, a key next to the fifth bends it, and all are
+	// released
+	const std::vector<ScriptedPress> presses = {
+		{ 10, rest + 100, 1100 },
+		{ 20, rest + 200, 1000 },
+		{ 30, rest + 300, 900 },
+		{ 40, rest + 400, 800 },
+		{ 60, rest + 500, 700 },
+		{ 62, rest + 600, 200 },
+	};
+	// what the voices are expected to be playing at some frames
+	const struct {
+		size_t frame;
+		const char* keys;
+		int bendingVoice;
+	} checkpoints[] = {
+		{ rest + 50, "-1 -1 -1 -1", -1 },
+		{ rest + 150, "10 -1 -1 -1", -1 },
+		{ rest + 250, "10 20 -1 -1", -1 },
+		{ rest + 450, "10 20 30 40", -1 },
+		{ rest + 550, "60 20 30 40", -1 },
+		{ rest + 700, "60 20 30 40", 0 },
+		{ rest + 900, "60 20 30 40", -1 },
+		{ rest + 1300, "-1 -1 -1 -1", -1 },
+	};
+	KeyboardTracker keyboardTracker(numKeys, 1000);
+	KeyboardState keyboardState(numKeys, numVoices);
+	std::vector<float> frame(numKeys);
+	uint32_t noise = 1;
+	size_t checkpoint = 0;
+	for(size_t n = 0; checkpoint < sizeof(checkpoints) / sizeof(checkpoints[0]); ++n)
+	{
+		// with a little sensor noise
+		for(unsigned int k = 0; k < numKeys; ++k)
+		{
+			noise = noise * 1664525 + 1013904223;
+			frame[k] = (noise >> 8) % 1000 * 0.00001f;
+		}
+		for(auto& press : presses)
+			frame[press.key] += press.position(n);
+		keyboardTracker.processFrame(frame.data(), n);
+		keyboardState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, keyboardTracker.getActiveKeys());
+		drainNotifications(keyboardTracker);
+		if(n != checkpoints[checkpoint].frame)
+			continue;
+		auto& expected = checkpoints[checkpoint];
+		++checkpoint;
+		std::string keys = voiceKeys(keyboardState);
+		check(keys == expected.keys, "polyphonic", format("frame %zu: voices playing %s, expected %s", n, keys.c_str(), expected.keys));
+		for(unsigned int v = 0; v < numVoices; ++v)
+		{
+			const KeyboardState::Voice& voice = keyboardState.getVoice(v);
+			bool bending = 0 != voice.bendRange;
+			check(bending == ((int)v == expected.bendingVoice), "polyphonic", format("frame %zu: voice %u %s", n, v, bending ? "bending" : "not bending"));
+		}
+	}
+	printf("polyphonic: %zu checkpoints\n", checkpoint);
+}
+
+// The outputs that only depend on the parameters through the range of
+// distances a bend can have
+static bool isValidOutput(KeyboardState& keyboardState, unsigned int numKeys, int maxDistance)
+{
+	return keyboardState.getKey() >= 0 && keyboardState.getKey() < (int)numKeys
+		&& std::isfinite(keyboardState.getPosition())
+		&& std::isfinite(keyboardState.getBend())
+		&& std::abs(keyboardState.getBendRange()) <= maxDistance;
+}
+
+static void testParametersFromThread()
+{
+#ifdef KEYBOARD_STATE_CONSTANT_PARAMETERS
+	printf("parameters: skipped, built with KEYBOARD_STATE_CONSTANT_PARAMETERS\n");
+#else /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+	const unsigned int numKeys = 88;
+	const size_t numSets = 2000;
+	KeyboardStateParameters sets[2];
+	sets[1].bendOnThreshold = 0.2;
+	sets[1].bendMaxDistance = 12;
+	sets[1].highestPositionHysteresisStart = 0.1;
+	sets[1].highestPositionHysteresisDecay = 0.5;
+	sets[1].pressingKeyOnThreshold = 0.6;
+	KeyboardStateParameters invalid[5];
+	invalid[0].bendOnThreshold = 0.9; // past the press position
+	invalid[1].bendMaxDistance = -1;
+	invalid[2].highestPositionHysteresisDecay = 1.5;
+	invalid[3].pressingKeyOnThreshold = 1;
+	invalid[4].highestPositionHysteresisStart = NAN;
+
+	KeyboardTracker keyboardTracker(numKeys, 1000);
+	KeyboardState keyboardState(numKeys);
+	SyntheticGestures gestures(numKeys, kGestureGlissando);
+	std::atomic<bool> done{false};
+	size_t accepted = 0;
+	size_t rejected = 0;
+	std::thread setter([&]() {
+		for(size_t n = 0; n < numSets; ++n)
+		{
+			for(auto& parameters : invalid)
+				rejected += !keyboardState.setParameters(parameters);
+			// render() takes them over on its next call
+			while(!keyboardState.setParameters(sets[n % 2]))
+				std::this_thread::yield();
+			++accepted;
+			KeyboardStateParameters parameters = keyboardState.getParameters();
+			check(0 == memcmp(&parameters, &sets[n % 2], sizeof(parameters)), "parameters", format("set %zu not the latest", n));
+		}
+		done = true;
+	});
+	std::vector<float> frame(numKeys);
+	size_t n;
+	for(n = 0; !done || n < 1000; ++n)
+	{
+		gestures.render(frame.data());
+		keyboardTracker.processFrame(frame.data(), n);
+		keyboardState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, keyboardTracker.getActiveKeys());
+		drainNotifications(keyboardTracker);
+		check(isValidOutput(keyboardState, numKeys, sets[1].bendMaxDistance), "parameters", format("frame %zu: key %d position %g bend %g range %g",
+			n, keyboardState.getKey(), keyboardState.getPosition(), keyboardState.getBend(), keyboardState.getBendRange()));
+		// let the other thread in, where there are few cores
+		std::this_thread::yield();
+	}
+	setter.join();
+	check(accepted == numSets, "parameters", format("%zu of %zu sets accepted", accepted, numSets));
+	check(rejected == numSets * 5, "parameters", format("%zu of %zu invalid sets rejected", rejected, numSets * 5));
+	printf("parameters: %zu sets while rendering %zu frames\n", accepted, n);
+#endif /* KEYBOARD_STATE_CONSTANT_PARAMETERS */
+}
+
+// What keyMaskMax() should return, one key at a time
+template <typename T>
+static int maxReference(const T* frame, const key_mask_word* mask, unsigned int first, unsigned int last, T floor)
+{
+	int max = -1;
+	for(unsigned int n = first; n < last; ++n)
+	{
+		if(keyMaskGet(mask, n) && frame[n] > floor && (max < 0 || frame[n] > frame[max]))
+			max = n;
+	}
+	return max;
+}
+
+template <typename T>
+static void testKeyMask(const char* type, T (*sample)(uint32_t random), T floor, size_t& searches)
+{
+	const unsigned int maxKeys = 100;
+	uint32_t random = 1;
+	auto next = [&random]() {
+		random = random * 1664525 + 1013904223;
+		return random >> 8;
+	};
+	std::vector<T> frame(maxKeys);
+	std::vector<key_mask_word> mask(keyMaskWords(maxKeys));
+	std::vector<key_mask_word> expectedMask(keyMaskWords(maxKeys));
+	for(unsigned int run = 0; run < 200; ++run)
+	{
+		unsigned int numKeys = 1 + next() % maxKeys;
+		// from masks with few keys to all keys set
+		unsigned int density = run % 5;
+		for(unsigned int n = 0; n < numKeys; ++n)
+			frame[n] = sample(next());
+		for(unsigned int n = 0; n < numKeys; ++n)
+			keyMaskSet(mask.data(), n, next() % 4 < density);
+
+		for(unsigned int n = 0; n < expectedMask.size(); ++n)
+			expectedMask[n] = 0;
+		for(unsigned int n = 0; n < numKeys; ++n)
+			keyMaskSet(expectedMask.data(), n, frame[n] > floor);
+		std::vector<key_mask_word> screened(keyMaskWords(numKeys));
+		keyMaskScreen(frame.data(), numKeys, floor, screened.data());
+		check(0 == memcmp(screened.data(), expectedMask.data(), screened.size() * sizeof(screened[0])), "keyMaskScreen",
+			format("%s, %u keys: differs", type, numKeys));
+
+		for(unsigned int first = 0; first < numKeys; ++first)
+		{
+			for(unsigned int last = first; last <= numKeys; ++last)
+			{
+				int max = keyMaskMax(frame.data(), mask.data(), first, last, floor);
+				int expected = maxReference(frame.data(), mask.data(), first, last, floor);
+				check(max == expected, "keyMaskMax", format("%s, %u keys, [%u, %u): %d, expected %d", type, numKeys, first, last, max, expected));
+				++searches;
+			}
+		}
+	}
+}
+
+// Few distinct values, so that there are ties, some of them below the floor
+static float floatSample(uint32_t random)
+{
+	return (random % 16) / 16.f - 0.1f;
+}
+
+static int16_t intSample(uint32_t random)
+{
+	return (int16_t)((random % 16) * 4096 - 8192);
+}
+
+static void testKeyMasks()
+{
+	size_t searches = 0;
+	testKeyMask<float>("float", floatSample, 0.1f, searches);
+	testKeyMask<int16_t>("int16", intSample, 3000, searches);
+	printf("key masks (vectorized with %s): %zu searches\n", keyMaskVectorPaths(), searches);
+}
+
+int main(int argc, char** argv)
+{
+	testKeyMasks();
+	testPolyphonic();
+	testParametersFromThread();
+	testMonophonic(argc, argv);
+	if(gFailures)
+	{
+		fprintf(stderr, "%u failures\n", gFailures);
+		return 1;
+	}
+	printf("all passed\n");
+	return 0;
+}
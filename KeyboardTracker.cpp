@@ -0,0 +1,291 @@
+#include "KeyboardTracker.h"
+#include "XenomaiWraps.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+KeyboardTracker::KeyboardTracker(unsigned int numKeys, unsigned int bufferLength)
+{
+	setup(numKeys, bufferLength);
+}
+
+KeyboardTracker::~KeyboardTracker()
+{
+	stopShards();
+}
+
+bool KeyboardTracker::setup(unsigned int numKeys, unsigned int bufferLength, unsigned int notificationQueueLength,
+		unsigned int numShards, int firstCpu, int priority)
+{
+	stopShards();
+	if(!keyBuffers.setup(numKeys, bufferLength))
+		return false;
+	if(!notifications.setup(notificationQueueLength))
+		return false;
+	this->numKeys = numKeys;
+	activeKeys.assign(keyMaskWords(numKeys), 0);
+	busyKeys.assign(keyMaskWords(numKeys), 0);
+	keyPositionTrackers.clear();
+	keyBuffer.clear();
+	// the trackers hold references to the elements of keyBuffer: avoid
+	// reallocation in the loop below
+	keyBuffer.reserve(numKeys);
+	keyPositionTrackers.reserve(numKeys);
+	for(unsigned int n = 0; n < numKeys; ++n)
+	{
+		keyBuffer.emplace_back(keyBuffers, n);
+		keyPositionTrackers.emplace_back(10, keyBuffer[n]);
+		keyPositionTrackers.back().setNotificationQueue(&notifications, n);
+		keyPositionTrackers.back().engage();
+	}
+	numShards = std::min(numShards, numKeys);
+	if(numShards <= 1)
+		return true;
+	for(auto& keyPositionTracker : keyPositionTrackers)
+		keyPositionTracker.setScopeLogging(false);
+	for(unsigned int s = 0; s < numShards; ++s)
+	{
+		std::unique_ptr<Shard> shard(new Shard);
+		shard->tracker = this;
+		shard->first = numKeys * s / numShards;
+		shard->last = numKeys * (s + 1) / numShards;
+		shard->busyKeys.assign(keyMaskWords(numKeys), 0);
+		if(s)
+		{
+			if(!shard->notifications.setup(notificationQueueLength))
+				return false;
+			for(unsigned int n = shard->first; n < shard->last; ++n)
+				keyPositionTrackers[n].setNotificationQueue(&shard->notifications, n);
+		}
+		shards.push_back(std::move(shard));
+	}
+	long numCpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if(priority >= 0)
+	{
+		struct sched_param param = {};
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	for(unsigned int s = 1; s < numShards; ++s)
+	{
+		Shard& shard = *shards[s];
+		shard.claimed = shard.done = shardFrames.load();
+		if(RT_CALL(sem_init)(&shard.start, 0, 0))
+		{
+			fprintf(stderr, "Error creating the semaphore for shard %u: %s\n", s, strerror(errno));
+			break;
+		}
+		shard.startInitialised = true;
+		if(firstCpu >= 0)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET((firstCpu + s - 1) % numCpus, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		int ret = RT_CALL(pthread_create)(&shard.thread, &attr, shardThreadLoop, &shard);
+		if(ret)
+		{
+			fprintf(stderr, "Error creating the thread for shard %u: %s\n", s, strerror(ret));
+			break;
+		}
+		shard.threadRunning = true;
+	}
+	pthread_attr_destroy(&attr);
+	if(!shards.back()->threadRunning)
+	{
+		stopShards();
+		return false;
+	}
+	return true;
+}
+
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+void KeyboardTracker::processKeys(unsigned int first, unsigned int last, key_mask_word* busy, frame_type timestamp)
+{
+	for(unsigned int w = first / kKeyMaskWordBits; w < keyMaskWords(last); ++w)
+	{
+		key_mask_word bits = activeKeys[w] & keyMaskRange(w, first, last);
+		while(bits)
+		{
+			unsigned int n = w * kKeyMaskWordBits + keyMaskLowestBit(bits);
+			bits &= bits - 1;
+			KeyPositionTracker& tracker = keyPositionTrackers[n];
+			tracker.triggerReceived(timestamp);
+			keyMaskSet(busy, n, !tracker.resting());
+		}
+	}
+}
+
+// Take the keys of shard for frame, unless the worker or the caller already
+// did. Every shard is taken exactly once per frame, so claimed is frame - 1
+// until then
+bool KeyboardTracker::claimShard(Shard& shard, uint64_t frame)
+{
+	uint64_t previous = frame - 1;
+	return shard.claimed.compare_exchange_strong(previous, frame, std::memory_order_acq_rel);
+}
+
+void* KeyboardTracker::shardThreadLoop(void* arg)
+{
+	Shard& shard = *(Shard*)arg;
+	KeyboardTracker& that = *shard.tracker;
+	while(1)
+	{
+		if(RT_CALL(sem_wait)(&shard.start) && EINTR != errno)
+			break; // the caller will process this shard
+		if(that.shardsShouldStop.load(std::memory_order_acquire))
+			break;
+		// if we woke up late, the caller may have taken this frame already
+		uint64_t frame = that.shardFrames.load(std::memory_order_acquire);
+		if(!that.claimShard(shard, frame))
+			continue;
+		that.processKeys(shard.first, shard.last, shard.busyKeys.data(), that.shardTimestamp);
+		shard.done.store(frame, std::memory_order_release);
+	}
+	return NULL;
+}
+
+void KeyboardTracker::stopShards()
+{
+	shardsShouldStop.store(true, std::memory_order_release);
+	for(auto& shard : shards)
+	{
+		if(shard->threadRunning)
+		{
+			RT_CALL(sem_post)(&shard->start);
+			RT_CALL(pthread_join)(shard->thread, NULL);
+		}
+		if(shard->startInitialised)
+			RT_CALL(sem_destroy)(&shard->start);
+	}
+	shards.clear();
+	shardsShouldStop = false;
+}
+
+void KeyboardTracker::processFrame(const float* frame, frame_type timestamp)
+{
+	keyBuffers.postCallback(frame, numKeys, timestamp);
+	trackFrame(timestamp);
+}
+
+key_sample* KeyboardTracker::nextFrame()
+{
+	return keyBuffers.nextFrame();
+}
+
+void KeyboardTracker::processFrame(frame_type timestamp)
+{
+	keyBuffers.commitFrame(timestamp);
+	trackFrame(timestamp);
+}
+
+// Run the trackers on the frame just stored
+void KeyboardTracker::trackFrame(frame_type timestamp)
+{
+	// screen what was stored, so that the test matches KeyPositionTracker::idle()
+	// also where the fixed-point build quantizes the positions
+	keyMaskScreen(keyBuffers.latestFrame(), numKeys, (key_sample)kDefaultKeyIdleThreshold, activeKeys.data());
+	for(unsigned int w = 0; w < activeKeys.size(); ++w)
+		activeKeys[w] |= busyKeys[w];
+	if(shards.empty())
+	{
+		processKeys(0, numKeys, busyKeys.data(), timestamp);
+		return;
+	}
+	// wake the workers and process the first shard here
+	shardTimestamp = timestamp;
+	uint64_t frame = shardFrames.load(std::memory_order_relaxed) + 1;
+	shardFrames.store(frame, std::memory_order_release);
+	for(unsigned int s = 1; s < shards.size(); ++s)
+		RT_CALL(sem_post)(&shards[s]->start);
+	processKeys(shards[0]->first, shards[0]->last, shards[0]->busyKeys.data(), timestamp);
+	// then the shards whose worker has not started yet, rather than
+	// waiting for it to be scheduled
+	for(unsigned int s = 1; s < shards.size(); ++s)
+	{
+		Shard& shard = *shards[s];
+		if(claimShard(shard, frame))
+		{
+			processKeys(shard.first, shard.last, shard.busyKeys.data(), timestamp);
+			shard.done.store(frame, std::memory_order_relaxed);
+		}
+	}
+	// the others are being processed: this waits for one shard at most
+	for(unsigned int s = 1; s < shards.size(); ++s)
+	{
+		while(shards[s]->done.load(std::memory_order_acquire) != frame)
+			cpuRelax();
+	}
+	// merge the results, in key order
+	for(unsigned int w = 0; w < busyKeys.size(); ++w)
+	{
+		busyKeys[w] = 0;
+		for(auto& shard : shards)
+			busyKeys[w] |= shard->busyKeys[w];
+	}
+	KeyPositionTrackerNotification notification;
+	for(unsigned int s = 1; s < shards.size(); ++s)
+	{
+		while(shards[s]->notifications.pop(notification))
+			notifications.push(notification);
+	}
+}
+
+unsigned int KeyboardTracker::getNumKeys()
+{
+	return numKeys;
+}
+
+unsigned int KeyboardTracker::getNumShards()
+{
+	return shards.empty() ? 1 : shards.size();
+}
+
+KeyBuffers& KeyboardTracker::getBuffers()
+{
+	return keyBuffers;
+}
+
+std::vector<KeyPositionTracker>& KeyboardTracker::getTrackers()
+{
+	return keyPositionTrackers;
+}
+
+const key_mask_word* KeyboardTracker::getActiveKeys()
+{
+	return activeKeys.data();
+}
+
+bool KeyboardTracker::popNotification(KeyPositionTrackerNotification& notification)
+{
+	return notifications.pop(notification);
+}
+
+size_t KeyboardTracker::getPendingNotifications()
+{
+	return notifications.size();
+}
+
+size_t KeyboardTracker::getDroppedNotifications()
+{
+	size_t dropped = notifications.getDropped();
+	for(auto& shard : shards)
+		dropped += shard->notifications.getDropped();
+	return dropped;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "KeyPositionTracker.h"
+#include "KeyMask.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// KeyboardTracker
+//
+// Owns the position buffers and the KeyPositionTracker of every key on the
+// keyboard, and processes a whole frame of key positions per call. Keys that
+// are at rest are skipped, so that the cost of a frame scales with the number
+// of active keys: a vectorized pass over the frame marks the keys above the
+// idle threshold, and only those and the keys whose tracker is not resting
+// are processed. The trackers keep references into this object: it must not
+// be copied or moved after setup().
+//
+// The keys can be split into shards, contiguous ranges of keys that are
+// processed in parallel: the thread calling processFrame() takes the first
+// shard and one worker thread per shard takes each of the others.
+// Notifications come out in the same order as with a single shard. Workers
+// sleep on a semaphore between frames, a Cobalt one on the board, so they
+// should run with the policy and priority of the caller. The caller never
+// sleeps: it processes itself any shard whose worker has not started on the
+// frame by the time it is done with its own, and only spins on the shards
+// that a worker is in the middle of.
+class KeyboardTracker
+{
+public:
+	KeyboardTracker() {};
+	KeyboardTracker(unsigned int numKeys, unsigned int bufferLength);
+	~KeyboardTracker();
+	// numShards: how many threads process the keys, including the one
+	// calling processFrame(). firstCpu: if not negative, worker n, which
+	// processes shard n, is pinned to CPU firstCpu + n - 1, modulo the number
+	// of CPUs: by default, the caller is expected on CPU 0. priority: if not
+	// negative, the workers run SCHED_FIFO at this priority, which should be
+	// that of the thread calling processFrame(); otherwise they inherit the
+	// scheduling of the thread calling setup().
+	bool setup(unsigned int numKeys, unsigned int bufferLength, unsigned int notificationQueueLength = 1024,
+			unsigned int numShards = 1, int firstCpu = 1, int priority = -1);
+	// Store and process a frame of numKeys positions
+	void processFrame(const float* frame, frame_type timestamp);
+	// The same, for a frame that was written straight into the buffers: fill
+	// the numKeys samples at nextFrame(), then call processFrame(timestamp)
+	key_sample* nextFrame();
+	void processFrame(frame_type timestamp);
+	unsigned int getNumKeys();
+	unsigned int getNumShards();
+	KeyBuffers& getBuffers();
+	std::vector<KeyPositionTracker>& getTrackers();
+	// Keys processed by the latest call to processFrame(), to be passed on
+	// to KeyboardState::render()
+	const key_mask_word* getActiveKeys();
+	// Retrieve the notifications of all trackers, in the order they were
+	// generated. Call from a single, non-real-time thread.
+	bool popNotification(KeyPositionTrackerNotification& notification);
+	// How many notifications are waiting to be retrieved. Can be called from
+	// either side, e.g.: to wake up the consumer after processFrame()
+	size_t getPendingNotifications();
+	// How many notifications were lost because the queue was full
+	size_t getDroppedNotifications();
+private:
+	struct Shard {
+		KeyboardTracker* tracker;
+		unsigned int first;	// keys [first, last)
+		unsigned int last;
+		std::vector<key_mask_word> busyKeys; // only the bits of this shard's keys are used
+		// notifications of this shard's keys, moved to the main queue after
+		// each frame. Unused by the first shard, which pushes to the main queue
+		KeyPositionTrackerNotificationQueue notifications;
+		pthread_t thread;
+		bool threadRunning = false;
+		sem_t start;	// posted at every frame
+		bool startInitialised = false;
+		// the latest frame whose keys were taken, by the worker or by the
+		// caller, and the latest one whose keys were processed
+		std::atomic<uint64_t> claimed{0};
+		std::atomic<uint64_t> done{0};
+	};
+	void trackFrame(frame_type timestamp);
+	void processKeys(unsigned int first, unsigned int last, key_mask_word* busy, frame_type timestamp);
+	bool claimShard(Shard& shard, uint64_t frame);
+	static void* shardThreadLoop(void* arg);
+	void stopShards();
+	KeyBuffers keyBuffers;
+	std::vector<KeyBuffer> keyBuffer;
+	std::vector<KeyPositionTracker> keyPositionTrackers;
+	KeyPositionTrackerNotificationQueue notifications;
+	std::vector<key_mask_word> activeKeys;
+	std::vector<key_mask_word> busyKeys; // trackers that are not resting
+	unsigned int numKeys = 0;
+	std::vector<std::unique_ptr<Shard>> shards; // empty with a single shard
+	frame_type shardTimestamp = 0; // of the frame being processed by the workers
+	std::atomic<uint64_t> shardFrames{0}; // incremented to start a frame on the workers
+	std::atomic<bool> shardsShouldStop{false};
+};
@@ -0,0 +1,48 @@
+#include "KeysScanSource.h"
+#include "KeyPositionTracker.h"
+#include <stdio.h>
+
+KeysScanSource::~KeysScanSource()
+{
+	stop();
+}
+
+bool KeysScanSource::start(Callback callback, void* arg)
+{
+	stop();
+	keys = new Keys;
+	keys->setPostCallback(callback, arg);
+	int ret = keys->start(&topology, NULL);
+	if(ret)
+	{
+		fprintf(stderr, "Error starting the Keys board: %d\n", ret);
+		delete keys;
+		keys = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void KeysScanSource::stop()
+{
+	if(!keys)
+		return;
+	keys->stopAndWait();
+	delete keys;
+	keys = nullptr;
+}
+
+unsigned int KeysScanSource::getNumKeys()
+{
+	return topology.getHighestNote() - topology.getLowestNote() + 1;
+}
+
+int KeysScanSource::getLowestNote()
+{
+	return topology.getLowestNote();
+}
+
+float KeysScanSource::getScanRate()
+{
+	return kKeyScanFrameRate;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <Keys.h>
+#include "ScanSource.h"
+
+// KeysScanSource
+//
+// The Keys board, only available on Bela. Set up the boards through
+// getTopology() before start(), and calibrate through getKeys() after it.
+class KeysScanSource : public ScanSource
+{
+public:
+	KeysScanSource() {};
+	~KeysScanSource();
+	BoardsTopology& getTopology() { return topology; }
+	Keys* getKeys() { return keys; }
+	bool start(Callback callback, void* arg) override;
+	void stop() override;
+	unsigned int getNumKeys() override;
+	int getLowestNote() override;
+	// Nominal: Keys does not report it
+	float getScanRate() override;
+private:
+	BoardsTopology topology;
+	Keys* keys = nullptr;
+};
@@ -23,26 +23,50 @@
 #ifndef KEYCONTROL_PIANO_TYPES_H
 #define KEYCONTROL_PIANO_TYPES_H
 
-#undef FIXED_POINT_PIANO_SAMPLES
+#include <algorithm>
+
+// Define FIXED_POINT_PIANO_SAMPLES (e.g.: with -D) for an integer-only tracking
+// pipeline, for boards without a good FPU. The tracker's timestamps are
+// integer frames (see frame_type in Types.h) either way.
 
 // Data types.  Allow for floating-point (more flexible) or fixed-point (faster) arithmetic
-// on piano key positions
+// on piano key positions. key_sample is the type used to store positions in
+// the key buffers.
 #ifdef FIXED_POINT_PIANO_SAMPLES
+// Positions are scaled so that a fully pressed key is 4096. Velocities are
+// scaled by 65536, per frame. Samples are stored as int16.
 typedef int key_position;
 typedef int key_velocity;
-#define scale_key_position(x) 4096*(key_position)(x)
-#define key_position_to_float(x) ((float)x/4096.0)
+typedef short key_sample;
+#define scale_key_position(x) ((key_position)((x)*4096 + ((x) < 0 ? -0.5 : 0.5)))
+// Thresholds on positive positions, rounded down or up to a whole sample so
+// that integer compares on quantized samples give the same result as the
+// float ones: key_threshold_down() goes with > and <=, key_threshold_up()
+// with < and >=
+#define key_threshold_down(x) ((key_position)((x)*4096))
+#define key_threshold_up(x) ((key_position)((x)*4096) + ((x)*4096 > (key_position)((x)*4096)))
+#define key_position_to_float(x) ((float)(x)/4096.f)
+#define float_to_key_sample(x) ((key_sample)std::max(-32768.f, std::min(32767.f, (x)*4096.f)))
 #define key_abs(x) abs(x)
-#define calculate_key_velocity(dpos, dt) (key_velocity)((65536*dpos)/(key_position)dt)
-#define scale_key_velocity(x) (65536/4096)*(key_velocity)(x) // FIXME: TEST THIS!
+// samples that share a timestamp (e.g.: the empty start of a buffer) have no velocity
+#define calculate_key_velocity(dpos, dt) (key_velocity)((dt) ? (16*(key_velocity)(dpos))/(dt) : 0)
+#define scale_key_velocity(x) ((key_velocity)((x)*65536))
+#define key_velocity_to_float(x) ((float)(x)/65536.f)
+#define divide_key_position(x, n) ((key_position)((x)/(long long)(n)))
 #else
 typedef float key_position;
 typedef float key_velocity;
+typedef float key_sample;
 #define scale_key_position(x) (key_position)(x)
+#define key_threshold_down(x) (key_position)(x)
+#define key_threshold_up(x) (key_position)(x)
 #define key_position_to_float(x) (x)
+#define float_to_key_sample(x) (x)
 #define key_abs(x) fabsf(x)
 #define calculate_key_velocity(dpos, dt) (key_velocity)(dpos/(key_position)dt)
 #define scale_key_velocity(x) (key_velocity)(x)
+#define key_velocity_to_float(x) (x)
+#define divide_key_position(x, n) ((key_position)(x)/(key_position)(n))
 #endif /* FIXED_POINT_PIANO_SAMPLES */
 
 #endif /* KEYCONTROL_PIANO_TYPES_H */
@@ -0,0 +1,118 @@
+#include "ScanSource.h"
+#include <stdio.h>
+#include <time.h>
+
+ThreadedScanSource::~ThreadedScanSource()
+{
+	stop();
+}
+
+bool ThreadedScanSource::start(Callback callback, void* arg)
+{
+	stop();
+	if(!numKeys || scanRate <= 0)
+		return false;
+	this->callback = callback;
+	callbackArg = arg;
+	shouldStop = false;
+	if(pthread_create(&thread, NULL, threadLoop, this))
+	{
+		fprintf(stderr, "Error creating the scan source thread\n");
+		return false;
+	}
+	threadRunning = true;
+	return true;
+}
+
+void ThreadedScanSource::stop()
+{
+	if(!threadRunning)
+		return;
+	shouldStop = true;
+	pthread_join(thread, NULL);
+	threadRunning = false;
+}
+
+static void addNanoseconds(struct timespec& time, long ns)
+{
+	time.tv_nsec += ns;
+	while(time.tv_nsec >= 1000000000)
+	{
+		time.tv_nsec -= 1000000000;
+		++time.tv_sec;
+	}
+}
+
+void* ThreadedScanSource::threadLoop(void* arg)
+{
+	ThreadedScanSource& that = *(ThreadedScanSource*)arg;
+	std::vector<float> frame(that.numKeys);
+	long period = 1000000000 / that.scanRate;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(!that.shouldStop)
+	{
+		if(!that.render(frame.data()))
+		{
+			if(that.endCallback)
+				that.endCallback(that.endArg);
+			break;
+		}
+		that.callback(that.callbackArg, frame.data(), that.numKeys);
+		++that.frames;
+		if(!that.paced)
+			continue;
+		addNanoseconds(next, period);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+			++that.overruns;
+		else
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+bool FileScanSource::setup(const char* path, bool paced, bool loop)
+{
+	stop();
+	if(!reader.open(path))
+		return false;
+	numKeys = reader.getNumKeys();
+	lowestNote = reader.getHeader().lowestNote;
+	scanRate = reader.getHeader().scanRate;
+	this->paced = paced;
+	this->loop = loop;
+	frame = 0;
+	return numKeys && scanRate > 0;
+}
+
+bool FileScanSource::render(float* out)
+{
+	if(frame >= reader.getNumFrames())
+	{
+		if(!loop || !reader.getNumFrames())
+			return false;
+		frame = 0;
+	}
+	reader.getFrame(frame++, out);
+	return true;
+}
+
+bool SyntheticScanSource::setup(unsigned int numKeys, int gesture, float scanRate, bool paced)
+{
+	stop();
+	if(!gestures.setup(numKeys, gesture, scanRate))
+		return false;
+	this->numKeys = numKeys;
+	this->scanRate = scanRate;
+	this->paced = paced;
+	lowestNote = 0;
+	return true;
+}
+
+bool SyntheticScanSource::render(float* frame)
+{
+	gestures.render(frame);
+	return true;
+}
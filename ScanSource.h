@@ -0,0 +1,105 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include "KeyCapture.h"
+#include "SyntheticGestures.h"
+
+// ScanSource
+//
+// Where the frames of key positions come from: the Keys board (see
+// KeysScanSource), or one of the stand-ins below, which run on any Linux
+// machine. Once started, a source calls the callback from its own thread
+// with each frame, as Keys does with its post callback: getNumKeys()
+// positions, starting from getLowestNote().
+class ScanSource
+{
+public:
+	typedef void (*Callback)(void* arg, float* buffer, unsigned int length);
+	virtual ~ScanSource() {}
+	virtual bool start(Callback callback, void* arg) = 0;
+	// Stop calling the callback and wait for the thread that calls it
+	virtual void stop() = 0;
+	virtual unsigned int getNumKeys() = 0;
+	virtual int getLowestNote() = 0;
+	// Nominal frames per second
+	virtual float getScanRate() = 0;
+	// Called from the thread of the source if it runs out of frames
+	void setEndCallback(void (*callback)(void* arg), void* arg)
+	{
+		endCallback = callback;
+		endArg = arg;
+	}
+protected:
+	void (*endCallback)(void*) = nullptr;
+	void* endArg = nullptr;
+};
+
+// ThreadedScanSource
+//
+// Base of the stand-ins: a normal pthread renders a frame and calls the
+// callback once every 1/getScanRate() seconds, on an absolute schedule so
+// that the rate does not drift, or back to back if not paced. A frame that
+// is late is not skipped, but counted as an overrun.
+class ThreadedScanSource : public ScanSource
+{
+public:
+	// Derived classes must stop() in their destructor, as the thread calls render()
+	~ThreadedScanSource();
+	bool start(Callback callback, void* arg) override;
+	void stop() override;
+	unsigned int getNumKeys() override { return numKeys; }
+	int getLowestNote() override { return lowestNote; }
+	float getScanRate() override { return scanRate; }
+	size_t getFrames() { return frames; }
+	size_t getOverruns() { return overruns; }
+protected:
+	// Write the next frame, numKeys positions. Returns false when there
+	// are no more frames
+	virtual bool render(float* frame) = 0;
+	unsigned int numKeys = 0;
+	int lowestNote = 0;
+	float scanRate = 1000;
+	bool paced = true;
+private:
+	static void* threadLoop(void* arg);
+	Callback callback = nullptr;
+	void* callbackArg = nullptr;
+	pthread_t thread;
+	bool threadRunning = false;
+	std::atomic<bool> shouldStop{false};
+	std::atomic<size_t> frames{0};
+	std::atomic<size_t> overruns{0};
+};
+
+// FileScanSource
+//
+// Replays a capture file (see KeyCapture.h), at the rate it was captured at
+// or as fast as possible.
+class FileScanSource : public ThreadedScanSource
+{
+public:
+	~FileScanSource() { stop(); }
+	bool setup(const char* path, bool paced = true, bool loop = false);
+protected:
+	bool render(float* frame) override;
+private:
+	KeyCaptureReader reader;
+	size_t frame = 0;
+	bool loop = false;
+};
+
+// SyntheticScanSource
+//
+// Plays one of the gestures of SyntheticGestures, over and over.
+class SyntheticScanSource : public ThreadedScanSource
+{
+public:
+	~SyntheticScanSource() { stop(); }
+	bool setup(unsigned int numKeys, int gesture, float scanRate = 1000, bool paced = true);
+protected:
+	bool render(float* frame) override;
+private:
+	SyntheticGestures gestures;
+};
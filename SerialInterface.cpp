@@ -1,179 +1,81 @@
 // based on https://github.com/dr-offig/BelaArduinoComms/blob/master/render.cpp
-#include <termios.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include "SerialTransport.h"
 #include "TouchkeyDevice.h"
+#include "SpscQueue.h"
+#include "AnalogDeltaCodec.h"
+#include "TouchkeyFrameParser.h"
+#include "EventLoop.h"
+#include "ScanSource.h"
 #include <poll.h>
 
 void setPostCallback(void(*postCallback)(void* arg, float* buffer, unsigned int length), void* arg);
 
 
-static int _handle;
-
-/*
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo - UsbConfigurationDescriptor -
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .bLength = 9
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .bDescriptorType = 0x02
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .wTotalLength = 32
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .bNumInterfaces = 1
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .bConfigurationValue = 1
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .iConfiguration = 0
-com_silabs_driver_CP210xVCPDriver(<ptr>)::GetCP210xInfo     .bmAttributes = 0x80
-com_silabs_driver_CP210xVCPDriver(<ptr>)::start Interface 0 - Sucessfully loaded the driver
-*/
-int set_interface_attribs(int fd, int speed)
-{
-	struct termios tty;
-
-	if (tcgetattr(fd, &tty) < 0) {
-		printf("Error from tcgetattr: %s\n", strerror(errno));
-			return -1;
-	}
-
-	cfsetospeed(&tty, (speed_t)speed);
-	cfsetispeed(&tty, (speed_t)speed);
-
-	tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
-	tty.c_cflag &= ~CSIZE;
-	tty.c_cflag |= CS8;         /* 8-bit characters */
-	tty.c_cflag &= ~PARENB;     /* no parity bit */
-	tty.c_cflag &= ~CSTOPB;     /* only need 1 stop bit */
-	tty.c_cflag &= ~CRTSCTS;    /* no hardware flowcontrol */
-
-	/* setup for non-canonical mode */
-	tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
-	tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	tty.c_oflag &= ~OPOST;
-
-	/* fetch bytes as they become available */
-	tty.c_cc[VMIN] = 1;
-	tty.c_cc[VTIME] = 1;
-
-	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-		printf("Error from tcsetattr: %s\n", strerror(errno));
-		return -1;
-	}
-	return 0;
-}
-
-
-void set_mincount(int fd, int mcount)
-{
-	struct termios tty;
-
-	if (tcgetattr(fd, &tty) < 0) {
-		printf("Error tcgetattr: %s\n", strerror(errno));
-		return;
-	}
-
-	tty.c_cc[VMIN] = mcount ? 1 : 0;
-	tty.c_cc[VTIME] = 5;        /* half second timer */
-
-	if (tcsetattr(fd, TCSANOW, &tty) < 0) {
-		printf("Error tcsetattr: %s\n", strerror(errno));
-	}
-}
-
-int initSerial(const char *portname, int speed)
-{
-	printf ("Attempting to connect to %s\n", portname);
-	_handle = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-	if (_handle < 0) {
-		printf("Error opening %s: %s\n", portname, strerror(errno));
-		return -1;
-	} else {
-		printf ("Successfully opened %s with file descriptor %d\n", portname, _handle);
-	}
-
-	set_interface_attribs(_handle, speed);
-	set_mincount(_handle, 0); /* set to pure timed read */
-	return 0;
-}
-
-int serialRead(char* buf, size_t len, int timeoutMs)
-{
-	struct pollfd pfd[1];
-	pfd[0].fd = _handle;
-	pfd[0].events = POLLIN;
-	//printf("before poll\n");
-	int result = poll(pfd, 1, timeoutMs);
-	if(result < 0)
-	{
-		fprintf(stderr, "Error polling for serial: %d %s\n", errno, strerror(errno));
-		return errno;
-	} else if (result == 0) {
-		printf("Timeout\n");
-		// timeout
-		return 0;
-	} else if (pfd[0].revents & POLLIN){
-		//printf("before read\n");
-		int rdlen = read(_handle, buf, len);
-		//printf("after read\n");
-		if(rdlen > 0)
-		{
-			if(1 || rdlen != 5)
-			{
-				printf("Serial read %d bytes: ", rdlen);
-				for(unsigned int n = 0; n < rdlen; ++n)
-				{
-					printf("%03d ", buf[n]);
-				}
-				printf("\n");
-			}
-		} 
-		else if (rdlen < 0) {
-			fprintf(stderr, "Error from read: %d: %s\n", rdlen, strerror(errno));
-		}
-		return rdlen;
-	} else {
-		fprintf(stderr, "unknown error while reading serial\n");
-		return -1;
-	}
-}
-
-int serialWrite(const char* buf, size_t len)
-{
-	if(0)
-	{
-		printf("Writing %d bytes: ", len);
-		for(unsigned int n = 0; n < len; ++n)
-			printf("%d ", buf[n]);
-		printf("\n");
-	}
-	int ret = write(_handle, buf, len);
-	if(ret < 0) {
-		fprintf(stderr, "write failed: %d %s\n", errno, strerror(errno));
-	}
-	return ret;
-}
-
-void serialCleanup()
-{
-	close(_handle);
-}
-bool serialSetup(const char* device)
-{
-	return !initSerial(device, B115200);
-}
+static SerialTransport gTransport;
 
 #if 1
 // example application
-#include <signal.h>
 #include <stdint.h>
 #include <pthread.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
 int gShouldStop;
 int gShouldSendScans;
-int frameDataLength = 25;
+unsigned int frameDataLength = 25;
+
+// Scan frames are encoded on the real-time thread and queued, and the
+// serial writer thread writes them out, several at a time. If the queue
+// is full, e.g.: because the host stopped reading, frames are dropped and
+// counted instead of blocking the scanner.
+struct SerialFrame {
+	size_t length;
+	char data[TOUCHKEY_MAX_FRAME_LENGTH];
+};
+static_assert(2 * kAnalogDeltaMaxPayload + 6 <= TOUCHKEY_MAX_FRAME_LENGTH, "compact frames must fit in a SerialFrame");
+static SpscQueue<SerialFrame> gSerialFrames(256);
+// Replies to the host, queued by the main thread, so that only the writer
+// thread ever writes to the port: a frame written by another thread could
+// land in the middle of a partially written batch
+static SpscQueue<SerialFrame> gSerialReplies(8);
+static const unsigned int kSerialFramesPerWrite = 16;
+static size_t gSerialFramesWritten = 0;
+static size_t gSerialWriteErrors = 0;
+static size_t gSerialBacklogPeak = 0; // most frames found waiting in the queue
+static pthread_t gSerialWriteThread;
+// Woken by sendScanFrame() and sendStatusFrame() when the writer thread is idle
+static EventLoop gSerialWriterEvents;
+// The main thread: commands from the host and SIGINT/SIGTERM
+static EventLoop gEventLoop;
+// With -c, scan frames are sent as kFrameTypeAnalogDelta, with one encoder
+// per two-octave block. A block is flagged for resync when the host
+// (re)starts scanning, so that its next frame is a keyframe.
+static bool gDeltaFrames = false;
+static const unsigned int kMaxDeltaBlocks = 8;
+static AnalogDeltaEncoder gDeltaEncoders[kMaxDeltaBlocks];
+static std::atomic<bool> gDeltaFramesResync[kMaxDeltaBlocks];
+// Settings from the host, read by the real-time thread
+static const unsigned int kMaxOctaves = kMaxDeltaBlocks * 2;
+static std::atomic<unsigned int> gScanIntervalMs{0}; // 0: send every scan
+static std::atomic<unsigned int> gNoiseThreshold{0}; // for compact frames
+static std::atomic<uint16_t> gEnabledKeys[kMaxOctaves]; // one bit per note
 
 int sendStatusFrame(int octaves)
 {
-	char frameBuffer[TOUCHKEY_MAX_FRAME_LENGTH];
+	SerialFrame frame;
+	char* frameBuffer = frame.data;
 	int len = 0;
 	frameBuffer[len++] = ESCAPE_CHARACTER;
 	frameBuffer[len++] = kControlCharacterFrameBegin;
@@ -196,187 +98,403 @@ int sendStatusFrame(int octaves)
 	}
 	frameBuffer[len++] = ESCAPE_CHARACTER;
 	frameBuffer[len++] = kControlCharacterFrameEnd;
-	return serialWrite(frameBuffer, len);
+	frame.length = len;
+	if(!gSerialReplies.push(frame))
+		return -1;
+	gSerialWriterEvents.notify();
+	return len;
 }
 
-int sendScanFrame(unsigned char octave, uint32_t timestamp, float* data, int offset)
+// data holds the values of count keys, from the one at index first in the
+// block: the others are sent as missing
+int sendScanFrame(unsigned char octave, uint32_t timestamp, const float* data, unsigned int first, unsigned int count)
 {
-	char frameBuffer[TOUCHKEY_MAX_FRAME_LENGTH];
-	int len = 0;
-	frameBuffer[len++] = ESCAPE_CHARACTER;
-	frameBuffer[len++] = kControlCharacterFrameBegin;
-	frameBuffer[len++] = kFrameTypeAnalog;
-	// Format: [Octave] [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
-	//                   ... (more frames)
-	//                  [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
-	frameBuffer[len++] = octave; //octave
-	// timestamp (i.e. frame ID generated by the device). 32-bit little-endian.
-	memcpy(&frameBuffer[len], &timestamp, sizeof(timestamp));
-	len += sizeof(timestamp);
-	for(unsigned int n = 0; n < offset; ++n)
+	int16_t values[kAnalogDeltaKeys];
+	for(unsigned int n = 0; n < frameDataLength; ++n)
 	{
-		int16_t value = 0;
-		memcpy(&frameBuffer[len], &value, sizeof(value));
-		len += sizeof(value);
+		if(n >= first && n < first + count)
+			values[n] = (1-data[n - first]) * 4096.f;
+		else
+			values[n] = 0;
 	}
-	for(unsigned int n = offset; n < frameDataLength; ++n)
+	// disabled keys are sent as the missing ones
+	for(unsigned int n = first; n < frameDataLength; ++n)
 	{
-		int16_t value = (1-data[n]) * 4096.f;
-		memcpy(&frameBuffer[len], &value, sizeof(value));
-		len += sizeof(value);
+		unsigned int o = octave + n / 12;
+		if(o < kMaxOctaves && !(gEnabledKeys[o].load(std::memory_order_relaxed) & (1 << (n % 12))))
+			values[n] = 0;
 	}
-	frameBuffer[len++] = ESCAPE_CHARACTER;
-	frameBuffer[len++] = kControlCharacterFrameEnd;
-	int ret = serialWrite(frameBuffer, len);
-	if(0 > ret)
+	SerialFrame frame;
+	char* frameBuffer = frame.data;
+	int len = 0;
+	AnalogDeltaEncoder* encoder = NULL;
+	if(gDeltaFrames)
 	{
-		gShouldSendScans = 0;
-		printf("Failed writing, breaking\n");
+		unsigned int block = octave / 2;
+		if(block >= kMaxDeltaBlocks)
+			return -1;
+		encoder = &gDeltaEncoders[block];
+		if(gDeltaFramesResync[block].exchange(false))
+			encoder->resync();
+		encoder->setThreshold(gNoiseThreshold.load(std::memory_order_relaxed));
+		unsigned char payload[kAnalogDeltaMaxPayload];
+		size_t payloadLength = encoder->encode(octave, timestamp, values, payload);
+		if(!payloadLength)
+			return 0;
+		len = touchkeyFrameWrite((unsigned char*)frameBuffer, kFrameTypeAnalogDelta, payload, payloadLength);
+	} else {
+		frameBuffer[len++] = ESCAPE_CHARACTER;
+		frameBuffer[len++] = kControlCharacterFrameBegin;
+		frameBuffer[len++] = kFrameTypeAnalog;
+		// Format: [Octave] [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
+		//                   ... (more frames)
+		//                  [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
+		frameBuffer[len++] = octave; //octave
+		// timestamp (i.e. frame ID generated by the device). 32-bit little-endian.
+		memcpy(&frameBuffer[len], &timestamp, sizeof(timestamp));
+		len += sizeof(timestamp);
+		memcpy(&frameBuffer[len], values, frameDataLength * sizeof(values[0]));
+		len += frameDataLength * sizeof(values[0]);
+		frameBuffer[len++] = ESCAPE_CHARACTER;
+		frameBuffer[len++] = kControlCharacterFrameEnd;
+	}
+	frame.length = len;
+	// never blocks: if the writer thread is behind, the frame is dropped
+	if(!gSerialFrames.push(frame))
+	{
+		// the host would apply the next deltas to the wrong values
+		if(encoder)
+			encoder->resync();
 		return -1;
 	}
+	// wakes the writer if it is waiting, without leaving primary mode
+	gSerialWriterEvents.notifyRt();
 	return len;
 }
 
-//#define DUMMY
-#ifdef DUMMY
-void* writeThreadLoop(void* arg)
+// Whether the scan just acquired should be sent, as per gScanIntervalMs
+static bool scanDue()
 {
-	while(!gShouldStop)
-	{
-		while(gShouldSendScans && !gShouldStop)
+	static std::chrono::steady_clock::time_point lastScan;
+	unsigned int interval = gScanIntervalMs.load(std::memory_order_relaxed);
+	auto now = std::chrono::steady_clock::now();
+	if(interval && now - lastScan < std::chrono::milliseconds(interval))
+		return false;
+	lastScan = now;
+	return true;
+}
+
+static void printSerialStats()
+{
+	fprintf(stderr, "Serial: %zu frames written, %zu dropped, %zu write errors, backlog peak %zu/%zu frames\n",
+			gSerialFramesWritten, gSerialFrames.getDropped(), gSerialWriteErrors,
+			gSerialBacklogPeak, gSerialFrames.capacity());
+}
+
+// Writes out the queued replies and scan frames, coalescing up to
+// kSerialFramesPerWrite of them in each call to writev(), until there are
+// none left. Runs on the writer thread at every wake-up of
+// gSerialWriterEvents: that is armed first, so that a frame queued while
+// this runs wakes it up again
+static void writeSerialFrames(void*)
+{
+	static SerialFrame frames[kSerialFramesPerWrite];
+	static struct iovec iov[kSerialFramesPerWrite];
+	static size_t reportedDropped = 0;
+	static size_t reportedErrors = 0;
+	static auto lastReport = std::chrono::steady_clock::now();
+	unsigned int count;
+	do {
+		gSerialBacklogPeak = std::max(gSerialBacklogPeak, gSerialFrames.size());
+		count = 0;
+		while(count < kSerialFramesPerWrite && gSerialReplies.pop(frames[count]))
+			++count;
+		unsigned int replies = count;
+		while(count < kSerialFramesPerWrite && gSerialFrames.pop(frames[count]))
+			++count;
+		for(unsigned int n = 0; n < count; ++n)
+		{
+			iov[n].iov_base = frames[n].data;
+			iov[n].iov_len = frames[n].length;
+		}
+		if(count)
 		{
-			float data[frameDataLength];
-			static int count = 0;
-			// fake some channels
-			for(unsigned int n = 0; n < frameDataLength; ++n)
+			if(gTransport.writev(iov, count) < 0)
 			{
-				float value = n;
-				if(10 == n)
-				{
-					value = (count * 3) % 8192;
-					if(value >= 4096)
-						value = 8192 - value;
-				}
-				value /= 4096.f;
-				data[n] = value;
+				// the frames are lost, but we keep going: the host may come back
+				++gSerialWriteErrors;
+				if(1 == gSerialWriteErrors)
+					fprintf(stderr, "Serial write failed: %d %s\n", errno, strerror(errno));
+			} else {
+				gSerialFramesWritten += count - replies;
 			}
-			sendScanFrame(0, count, data, 0);
-			count++;
-			usleep(2000);
 		}
-		usleep(50000);
+	} while(count == kSerialFramesPerWrite);
+	// report overruns and errors as they happen, at most once per second
+	auto now = std::chrono::steady_clock::now();
+	if((gSerialFrames.getDropped() != reportedDropped || gSerialWriteErrors != reportedErrors)
+		&& now - lastReport >= std::chrono::seconds(1))
+	{
+		reportedDropped = gSerialFrames.getDropped();
+		reportedErrors = gSerialWriteErrors;
+		lastReport = now;
+		printSerialStats();
 	}
-	return NULL;
 }
 
-pthread_t writeThread;
-int start_write_thread()
+void* serialWriteThreadLoop(void*)
 {
-	return pthread_create(&writeThread, NULL, writeThreadLoop, NULL);
+	while(gSerialWriterEvents.runOnce(-1))
+		;
+	return NULL;
 }
-#else /* DUMMY */
-#include <Keys.h>
+
+#ifndef HOST_BUILD
+#include "KeysScanSource.h"
 int gXenomaiInited = 0; // required by libbelaextra
 unsigned int gAuxiliaryTaskStackSize  = 1 << 17; // required by libbelaextra
-BoardsTopology bt;
-Keys* keys;
+#endif /* HOST_BUILD */
+static ScanSource* gSource;
 unsigned int octaves;
 void postCallback(void* arg, float* buffer, unsigned int length)
 {
-	if(!gShouldSendScans)
+	if(!gShouldSendScans || !scanDue())
 		return;
-	Keys* keys = (Keys*)arg;
-	unsigned int numKeys = bt.getHighestNote() - bt.getLowestNote() + 1;
-	float values[numKeys];
-	for(int n = bt.getLowestNote(); n <= bt.getHighestNote(); ++n)
-	{
-		values[n-bt.getLowestNote()] = keys->getNoteValue(n);
-	}
+	unsigned int numKeys = gSource->getNumKeys();
+	if(length < numKeys)
+		return;
+	// buffer holds one value per key, starting from the lowest note, and is
+	// serialised in place. Each block covers 25 notes from the start of an
+	// even octave, except the first one, which starts at the lowest note,
+	// and the last one, which stops at the highest
+	unsigned int offset = gSource->getLowestNote() % 12;
 	static int count = 0;
 	for(unsigned int octave = 0; octave < octaves; octave += 2)
 	{
-		int offset;
-		if(octave == 0)
-		{
-			offset = bt.getLowestNote() % 12;
-		} else {
-			offset = 0;
-		}
-		float* data = values + octave * 12 + offset;
-		sendScanFrame(octave, count, data, offset);
+		unsigned int first = octave ? 0 : offset;
+		unsigned int start = octave * 12 + first - offset; // in buffer
+		if(start >= numKeys)
+			break;
+		unsigned int available = std::min<unsigned int>(frameDataLength - first, numKeys - start);
+		sendScanFrame(octave, count, buffer + start, first, available);
 	}
 	++count;
 }
-#endif /* DUMMY */
 
-#define SERIAL_BUFFER_SIZE 1024
-static char serialBuffer[SERIAL_BUFFER_SIZE];
-void interrupt_handler(int)
+static void sourceEnded(void*)
 {
-	gShouldStop = 1;
+	printf("No more scans, stopping\n");
+	gEventLoop.stop();
 }
-int main()
+
+// Commands from the host, as parsed by TouchkeyFrameParser
+static void handleCommand(void*, unsigned char type, const unsigned char* payload, size_t length)
 {
-	serialSetup("/dev/ttyGS0");
-	signal(SIGINT, interrupt_handler);
-	signal(SIGTERM, interrupt_handler);
-	int dummy = 0;
-	auto path = "/root/serial-calibration.txt";
-#ifdef DUMMY
-	start_write_thread();
-	int octaves = 2;
-#else /* DUMMY */
-	keys = new Keys;
-	bt.setLowestNote(0);
-	bt.setBoard(0, 0, 24);
-	bt.setBoard(1, 0, 23);
-	bt.setBoard(2, 10, 23);
-	keys->setPostCallback(postCallback, keys);
-	int ret = keys->start(&bt, NULL);
-	keys->startTopCalibration();
-	keys->loadLinearCalibrationFile(path);
-	int bottomKey = bt.getLowestNote();
-	int topKey = bt.getHighestNote();
-	int bottomOctave = bottomKey / 12;
-	int topOctave = topKey / 12;
-	octaves = topOctave - bottomOctave + 1;
-	printf("Using %d real octaves (notes %d to %d)\n", octaves, bottomKey, topKey);
-#endif /* DUMMY */
-	while(!gShouldStop)
+	const char* name = touchkeyFrameTypeName(type);
+	printf(">> %s (%d), %zu bytes\n", name ? name : "unknown type", type, length);
+	switch(type)
 	{
-		int ret = serialRead(serialBuffer, SERIAL_BUFFER_SIZE, -1);
+	case kFrameTypeStatus:
+		sendStatusFrame(octaves);
+		break;
+	case kFrameTypeStartScanning:
+		for(auto& resync : gDeltaFramesResync)
+			resync = true;
+		gShouldSendScans = 1;
+		break;
+	case kFrameTypeStopScanning:
+		gShouldSendScans = 0;
+		break;
+	// [Interval]: milliseconds between scans
+	case kFrameTypeScanRate:
+		if(length >= 1)
+			gScanIntervalMs = payload[0];
+		break;
+	// [Octave] [Key] [Threshold]: compact frames have a single threshold for
+	// the whole keyboard, so only the latter is used
+	case kFrameTypeNoiseThreshold:
+		if(length >= 1)
+			gNoiseThreshold = payload[length - 1];
+		break;
+	// Two bytes per octave, as in the status frame: [Octave0H] [Octave0L] ...
+	case kFrameTypeSetEnabledKeys:
+		for(unsigned int o = 0; o < kMaxOctaves && 2 * o + 1 < length; ++o)
+			gEnabledKeys[o] = (payload[2 * o] << 8) | payload[2 * o + 1];
+		break;
+	// nothing to rescan or recalibrate on the fly, and the rest is for the
+	// touch sensors, the LEDs, MIDI or firmware updates, which we don't have
+	case kFrameTypeSendI2CCommand:
+	case kFrameTypeResetDevices:
+	case kFrameTypeSensitivity:
+	case kFrameTypeSizeScaler:
+	case kFrameTypeMinimumSize:
+	case kFrameTypeMonitorRawFromKey:
+	case kFrameTypeUpdateBaselines:
+	case kFrameTypeRescanKeyboard:
+	case kFrameTypeEncapsulatedMIDI:
+	case kFrameTypeRGBLEDSetColors:
+	case kFrameTypeRGBLEDAllOff:
+	case kFrameTypeEnterISPMode:
+	case kFrameTypeEnterSelfProgramMode:
+	default:
+		printf("   ignored\n");
+		break;
+	}
+}
+
+#define SERIAL_BUFFER_SIZE 1024
+static unsigned char serialBuffer[SERIAL_BUFFER_SIZE];
+static TouchkeyFrameParser gParser(handleCommand, NULL);
+static void serialReadable(void*, int, short revents)
+{
+	if(revents & POLLIN)
+	{
+		int ret = gTransport.read((char*)serialBuffer, SERIAL_BUFFER_SIZE, 0);
 		if(ret > 0)
+			gParser.process(serialBuffer, ret);
+	} else {
+		fprintf(stderr, "Serial port closed or in error (%#x), stopping\n", revents);
+		gEventLoop.stop();
+	}
+}
+// Usage: SerialPianoScanner [-d <device>] [-b <baud rate>] [-r] [-c [-k <interval>] [-n <threshold>]]
+//                           [-g <gesture> [-N <keys>] | -p <capture file>] [-s <scan rate>] [-u]
+// -r: raw mode, see SerialTransport. The default is /dev/ttyGS0 at 115200 baud
+// -c: send compact frames, with a keyframe at least every <interval> frames
+// of each block and ignoring changes of up to <threshold>, see AnalogDeltaEncoder
+// -g, -p: instead of the Keys board, scan a synthetic gesture on <keys>
+// keys or loop over a capture file, see ScanSource. -s sets the rate of the
+// former, -u runs either as fast as possible
+int main(int argc, char** argv)
+{
+	const char* device = "/dev/ttyGS0";
+	unsigned int baudRate = 115200;
+	bool raw = false;
+	unsigned int keyframeInterval = 100;
+	unsigned int deltaThreshold = 0;
+	int gesture = -1;
+	unsigned int numKeys = 25;
+	const char* playbackPath = NULL;
+	float scanRate = 1000;
+	bool paced = true;
+	for(int n = 1; n < argc; ++n)
+	{
+		if(!strcmp(argv[n], "-d") && n + 1 < argc)
+			device = argv[++n];
+		else if(!strcmp(argv[n], "-b") && n + 1 < argc)
+			baudRate = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-r"))
+			raw = true;
+		else if(!strcmp(argv[n], "-c"))
+			gDeltaFrames = true;
+		else if(!strcmp(argv[n], "-k") && n + 1 < argc)
+			keyframeInterval = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-n") && n + 1 < argc)
+			deltaThreshold = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-g") && n + 1 < argc)
 		{
-			if(ESCAPE_CHARACTER == serialBuffer[0])
+			gesture = gestureFromName(argv[++n]);
+			if(gesture < 0)
 			{
-				if(kControlCharacterFrameBegin == serialBuffer[1])
-				{
-					if(kFrameTypeStatus == serialBuffer[2])
-					{
-						sendStatusFrame(octaves);
-						printf(">> kFrameTypeStatus\n");
-					} else if (kFrameTypeStartScanning == serialBuffer[2]) {
-						printf(">> StartScanning\n");
-						gShouldSendScans = 1;
-					} else if (kFrameTypeStopScanning == serialBuffer[2]) {
-						printf(">> Stop scanning\n");
-						gShouldSendScans = 0;
-					}
-				}
-			} else {
-				printf("Received raw byte: %d\n", serialBuffer[0]);
+				fprintf(stderr, "Unknown gesture %s\n", argv[n]);
+				return 1;
 			}
 		}
-		usleep(50000);
+		else if(!strcmp(argv[n], "-N") && n + 1 < argc)
+			numKeys = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-p") && n + 1 < argc)
+			playbackPath = argv[++n];
+		else if(!strcmp(argv[n], "-s") && n + 1 < argc)
+			scanRate = atof(argv[++n]);
+		else if(!strcmp(argv[n], "-u"))
+			paced = false;
+		else {
+			fprintf(stderr, "Usage: %s [-d <device>] [-b <baud rate>] [-r] [-c [-k <interval>] [-n <threshold>]]\n"
+					"\t[-g <gesture> [-N <keys>] | -p <capture file>] [-s <scan rate>] [-u]\n", argv[0]);
+			return 1;
+		}
+	}
+	for(auto& encoder : gDeltaEncoders)
+	{
+		if(!encoder.setup(keyframeInterval, deltaThreshold))
+		{
+			fprintf(stderr, "Invalid keyframe interval\n");
+			return 1;
+		}
 	}
-#ifdef DUMMY
-	printf("pthread_join\n");
-	pthread_join(writeThread, NULL);
-	printf("pthread_joined\n");
-#else /* DUMMY */
-	keys->stopAndWait();
-	delete keys;
-#endif /* DUMMY */
-	serialCleanup();
+	gNoiseThreshold = deltaThreshold;
+	for(auto& keys : gEnabledKeys)
+		keys = 0xffff;
+	if(!gTransport.setup(device, baudRate, raw))
+		return 1;
+	// before any other thread is started, see EventLoop::setup()
+	if(!gEventLoop.setup() || !gSerialWriterEvents.setup(false))
+		return 1;
+	gEventLoop.addFd(gTransport.getFd(), POLLIN, serialReadable, NULL);
+	gSerialWriterEvents.setNotifyHandler(writeSerialFrames, NULL);
+	if(pthread_create(&gSerialWriteThread, NULL, serialWriteThreadLoop, NULL))
+	{
+		fprintf(stderr, "Error creating the serial write thread\n");
+		return 1;
+	}
+	std::unique_ptr<ScanSource> source;
+	if(playbackPath)
+	{
+		FileScanSource* file = new FileScanSource;
+		source.reset(file);
+		if(!file->setup(playbackPath, paced, true))
+		{
+			fprintf(stderr, "Error opening %s\n", playbackPath);
+			return 1;
+		}
+	} else if(gesture >= 0) {
+		SyntheticScanSource* synthetic = new SyntheticScanSource;
+		source.reset(synthetic);
+		if(!synthetic->setup(numKeys, gesture, scanRate, paced))
+		{
+			fprintf(stderr, "Invalid number of keys or scan rate\n");
+			return 1;
+		}
+	} else {
+#ifdef HOST_BUILD
+		fprintf(stderr, "No Keys board in host builds: use -g or -p\n");
+		return 1;
+#else /* HOST_BUILD */
+		KeysScanSource* keys = new KeysScanSource;
+		source.reset(keys);
+		BoardsTopology& bt = keys->getTopology();
+		bt.setLowestNote(0);
+		bt.setBoard(0, 0, 24);
+		bt.setBoard(1, 0, 23);
+		bt.setBoard(2, 10, 23);
+#endif /* HOST_BUILD */
+	}
+	gSource = source.get();
+	int bottomKey = source->getLowestNote();
+	int topKey = bottomKey + source->getNumKeys() - 1;
+	int bottomOctave = bottomKey / 12;
+	int topOctave = topKey / 12;
+	octaves = std::min<unsigned int>(topOctave - bottomOctave + 1, kMaxOctaves);
+	source->setEndCallback(sourceEnded, NULL);
+	if(!source->start(postCallback, NULL))
+		return 1;
+#ifndef HOST_BUILD
+	if(KeysScanSource* keys = dynamic_cast<KeysScanSource*>(source.get()))
+	{
+		auto path = "/root/serial-calibration.txt";
+		keys->getKeys()->startTopCalibration();
+		keys->getKeys()->loadLinearCalibrationFile(path);
+	}
+#endif /* HOST_BUILD */
+	printf("Using %d real octaves (notes %d to %d)\n", octaves, bottomKey, topKey);
+	// commands are handled as soon as they come in
+	gEventLoop.run();
+	gShouldStop = 1;
+	gSerialWriterEvents.stop();
+	printf("Serial: %zu commands received, %zu framing errors\n", gParser.getFrames(), gParser.getErrors());
+	source->stop();
+	pthread_join(gSerialWriteThread, NULL);
+	printSerialStats();
+	gTransport.cleanup();
 }
 #endif
@@ -0,0 +1,288 @@
+// Replays a byte stream, e.g.: a capture of what the host sent over the
+// serial port, through TouchkeyFrameParser and prints the frames found in
+// it. Then checks the parser against the same stream:
+// - split into chunks of random length, down to a byte at a time, it must
+// find the same frames and errors as when given the stream in one go
+// - each frame, written back with touchkeyFrameWrite() and parsed again,
+// must come back unchanged
+// Any stream is valid input, so random bytes can be used to fuzz it.
+// With -f, it also generates that many streams out of the pieces of the
+// protocol: frames, frames cut short, escapes, frame start and end and other
+// control sequences and stray bytes, with payloads full of escape
+// characters and of lengths around TOUCHKEY_MAX_FRAME_LENGTH. Each goes
+// through the checks above, and the frames and errors found must also match
+// those of a reference parser.
+// fixtures/host-commands.bin is a capture of a host session, and
+// fixtures/host-commands.txt what this prints for it, see "make check".
+//
+// Usage: serial-replay [-q] [-n <passes>] [-s <seed>] [-f <streams>] [<byte stream file>]
+// -q: don't print the frames
+// Exits with 1 if any check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "TouchkeyFrameParser.h"
+
+struct Frame {
+	unsigned char type;
+	std::vector<unsigned char> payload;
+	bool operator==(const Frame& other) const { return type == other.type && payload == other.payload; }
+};
+
+static void storeFrame(void* arg, unsigned char type, const unsigned char* payload, size_t length)
+{
+	((std::vector<Frame>*)arg)->push_back({type, std::vector<unsigned char>(payload, payload + length)});
+}
+
+// Parse data in chunks of up to maxChunk bytes, or in one go if maxChunk is 0
+static std::vector<Frame> parse(const std::vector<unsigned char>& data, size_t maxChunk, unsigned int& seed, size_t& errors)
+{
+	std::vector<Frame> frames;
+	TouchkeyFrameParser parser(storeFrame, &frames);
+	size_t n = 0;
+	while(n < data.size())
+	{
+		size_t chunk = maxChunk ? 1 + rand_r(&seed) % maxChunk : data.size();
+		chunk = std::min(chunk, data.size() - n);
+		parser.process(data.data() + n, chunk);
+		n += chunk;
+	}
+	errors = parser.getErrors();
+	return frames;
+}
+
+// The rules of TouchkeyFrameParser, applied in two steps: the stream is
+// first split into bytes and control sequences, which are then put
+// together into frames
+static std::vector<Frame> referenceParse(const std::vector<unsigned char>& data, size_t& errors)
+{
+	// a byte, or -1 - the control character of a control sequence
+	std::vector<int> tokens;
+	for(size_t n = 0; n < data.size(); ++n)
+	{
+		if(ESCAPE_CHARACTER != data[n])
+			tokens.push_back(data[n]);
+		else if(n + 1 < data.size())
+		{
+			++n;
+			tokens.push_back(ESCAPE_CHARACTER == data[n] ? ESCAPE_CHARACTER : -1 - data[n]);
+		}
+	}
+	std::vector<Frame> frames;
+	std::vector<unsigned char> frame;
+	bool inFrame = false;
+	errors = 0;
+	for(int token : tokens)
+	{
+		if(token >= 0)
+		{
+			if(inFrame)
+				frame.push_back(token);
+			else
+				++errors;
+		} else if(-1 - kControlCharacterFrameBegin == token) {
+			errors += inFrame;
+			inFrame = true;
+			frame.clear();
+		} else if(-1 - kControlCharacterFrameEnd == token) {
+			if(inFrame && frame.size() && frame.size() <= TOUCHKEY_MAX_FRAME_LENGTH)
+				frames.push_back({frame[0], std::vector<unsigned char>(frame.begin() + 1, frame.end())});
+			else
+				++errors;
+			inFrame = false;
+		} else {
+			inFrame = false;
+			++errors;
+		}
+	}
+	return frames;
+}
+
+// A payload byte, often one that means something to the parser
+static unsigned char protocolByte(unsigned int& seed)
+{
+	switch(rand_r(&seed) % 8)
+	{
+	case 0:
+	case 1:
+		return ESCAPE_CHARACTER;
+	case 2:
+		return kControlCharacterFrameBegin;
+	case 3:
+		return kControlCharacterFrameEnd;
+	default:
+		return rand_r(&seed);
+	}
+}
+
+static std::vector<unsigned char> generateStream(unsigned int& seed)
+{
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> payload;
+	std::vector<unsigned char> frame(2 * (TOUCHKEY_MAX_FRAME_LENGTH + 2) + 6);
+	unsigned int pieces = 1 + rand_r(&seed) % 40;
+	for(unsigned int p = 0; p < pieces; ++p)
+	{
+		unsigned int piece = rand_r(&seed) % 10;
+		if(piece < 5)
+		{
+			// a frame, whole or cut short, possibly between an escape and
+			// what it escapes. Now and then as long as a frame can be, or
+			// a little longer
+			size_t length = rand_r(&seed) % 8 ? rand_r(&seed) % 16 : TOUCHKEY_MAX_FRAME_LENGTH - 3 + rand_r(&seed) % 5;
+			payload.resize(length);
+			for(auto& byte : payload)
+				byte = protocolByte(seed);
+			size_t len = touchkeyFrameWrite(frame.data(), protocolByte(seed), payload.data(), payload.size());
+			if(piece == 4)
+				len = rand_r(&seed) % len;
+			data.insert(data.end(), frame.begin(), frame.begin() + len);
+		} else if(piece < 9) {
+			// a control sequence on its own, or a lone escape
+			static const int controls[] = { kControlCharacterFrameBegin, kControlCharacterFrameEnd, kControlCharacterAck, kControlCharacterNak, kControlCharacterFrameError, -1 };
+			int control = controls[rand_r(&seed) % (sizeof(controls) / sizeof(controls[0]))];
+			data.push_back(ESCAPE_CHARACTER);
+			if(control >= 0)
+				data.push_back(control);
+		} else {
+			// stray bytes
+			unsigned int count = 1 + rand_r(&seed) % 4;
+			for(unsigned int n = 0; n < count; ++n)
+				data.push_back(protocolByte(seed));
+		}
+	}
+	return data;
+}
+
+// The checks above that don't need to know what is in the stream
+static unsigned int checkStream(const std::vector<unsigned char>& data, const std::vector<Frame>& frames, size_t errors, unsigned int passes, unsigned int& seed)
+{
+	unsigned int failures = 0;
+	for(unsigned int p = 0; p < passes; ++p)
+	{
+		// mostly short chunks, the first pass a byte at a time
+		size_t maxChunk = p ? 1 << (p % 10) : 1;
+		size_t chunkErrors;
+		if(parse(data, maxChunk, seed, chunkErrors) != frames || chunkErrors != errors)
+		{
+			fprintf(stderr, "Pass %u, chunks of up to %zu bytes: different results\n", p, maxChunk);
+			++failures;
+		}
+	}
+	std::vector<unsigned char> written(2 * TOUCHKEY_MAX_FRAME_LENGTH + 6);
+	for(auto& frame : frames)
+	{
+		size_t len = touchkeyFrameWrite(written.data(), frame.type, frame.payload.data(), frame.payload.size());
+		std::vector<Frame> parsed;
+		TouchkeyFrameParser parser(storeFrame, &parsed);
+		parser.process(written.data(), len);
+		if(parsed.size() != 1 || !(parsed[0] == frame) || parser.getErrors())
+		{
+			fprintf(stderr, "Frame of type %d, %zu bytes: different once written and parsed again\n",
+					frame.type, frame.payload.size());
+			++failures;
+		}
+	}
+	return failures;
+}
+
+static unsigned int fuzz(unsigned int streams, unsigned int& seed)
+{
+	unsigned int failures = 0;
+	size_t totalFrames = 0;
+	size_t totalErrors = 0;
+	for(unsigned int s = 0; s < streams; ++s)
+	{
+		std::vector<unsigned char> data = generateStream(seed);
+		size_t errors;
+		std::vector<Frame> frames = parse(data, 0, seed, errors);
+		size_t expectedErrors;
+		if(referenceParse(data, expectedErrors) != frames || expectedErrors != errors)
+		{
+			fprintf(stderr, "Generated stream %u, %zu bytes: %zu frames and %zu errors, expected %zu and %zu\n",
+					s, data.size(), frames.size(), errors, referenceParse(data, expectedErrors).size(), expectedErrors);
+			++failures;
+		}
+		failures += checkStream(data, frames, errors, 10, seed);
+		totalFrames += frames.size();
+		totalErrors += errors;
+	}
+	printf("%u generated streams: %zu frames, %zu errors\n", streams, totalFrames, totalErrors);
+	return failures;
+}
+
+int main(int argc, char** argv)
+{
+	bool quiet = false;
+	unsigned int passes = 100;
+	unsigned int seed = 1;
+	unsigned int streams = 0;
+	const char* path = NULL;
+	bool usage = false;
+	for(int n = 1; n < argc; ++n)
+	{
+		if(!strcmp(argv[n], "-q"))
+			quiet = true;
+		else if(!strcmp(argv[n], "-n") && n + 1 < argc)
+			passes = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-s") && n + 1 < argc)
+			seed = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-f") && n + 1 < argc)
+			streams = strtoul(argv[++n], NULL, 0);
+		else if(!path && argv[n][0] != '-')
+			path = argv[n];
+		else
+			usage = true;
+	}
+	if((!path && !streams) || usage)
+	{
+		fprintf(stderr, "Usage: %s [-q] [-n <passes>] [-s <seed>] [-f <streams>] [<byte stream file>]\n", argv[0]);
+		return 1;
+	}
+	unsigned int failures = 0;
+	if(path)
+	{
+		FILE* file = fopen(path, "rb");
+		if(!file)
+		{
+			fprintf(stderr, "Error opening %s\n", path);
+			return 1;
+		}
+		std::vector<unsigned char> data;
+		unsigned char buffer[4096];
+		size_t ret;
+		while((ret = fread(buffer, 1, sizeof(buffer), file)) > 0)
+			data.insert(data.end(), buffer, buffer + ret);
+		fclose(file);
+
+		size_t errors;
+		std::vector<Frame> frames = parse(data, 0, seed, errors);
+		if(!quiet)
+		{
+			for(auto& frame : frames)
+			{
+				const char* name = touchkeyFrameTypeName(frame.type);
+				printf("%s (%d), %zu bytes:", name ? name : "unknown type", frame.type, frame.payload.size());
+				for(auto byte : frame.payload)
+					printf(" %02x", byte);
+				printf("\n");
+			}
+		}
+		printf("%zu bytes: %zu frames, %zu errors\n", data.size(), frames.size(), errors);
+		unsigned int fileFailures = checkStream(data, frames, errors, passes, seed);
+		if(!fileFailures)
+			printf("%u passes in chunks and %zu frames written back: ok\n", passes, frames.size());
+		failures += fileFailures;
+	}
+	if(streams)
+		failures += fuzz(streams, seed);
+	if(failures)
+	{
+		fprintf(stderr, "%u checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
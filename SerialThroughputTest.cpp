@@ -0,0 +1,304 @@
+// Sustained throughput of SerialTransport, against a pseudo-terminal pair.
+//
+// A thread writes scan frames, as sent by SerialInterface, through a
+// SerialTransport opened on the slave side as fast as it can, batching
+// them into writev() calls the same way. The main thread reads them back
+// from the master side and counts them. Reports how many frames and how
+// many scans of the whole keyboard (one frame per two octaves) per second
+// went through, and, for comparison, how many scans per second a real 8N1
+// line at the given baud rate could carry.
+// With -c, the frames are kFrameTypeAnalogDelta ones encoding a synthetic
+// gesture: the main thread also decodes them and checks the values.
+//
+// Usage: serial-throughput [-b <baud rate>] [-r] [-k <keys>] [-t <seconds>]
+//                          [-c [-g <gesture>] [-n <threshold>]]
+// -r: raw mode, see SerialTransport.
+// -n: see AnalogDeltaEncoder.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "AnalogDeltaCodec.h"
+#include "SerialTransport.h"
+#include "SyntheticGestures.h"
+#include "TouchkeyFrameParser.h"
+
+static const unsigned int kKeysPerFrame = kAnalogDeltaKeys;
+static const unsigned int kKeysPerBlock = 24;
+static const unsigned int kFramesPerWrite = 16;
+static std::atomic<bool> gShouldStop{false};
+
+// Generates the values of the scans, identically on both sides
+struct Scans {
+	bool setup(unsigned int numKeys, int gesture)
+	{
+		this->numKeys = numKeys;
+		positions.resize(numKeys);
+		values.assign(getNumBlocks() * kKeysPerBlock + kKeysPerFrame, 0);
+		return gestures.setup(numKeys, gesture);
+	}
+	void next()
+	{
+		gestures.render(positions.data());
+		for(unsigned int n = 0; n < numKeys; ++n)
+			values[n] = std::min(std::max(positions[n], 0.f), 1.f) * 4096.f;
+	}
+	unsigned int getNumBlocks() { return (numKeys + kKeysPerBlock - 1) / kKeysPerBlock; }
+	// The kKeysPerFrame values of a two-octave block
+	const int16_t* block(unsigned int block) { return &values[block * kKeysPerBlock]; }
+	SyntheticGestures gestures;
+	std::vector<float> positions;
+	std::vector<int16_t> values;
+	unsigned int numKeys;
+};
+
+// An analog frame: header, octave, 32-bit timestamp, kKeysPerFrame 16-bit
+// values, trailer
+static std::vector<char> makeFrame(unsigned char octave, uint32_t timestamp)
+{
+	std::vector<char> frame;
+	frame.push_back(ESCAPE_CHARACTER);
+	frame.push_back(kControlCharacterFrameBegin);
+	frame.push_back(kFrameTypeAnalog);
+	frame.push_back(octave);
+	frame.insert(frame.end(), (char*)&timestamp, (char*)&timestamp + sizeof(timestamp));
+	for(unsigned int n = 0; n < kKeysPerFrame; ++n)
+	{
+		int16_t value = n * 100;
+		frame.insert(frame.end(), (char*)&value, (char*)&value + sizeof(value));
+	}
+	frame.push_back(ESCAPE_CHARACTER);
+	frame.push_back(kControlCharacterFrameEnd);
+	return frame;
+}
+
+struct Writer {
+	SerialTransport* transport;
+	std::vector<char> frame;
+	// for compact frames
+	bool compact = false;
+	Scans scans;
+	std::vector<AnalogDeltaEncoder> encoders;
+	size_t errors = 0;
+};
+
+static void* writeLoop(void* arg)
+{
+	Writer& writer = *(Writer*)arg;
+	static unsigned char frames[kFramesPerWrite][2 * kAnalogDeltaMaxPayload + 6];
+	struct iovec iov[kFramesPerWrite];
+	uint32_t timestamp = 0;
+	unsigned int block = 0;
+	while(!gShouldStop)
+	{
+		for(unsigned int n = 0; n < kFramesPerWrite; ++n)
+		{
+			if(!writer.compact)
+			{
+				iov[n].iov_base = writer.frame.data();
+				iov[n].iov_len = writer.frame.size();
+				continue;
+			}
+			unsigned char payload[kAnalogDeltaMaxPayload];
+			size_t len = 0;
+			// skip the blocks that did not change
+			while(!len)
+			{
+				if(0 == block)
+					writer.scans.next();
+				len = writer.encoders[block].encode(block * 2, timestamp, writer.scans.block(block), payload);
+				if(++block == writer.scans.getNumBlocks())
+				{
+					block = 0;
+					++timestamp;
+				}
+			}
+			iov[n].iov_base = frames[n];
+			iov[n].iov_len = touchkeyFrameWrite(frames[n], kFrameTypeAnalogDelta, payload, len);
+		}
+		if(writer.transport->writev(iov, kFramesPerWrite) < 0)
+		{
+			// the frames that were not written are lost: the decoder will
+			// have to wait for the next keyframes
+			++writer.errors;
+			usleep(1000);
+		}
+	}
+	return NULL;
+}
+
+// Decodes the frames read back and checks that the values match the
+// scans, within the threshold of the encoder
+struct Reader {
+	Reader() { parser.setCallback(frameCallback, this); }
+	static void frameCallback(void* arg, unsigned char type, const unsigned char* payload, size_t length)
+	{
+		((Reader*)arg)->processFrame(type, payload, length);
+	}
+	void processFrame(unsigned char type, const unsigned char* payload, size_t length)
+	{
+		if(kFrameTypeAnalogDelta != type)
+		{
+			++errors;
+			return;
+		}
+		unsigned char octave;
+		uint32_t timestamp;
+		int16_t values[kAnalogDeltaKeys];
+		if(!decoder.decode(payload, length, octave, timestamp, values))
+			return;
+		unsigned int block = octave / 2;
+		if(block >= scans.getNumBlocks() || timestamp + 1 < scansDone)
+		{
+			++errors;
+			return;
+		}
+		while(scansDone <= timestamp)
+		{
+			scans.next();
+			++scansDone;
+		}
+		const int16_t* expected = scans.block(block);
+		for(unsigned int n = 0; n < kAnalogDeltaKeys; ++n)
+		{
+			if(abs(values[n] - expected[n]) > (int)threshold)
+			{
+				++mismatches;
+				break;
+			}
+		}
+		++decoded;
+	}
+	TouchkeyFrameParser parser;
+	Scans scans;
+	AnalogDeltaDecoder decoder;
+	unsigned int threshold = 0;
+	uint64_t scansDone = 0;
+	size_t decoded = 0;
+	size_t mismatches = 0;
+	size_t errors = 0;
+};
+
+int main(int argc, char** argv)
+{
+	unsigned int baudRate = 115200;
+	bool raw = false;
+	unsigned int numKeys = 88;
+	double duration = 2;
+	bool compact = false;
+	int gesture = kGestureHeldChord;
+	unsigned int threshold = 0;
+	for(int n = 1; n < argc; ++n)
+	{
+		if(!strcmp(argv[n], "-b") && n + 1 < argc)
+			baudRate = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-r"))
+			raw = true;
+		else if(!strcmp(argv[n], "-k") && n + 1 < argc)
+			numKeys = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-t") && n + 1 < argc)
+			duration = atof(argv[++n]);
+		else if(!strcmp(argv[n], "-c"))
+			compact = true;
+		else if(!strcmp(argv[n], "-g") && n + 1 < argc)
+			gesture = gestureFromName(argv[++n]);
+		else if(!strcmp(argv[n], "-n") && n + 1 < argc)
+			threshold = strtoul(argv[++n], NULL, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-b <baud rate>] [-r] [-k <keys>] [-t <seconds>] [-c [-g <gesture>] [-n <threshold>]]\n", argv[0]);
+			return 1;
+		}
+	}
+	Writer writer;
+	Reader reader;
+	if(!numKeys || duration <= 0 || !writer.scans.setup(numKeys, gesture) || !reader.scans.setup(numKeys, gesture))
+	{
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) || unlockpt(master))
+	{
+		fprintf(stderr, "Error creating the pseudo-terminal: %s\n", strerror(errno));
+		return 1;
+	}
+	SerialTransport transport;
+	if(!transport.setup(ptsname(master), baudRate, raw))
+		return 1;
+
+	writer.transport = &transport;
+	writer.frame = makeFrame(0, 0);
+	writer.compact = compact;
+	writer.encoders.resize(writer.scans.getNumBlocks());
+	for(auto& encoder : writer.encoders)
+		encoder.setup(100, threshold);
+	reader.threshold = threshold;
+	unsigned int framesPerScan = writer.scans.getNumBlocks();
+	size_t fullScanBytes = framesPerScan * writer.frame.size();
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, writeLoop, &writer))
+	{
+		fprintf(stderr, "Error creating the write thread\n");
+		return 1;
+	}
+	std::vector<unsigned char> buffer(65536);
+	size_t bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	while(elapsed < duration)
+	{
+		ssize_t ret = read(master, buffer.data(), buffer.size());
+		if(ret < 0 && EINTR != errno)
+		{
+			fprintf(stderr, "Error reading: %s\n", strerror(errno));
+			break;
+		}
+		if(ret > 0)
+		{
+			bytes += ret;
+			if(compact)
+				reader.parser.process(buffer.data(), ret);
+		}
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	gShouldStop = true;
+	// keep draining, so that the writer can return from its latest call
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	while(pthread_tryjoin_np(thread, NULL))
+	{
+		if(read(master, buffer.data(), buffer.size()) <= 0)
+			usleep(1000);
+	}
+
+	// compact frames are only sent for the blocks that changed: count the
+	// scans from the timestamps instead
+	double frames = compact ? reader.decoded : bytes / (double)writer.frame.size();
+	double scans = compact ? reader.scansDone : frames / framesPerScan;
+	double scanBytes = compact ? bytes / std::max(scans, 1.0) : fullScanBytes;
+	printf("%u keys: %u frames per scan, %s at %u baud\n", numKeys, framesPerScan,
+			raw ? "raw" : "serial line", baudRate);
+	printf("pty: %.0f bytes/s, %.0f frames/s, %.0f scans/s sustained over %.1f s, %zu write errors\n",
+			bytes / elapsed, frames / elapsed, scans / elapsed, elapsed, writer.errors);
+	if(compact)
+	{
+		printf("compact frames (%s, threshold %u): %.1f bytes per scan, %.1fx smaller than %zu\n",
+				kGestureNames[gesture], threshold, scanBytes, fullScanBytes / scanBytes, fullScanBytes);
+		printf("%zu frames decoded, %zu not decoded, %zu with wrong values, %zu framing errors\n",
+				reader.decoded, reader.decoder.getErrors(), reader.mismatches, reader.errors + reader.parser.getErrors());
+	}
+	if(!raw)
+		printf("8N1 line at %u baud: %.0f scans/s at most\n", baudRate, baudRate / 10.0 / scanBytes);
+	close(master);
+	return 0;
+}
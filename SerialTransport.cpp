@@ -0,0 +1,183 @@
+#include "SerialTransport.h"
+// termios2 and BOTHER come from the kernel headers, which clash with
+// <termios.h>: only use the former
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+SerialTransport::~SerialTransport()
+{
+	cleanup();
+}
+
+bool SerialTransport::setup(const char* device, unsigned int baudRate, bool raw)
+{
+	cleanup();
+	printf("Attempting to connect to %s\n", device);
+	fd = open(device, O_RDWR | O_NOCTTY | (raw ? 0 : O_SYNC));
+	if(fd < 0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", device, strerror(errno));
+		return false;
+	}
+	printf("Successfully opened %s with file descriptor %d\n", device, fd);
+	if(raw ? setupRaw() : setupLine(baudRate))
+		return true;
+	cleanup();
+	return false;
+}
+
+// The line settings shared by both modes: 8-bit characters, no
+// translations, no echo, non-canonical input
+static void makeRaw(struct termios2& tty)
+{
+	tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
+	tty.c_cflag &= ~CSIZE;
+	tty.c_cflag |= CS8;         /* 8-bit characters */
+	tty.c_cflag &= ~PARENB;     /* no parity bit */
+	tty.c_cflag &= ~CSTOPB;     /* only need 1 stop bit */
+	tty.c_cflag &= ~CRTSCTS;    /* no hardware flowcontrol */
+
+	/* setup for non-canonical mode */
+	tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+	tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	tty.c_oflag &= ~OPOST;
+
+	/* pure timed read: the callers poll() first */
+	tty.c_cc[VMIN] = 0;
+	tty.c_cc[VTIME] = 5;        /* half second timer */
+}
+
+static unsigned int standardBaudRate(unsigned int baudRate)
+{
+	static const struct { unsigned int rate; unsigned int constant; } rates[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 },
+		{ 576000, B576000 }, { 921600, B921600 }, { 1000000, B1000000 }, { 1152000, B1152000 },
+		{ 1500000, B1500000 }, { 2000000, B2000000 }, { 2500000, B2500000 }, { 3000000, B3000000 },
+		{ 3500000, B3500000 }, { 4000000, B4000000 },
+	};
+	for(auto& r : rates)
+	{
+		if(r.rate == baudRate)
+			return r.constant;
+	}
+	return 0;
+}
+
+bool SerialTransport::setupLine(unsigned int baudRate)
+{
+	struct termios2 tty;
+	if(ioctl(fd, TCGETS2, &tty) < 0)
+	{
+		fprintf(stderr, "Error from TCGETS2: %s\n", strerror(errno));
+		return false;
+	}
+	makeRaw(tty);
+	unsigned int constant = standardBaudRate(baudRate);
+	tty.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	if(constant)
+	{
+		tty.c_cflag |= constant;
+	} else {
+		// custom rate
+		tty.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+		tty.c_ispeed = baudRate;
+		tty.c_ospeed = baudRate;
+	}
+	if(ioctl(fd, TCSETS2, &tty) < 0)
+	{
+		fprintf(stderr, "Error setting %u baud: %s\n", baudRate, strerror(errno));
+		return false;
+	}
+	// the driver may have rounded the rate
+	if(0 == ioctl(fd, TCGETS2, &tty) && (tty.c_cflag & CBAUD) == BOTHER && tty.c_ospeed != baudRate)
+		printf("Requested %u baud, got %u\n", baudRate, tty.c_ospeed);
+	return true;
+}
+
+bool SerialTransport::setupRaw()
+{
+	if(!isatty(fd))
+		return true;
+	struct termios2 tty;
+	if(ioctl(fd, TCGETS2, &tty) < 0 || (makeRaw(tty), ioctl(fd, TCSETS2, &tty) < 0))
+	{
+		fprintf(stderr, "Error setting up %d as raw: %s\n", fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+int SerialTransport::read(char* buf, size_t len, int timeoutMs)
+{
+	struct pollfd pfd[1];
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	int result = poll(pfd, 1, timeoutMs);
+	if(result < 0)
+	{
+		fprintf(stderr, "Error polling for serial: %d %s\n", errno, strerror(errno));
+		return -1;
+	} else if (result == 0) {
+		// timeout
+		return 0;
+	} else if (pfd[0].revents & POLLIN) {
+		int rdlen = ::read(fd, buf, len);
+		if (rdlen < 0)
+			fprintf(stderr, "Error from read: %d: %s\n", rdlen, strerror(errno));
+		return rdlen;
+	} else {
+		fprintf(stderr, "unknown error while reading serial\n");
+		return -1;
+	}
+}
+
+int SerialTransport::write(const char* buf, size_t len)
+{
+	struct iovec iov = { (void*)buf, len };
+	return writev(&iov, 1);
+}
+
+int SerialTransport::writev(struct iovec* iov, int iovcnt)
+{
+	int total = 0;
+	while(iovcnt)
+	{
+		ssize_t ret = ::writev(fd, iov, iovcnt);
+		if(ret < 0)
+		{
+			if(EINTR == errno)
+				continue;
+			return -1;
+		}
+		total += ret;
+		// skip what was written
+		while(iovcnt && (size_t)ret >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if(iovcnt)
+		{
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return total;
+}
+
+void SerialTransport::cleanup()
+{
+	if(fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <sys/uio.h>
+
+// SerialTransport
+//
+// The link to the TouchKeys host. By default the device is a serial port,
+// set up as a raw 8N1 line at any baud rate: standard rates use the usual
+// Bxxx constants, others are set through termios2 and BOTHER.
+// In raw mode the line settings are left alone and the device is used as a
+// plain stream of bytes: a tty is only switched to non-canonical I/O
+// without translations, anything else (e.g.: a FunctionFS bulk endpoint)
+// is used as it is. This suits USB gadgets such as /dev/ttyGS0, whose
+// throughput depends on the bus and not on the baud rate.
+class SerialTransport
+{
+public:
+	SerialTransport() {};
+	~SerialTransport();
+	bool setup(const char* device, unsigned int baudRate = 115200, bool raw = false);
+	// Wait up to timeoutMs (-1: forever) for data. Returns the number of
+	// bytes read, 0 on timeout, or -1 on error
+	int read(char* buf, size_t len, int timeoutMs);
+	// Returns the number of bytes written, or -1 with errno set
+	int write(const char* buf, size_t len);
+	// Write all of the buffers, in order, updating iov as they go out.
+	// Returns the number of bytes written, or -1 with errno set
+	int writev(struct iovec* iov, int iovcnt);
+	void cleanup();
+	int getFd() { return fd; }
+private:
+	bool setupLine(unsigned int baudRate);
+	bool setupRaw();
+	int fd = -1;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+// SpscQueue
+//
+// Wait-free ring buffer between exactly one producer thread (typically the
+// real-time one) and one consumer thread. push() and pop() never block nor
+// allocate. When the queue is full, push() fails and the item is counted as
+// dropped, so that overruns can be reported by the consumer.
+template <typename T>
+class SpscQueue
+{
+public:
+	SpscQueue() {};
+	SpscQueue(size_t capacity) { setup(capacity); }
+	// Not thread-safe: call before the producer and the consumer start.
+	// The capacity is rounded up to a power of two.
+	bool setup(size_t capacity)
+	{
+		if(0 == capacity)
+			return false;
+		size_t length = 1;
+		while(length < capacity)
+			length <<= 1;
+		buffer.resize(length);
+		mask = length - 1;
+		writeIdx = 0;
+		readIdx = 0;
+		dropped = 0;
+		return true;
+	}
+	// Producer side
+	bool push(const T& item)
+	{
+		size_t w = writeIdx.load(std::memory_order_relaxed);
+		if(w - readIdx.load(std::memory_order_acquire) >= buffer.size())
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		buffer[w & mask] = item;
+		writeIdx.store(w + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer side
+	bool pop(T& item)
+	{
+		size_t r = readIdx.load(std::memory_order_relaxed);
+		if(r == writeIdx.load(std::memory_order_acquire))
+			return false;
+		item = buffer[r & mask];
+		readIdx.store(r + 1, std::memory_order_release);
+		return true;
+	}
+	size_t size()
+	{
+		return writeIdx.load(std::memory_order_acquire) - readIdx.load(std::memory_order_acquire);
+	}
+	size_t capacity()
+	{
+		return buffer.size();
+	}
+	// How many items push() could not store so far
+	size_t getDropped()
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+private:
+	std::vector<T> buffer;
+	size_t mask = 0;
+	// keep the two indices on separate cache lines
+	alignas(64) std::atomic<size_t> writeIdx{0};
+	alignas(64) std::atomic<size_t> readIdx{0};
+	std::atomic<size_t> dropped{0};
+};
@@ -0,0 +1,126 @@
+#include "SyntheticGestures.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+const char* const kGestureNames[kNumGestures] = {
+	"slow-press",
+	"hammered-press",
+	"trill",
+	"glissando",
+	"held-chord",
+};
+
+int gestureFromName(const char* name)
+{
+	for(int g = 0; g < kNumGestures; ++g)
+	{
+		if(!strcmp(name, kGestureNames[g]))
+			return g;
+	}
+	return -1;
+}
+
+static const float kDownPosition = 0.95;
+static const float kNoiseAmplitude = 0.002;
+
+SyntheticGestures::SyntheticGestures(unsigned int numKeys, int gesture, float frameRate)
+{
+	setup(numKeys, gesture, frameRate);
+}
+
+bool SyntheticGestures::setup(unsigned int numKeys, int gesture, float frameRate)
+{
+	if(0 == numKeys || frameRate <= 0)
+		return false;
+	this->numKeys = numKeys;
+	this->frameRate = frameRate;
+	frameCount = 0;
+	noiseState = 1;
+	presses.clear();
+	unsigned int centre = numKeys / 2;
+	switch(gesture)
+	{
+	case kGestureSlowPress:
+		presses.push_back({centre, 0.1, 0.25, 0.4, 0.2, false});
+		cycle = 1.2;
+		break;
+	case kGestureHammeredPress:
+		presses.push_back({centre, 0.05, 0.02, 0.25, 0.05, true});
+		presses.push_back({std::min(centre + 5, numKeys - 1), 0.45, 0.015, 0.2, 0.04, true});
+		cycle = 0.8;
+		break;
+	case kGestureTrill:
+		presses.push_back({centre, 0, 0.02, 0.06, 0.02, false});
+		presses.push_back({std::min(centre + 1, numKeys - 1), 0.08, 0.02, 0.06, 0.02, false});
+		cycle = 0.16;
+		break;
+	case kGestureGlissando:
+		for(unsigned int n = 0; n < numKeys; ++n)
+			presses.push_back({n, n * 0.015f, 0.012, 0.02, 0.015, false});
+		cycle = numKeys * 0.015f + 0.3f;
+		break;
+	case kGestureHeldChord:
+		for(unsigned int interval : {0, 4, 7, 12})
+			presses.push_back({std::min(centre + interval, numKeys - 1), 0.1, 0.05, 2, 0.1, false});
+		cycle = 2.5;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// Position of the key at the given time since the press started
+float SyntheticGestures::pressPosition(const Press& press, float time)
+{
+	if(time < 0)
+		return 0;
+	if(time < press.attack)
+	{
+		float x = time / press.attack;
+		if(press.percussive)
+		{
+			// the hammer shoots the key down, it bounces back a little,
+			// then the finger takes it all the way down
+			if(x < 0.25f)
+				return 0.35f * x / 0.25f;
+			if(x < 0.4f)
+				return 0.35f - 0.07f * (x - 0.25f) / 0.15f;
+			return 0.28f + (kDownPosition - 0.28f) * (x - 0.4f) / 0.6f;
+		}
+		return kDownPosition * x * x * (3 - 2 * x);
+	}
+	time -= press.attack;
+	if(time < press.hold)
+		return kDownPosition;
+	time -= press.hold;
+	if(time < press.release)
+		return kDownPosition * (1 - time / press.release);
+	time -= press.release;
+	// damped bounces once back at rest
+	const float bounceDuration = 0.1;
+	if(time < bounceDuration)
+		return 0.05f * expf(-time / 0.02f) * fabsf(sinf(2 * (float)M_PI * time / 0.03f));
+	return 0;
+}
+
+float SyntheticGestures::noise()
+{
+	// LCG, so that the output does not depend on the platform's rand()
+	noiseState = noiseState * 1664525u + 1013904223u;
+	return ((noiseState >> 8) / 16777216.f) * kNoiseAmplitude;
+}
+
+void SyntheticGestures::render(float* frame)
+{
+	float time = fmod(frameCount / (double)frameRate, cycle);
+	for(unsigned int n = 0; n < numKeys; ++n)
+		frame[n] = noise();
+	for(auto& press : presses)
+	{
+		float position = pressPosition(press, time - press.start);
+		frame[press.key] = std::max(frame[press.key], position + noise());
+	}
+	++frameCount;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+// SyntheticGestures
+//
+// Generates frames of key positions that mimic common playing gestures, so
+// that the tracking pipeline can be exercised and timed without hardware or
+// recordings. Output is deterministic for a given gesture, key count and
+// frame rate, including the sensor noise.
+
+enum {
+	kGestureSlowPress = 0,	// one key pressed and released slowly
+	kGestureHammeredPress,	// percussive presses, with a velocity spike at the onset
+	kGestureTrill,			// two neighbouring keys alternating
+	kGestureGlissando,		// a sweep of fast presses across the keyboard
+	kGestureHeldChord,		// four keys pressed together and held
+	kNumGestures
+};
+
+extern const char* const kGestureNames[kNumGestures];
+// The gesture called name in kGestureNames, or -1
+int gestureFromName(const char* name);
+
+class SyntheticGestures
+{
+public:
+	SyntheticGestures() {};
+	SyntheticGestures(unsigned int numKeys, int gesture, float frameRate = 1000);
+	bool setup(unsigned int numKeys, int gesture, float frameRate = 1000);
+	// Write the next frame, numKeys positions, to frame
+	void render(float* frame);
+	uint64_t getFrameCount() { return frameCount; }
+private:
+	struct Press {
+		unsigned int key;
+		float start;		// seconds, within the gesture cycle
+		float attack;		// seconds from rest to fully down
+		float hold;			// seconds held down
+		float release;		// seconds from down back to rest
+		bool percussive;
+	};
+	float pressPosition(const Press& press, float time);
+	float noise();
+	std::vector<Press> presses;
+	unsigned int numKeys = 0;
+	float frameRate = 1000;
+	float cycle = 1;	// seconds after which the gesture repeats
+	uint64_t frameCount = 0;
+	uint32_t noiseState = 1;
+};
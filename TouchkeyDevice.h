@@ -70,6 +70,7 @@ enum {
 	kFrameTypeI2CResponse = 17,	// Response from a specific I2C command
 	kFrameTypeRawKeyData = 18,	// Raw data from the selected key	
     kFrameTypeAnalog = 19,		// Analog data from Z-axis optical sensors
+	kFrameTypeAnalogDelta = 20,	// The same, only sending the changes, see AnalogDeltaCodec.h
 	
     kFrameTypeErrorMessage = 127, // Error message from controller
 	// These types are for incoming (computer -> us) data
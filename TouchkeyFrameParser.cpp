@@ -0,0 +1,132 @@
+#include "TouchkeyFrameParser.h"
+
+void TouchkeyFrameParser::setCallback(FrameCallback callback, void* arg)
+{
+	this->callback = callback;
+	this->arg = arg;
+}
+
+void TouchkeyFrameParser::reset()
+{
+	length = 0;
+	inFrame = false;
+	escape = false;
+	overflow = false;
+}
+
+void TouchkeyFrameParser::frameEnded()
+{
+	if(!length || overflow)
+	{
+		++errors;
+		return;
+	}
+	++frames;
+	if(callback)
+		callback(arg, frame[0], frame + 1, length - 1);
+}
+
+void TouchkeyFrameParser::process(const unsigned char* data, size_t len)
+{
+	for(size_t n = 0; n < len; ++n)
+	{
+		unsigned char byte = data[n];
+		if(!escape && ESCAPE_CHARACTER == byte)
+		{
+			escape = true;
+			continue;
+		}
+		if(escape)
+		{
+			escape = false;
+			if(kControlCharacterFrameBegin == byte)
+			{
+				if(inFrame)
+					++errors; // the previous frame never ended
+				inFrame = true;
+				length = 0;
+				overflow = false;
+				continue;
+			}
+			if(kControlCharacterFrameEnd == byte)
+			{
+				if(inFrame)
+					frameEnded();
+				else
+					++errors;
+				inFrame = false;
+				continue;
+			}
+			if(ESCAPE_CHARACTER != byte)
+			{
+				// any other control sequence
+				inFrame = false;
+				++errors;
+				continue;
+			}
+			// a literal ESCAPE_CHARACTER, stored below
+		}
+		if(!inFrame)
+		{
+			++errors;
+			continue;
+		}
+		if(length < sizeof(frame))
+			frame[length++] = byte;
+		else
+			overflow = true;
+	}
+}
+
+size_t touchkeyFrameWrite(unsigned char* frame, unsigned char type, const unsigned char* payload, size_t payloadLength)
+{
+	size_t len = 0;
+	frame[len++] = ESCAPE_CHARACTER;
+	frame[len++] = kControlCharacterFrameBegin;
+	// a literal ESCAPE_CHARACTER is sent twice
+	if(ESCAPE_CHARACTER == type)
+		frame[len++] = ESCAPE_CHARACTER;
+	frame[len++] = type;
+	for(size_t n = 0; n < payloadLength; ++n)
+	{
+		if(ESCAPE_CHARACTER == payload[n])
+			frame[len++] = ESCAPE_CHARACTER;
+		frame[len++] = payload[n];
+	}
+	frame[len++] = ESCAPE_CHARACTER;
+	frame[len++] = kControlCharacterFrameEnd;
+	return len;
+}
+
+const char* touchkeyFrameTypeName(unsigned char type)
+{
+	switch(type)
+	{
+	case kFrameTypeStatus: return "Status";
+	case kFrameTypeCentroid: return "Centroid";
+	case kFrameTypeI2CResponse: return "I2CResponse";
+	case kFrameTypeRawKeyData: return "RawKeyData";
+	case kFrameTypeAnalog: return "Analog";
+	case kFrameTypeAnalogDelta: return "AnalogDelta";
+	case kFrameTypeErrorMessage: return "ErrorMessage";
+	case kFrameTypeStartScanning: return "StartScanning";
+	case kFrameTypeStopScanning: return "StopScanning";
+	case kFrameTypeSendI2CCommand: return "SendI2CCommand";
+	case kFrameTypeResetDevices: return "ResetDevices";
+	case kFrameTypeScanRate: return "ScanRate";
+	case kFrameTypeNoiseThreshold: return "NoiseThreshold";
+	case kFrameTypeSensitivity: return "Sensitivity";
+	case kFrameTypeSizeScaler: return "SizeScaler";
+	case kFrameTypeMinimumSize: return "MinimumSize";
+	case kFrameTypeSetEnabledKeys: return "SetEnabledKeys";
+	case kFrameTypeMonitorRawFromKey: return "MonitorRawFromKey";
+	case kFrameTypeUpdateBaselines: return "UpdateBaselines";
+	case kFrameTypeRescanKeyboard: return "RescanKeyboard";
+	case kFrameTypeEncapsulatedMIDI: return "EncapsulatedMIDI";
+	case kFrameTypeRGBLEDSetColors: return "RGBLEDSetColors";
+	case kFrameTypeRGBLEDAllOff: return "RGBLEDAllOff";
+	case kFrameTypeEnterISPMode: return "EnterISPMode";
+	case kFrameTypeEnterSelfProgramMode: return "EnterSelfProgramMode";
+	}
+	return NULL;
+}
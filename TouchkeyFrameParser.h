@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+#include "TouchkeyDevice.h"
+
+// TouchkeyFrameParser
+//
+// Splits a stream of bytes in the TouchKeys protocol into frames: each
+// frame starts with ESCAPE_CHARACTER kControlCharacterFrameBegin, then the
+// frame type, the payload, in which a literal ESCAPE_CHARACTER is sent
+// twice, and ESCAPE_CHARACTER kControlCharacterFrameEnd. Bytes can be
+// passed in chunks of any size: a frame may span several calls to
+// process() and a call may hold several frames. Every complete frame is
+// passed, unescaped, to the callback. Does not allocate and keeps no more
+// than one frame of TOUCHKEY_MAX_FRAME_LENGTH bytes.
+//
+// Anything else counts as an error and is skipped: bytes outside of a frame,
+// frames that are empty, too long or interrupted by another control
+// sequence. Parsing resumes at the next frame start.
+class TouchkeyFrameParser
+{
+public:
+	typedef void (*FrameCallback)(void* arg, unsigned char type, const unsigned char* payload, size_t length);
+	TouchkeyFrameParser() {};
+	TouchkeyFrameParser(FrameCallback callback, void* arg) { setCallback(callback, arg); }
+	void setCallback(FrameCallback callback, void* arg);
+	void process(const unsigned char* data, size_t length);
+	// Drop any partial frame
+	void reset();
+	size_t getFrames() { return frames; }
+	size_t getErrors() { return errors; }
+private:
+	void frameEnded();
+	FrameCallback callback = NULL;
+	void* arg = NULL;
+	unsigned char frame[TOUCHKEY_MAX_FRAME_LENGTH];
+	size_t length = 0;
+	bool inFrame = false;
+	bool escape = false;
+	bool overflow = false;
+	size_t frames = 0;
+	size_t errors = 0;
+};
+
+// Write a whole frame of the given type to frame: start sequence, type and
+// payload with any ESCAPE_CHARACTER doubled, end sequence. frame must hold
+// 2 * payloadLength + 6 bytes. Returns the length
+size_t touchkeyFrameWrite(unsigned char* frame, unsigned char type, const unsigned char* payload, size_t payloadLength);
+
+// Name of a frame type from TouchkeyDevice.h, for logging. NULL if unknown
+const char* touchkeyFrameTypeName(unsigned char type);
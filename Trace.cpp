@@ -0,0 +1,67 @@
+#include "Trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+const TraceEventDesc kTraceEvents[kNumTraceEvents] = {
+	{ "state change", 1, "frame", { "state", NULL } },
+	{ "reset", 1, NULL, { "from state", NULL } },
+	{ "back to idle", 1, "frame", { "position", NULL } },
+	{ "restart", 1, "frame", { "position", "onset threshold" } },
+	{ "not percussive", 1, NULL, { "max velocity", NULL } },
+	{ "percussiveness read", 1, NULL, { "velocity", NULL } },
+	{ "new minimum", 1, NULL, { "start position", "last min/max position" } },
+	{ "previous location", 1, "index", { NULL, NULL } },
+	{ "velocity available", 1, "index", { NULL, NULL } },
+	{ "press start", 2, "index", { NULL, NULL } },
+	{ "velocity spike", 2, "max velocity at index", { "max velocity", "largest difference" } },
+	{ "spike area", 2, NULL, { "before", "after" } },
+	{ "sample", 3, "frame", { "position", "pressing" } },
+	{ "bend", 2, NULL, { "primary key", "secondary key" } },
+};
+
+thread_local TraceRing* gTraceRing = nullptr;
+static TraceRing gTraceRings[kMaxTraceThreads];
+static std::atomic<unsigned int> gTraceRingsClaimed{0};
+
+TraceRing* traceClaimRing()
+{
+	unsigned int n = gTraceRingsClaimed.fetch_add(1, std::memory_order_relaxed);
+	if(n >= kMaxTraceThreads)
+	{
+		gTraceRingsClaimed.store(kMaxTraceThreads, std::memory_order_relaxed);
+		return nullptr;
+	}
+	return &gTraceRings[n];
+}
+
+// File format, native endianness:
+// "KEYTRACE", uint32 sizeof(TraceRecord), uint32 number of rings, then for
+// each ring: uint32 number of records, and the records, oldest first
+bool traceDump(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if(!file)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	uint32_t header[2] = { sizeof(TraceRecord), 0 };
+	header[1] = gTraceRingsClaimed.load(std::memory_order_acquire);
+	if(header[1] > kMaxTraceThreads)
+		header[1] = kMaxTraceThreads;
+	bool ok = fwrite("KEYTRACE", 8, 1, file) && fwrite(header, sizeof(header), 1, file);
+	for(unsigned int r = 0; r < header[1] && ok; ++r)
+	{
+		const TraceRing& ring = gTraceRings[r];
+		uint32_t written = ring.written.load(std::memory_order_acquire);
+		uint32_t count = written < kTraceRingLength ? written : kTraceRingLength;
+		ok &= 1 == fwrite(&count, sizeof(count), 1, file);
+		for(uint32_t n = written - count; n != written && ok; ++n)
+			ok &= 1 == fwrite(&ring.records[n & (kTraceRingLength - 1)], sizeof(TraceRecord), 1, file);
+	}
+	ok &= 0 == fclose(file);
+	if(!ok)
+		fprintf(stderr, "Error writing %s\n", path);
+	return ok;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+// Trace
+//
+// Tracing for the real-time paths: each trace() stores a fixed-size binary
+// record in a ring that belongs to the calling thread, with no formatting,
+// locking nor allocation, so that it can stay on in production. The rings
+// keep the latest kTraceRingLength records of each thread. traceDump()
+// writes them to a file, and trace-decode (TraceDecode.cpp) prints that.
+//
+// TRACE_LEVEL selects at compile time which records are kept: 0 none,
+// 1 (the default) state changes and other occasional events, 2 the details
+// of feature extraction and of bends, every frame, 3 every sample of every
+// key. Records above it are compiled out.
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 1
+#endif /* TRACE_LEVEL */
+
+enum TraceEvent : uint16_t {
+	// KeyPositionTracker
+	kTraceStateChange = 0,		// at: frame; new state
+	kTraceReset,				// state it resets from
+	kTraceBackToIdle,			// at: frame; position
+	kTraceRestart,				// at: frame; position, onset threshold
+	kTraceNotPercussive,		// maximum velocity
+	kTracePercussivenessRead,	// velocity of the spike
+	kTraceNewMinimum,			// start position, previous min/max position
+	kTracePreviousLocation,		// at: buffer index
+	kTraceVelocityAvailable,	// at: buffer index, at the start of the press
+	kTracePressStart,			// at: buffer index
+	kTraceVelocitySpike,		// at: buffer index of the maximum velocity; maximum velocity, largest difference
+	kTraceSpikeArea,			// area before, area after
+	kTraceSample,				// at: frame; position, pressing
+	// KeyboardState
+	kTraceBend,					// primary key, secondary key
+	kNumTraceEvents
+};
+
+// What trace-decode prints for each event: the name, the level and what
+// TraceRecord::at and the values are (NULL: unused)
+struct TraceEventDesc {
+	const char* name;
+	unsigned int level;
+	const char* at;
+	const char* values[2];
+};
+extern const TraceEventDesc kTraceEvents[kNumTraceEvents];
+
+// 24 bytes. Frames and buffer indices go in at, as integers: they grow for
+// as long as the program runs, and would lose precision as floats after
+// 2^24 frames. The values hold positions, velocities, states and the like
+struct TraceRecord {
+	uint32_t sequence;	// per thread: gaps are records lost to the ring wrapping
+	uint16_t event;		// TraceEvent
+	int16_t key;		// -1 if none
+	uint64_t at;		// frame or buffer index, 0 if none
+	float values[2];
+};
+
+const unsigned int kTraceRingLength = 4096; // a power of two
+const unsigned int kMaxTraceThreads = 8;
+
+struct TraceRing {
+	TraceRecord records[kTraceRingLength];
+	std::atomic<uint32_t> written{0};
+};
+
+// The ring of the calling thread, claimed from a static pool on its first
+// record. NULL if the pool is exhausted: the records of that thread are lost
+extern thread_local TraceRing* gTraceRing;
+TraceRing* traceClaimRing();
+
+static inline void traceRecord(uint16_t event, int key, uint64_t at, float a, float b)
+{
+	TraceRing* ring = gTraceRing;
+	if(!ring)
+	{
+		ring = gTraceRing = traceClaimRing();
+		if(!ring)
+			return;
+	}
+	uint32_t n = ring->written.load(std::memory_order_relaxed);
+	TraceRecord& record = ring->records[n & (kTraceRingLength - 1)];
+	record.sequence = n;
+	record.event = event;
+	record.key = key;
+	record.at = at;
+	record.values[0] = a;
+	record.values[1] = b;
+	ring->written.store(n + 1, std::memory_order_release);
+}
+
+template <unsigned int level>
+static inline void trace(uint16_t event, int key, float a = 0, float b = 0)
+{
+	if(level <= TRACE_LEVEL)
+		traceRecord(event, key, 0, a, b);
+}
+
+// For the events that refer to a frame or a buffer index
+template <unsigned int level>
+static inline void traceAt(uint16_t event, int key, uint64_t at, float a = 0, float b = 0)
+{
+	if(level <= TRACE_LEVEL)
+		traceRecord(event, key, at, a, b);
+}
+
+// Write the rings of all threads to path. Not real-time safe. Records written
+// while this runs may be torn: trace-decode reports them as sequence gaps
+bool traceDump(const char* path);
@@ -0,0 +1,127 @@
+// Prints a trace dump, as written by traceDump() (see Trace.h): the records
+// of each thread, oldest first, one per line, and the gaps in their
+// sequence numbers, i.e.: records overwritten before the dump.
+//
+// Usage: trace-decode [-k <key>] [-e <event>] <trace dump file>
+// -k, -e: only print the records of the given key, or event (its name as
+// printed, or its number)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "Trace.h"
+#include "KeyPositionTracker.h"
+
+static void printRecord(const TraceRecord& record)
+{
+	printf("%10u ", record.sequence);
+	if(record.key >= 0)
+		printf("key %3d ", record.key);
+	else
+		printf("        ");
+	if(record.event >= kNumTraceEvents)
+	{
+		printf("unknown event %u\n", record.event);
+		return;
+	}
+	const TraceEventDesc& desc = kTraceEvents[record.event];
+	printf("%-20s", desc.name);
+	bool first = true;
+	if(desc.at)
+	{
+		printf(" %s: %llu", desc.at, (unsigned long long)record.at);
+		first = false;
+	}
+	for(unsigned int n = 0; n < 2 && desc.values[n]; ++n)
+	{
+		float value = record.values[n];
+		printf("%s %s: %g", first ? "" : ",", desc.values[n], value);
+		first = false;
+		// the states of KeyPositionTracker
+		if(strstr(desc.values[n], "state") && value >= 0 && value < statesDesc.size())
+			printf(" (%s)", statesDesc[(unsigned int)value].c_str());
+	}
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	int key = -1;
+	int event = -1;
+	const char* path = NULL;
+	bool usage = false;
+	for(int n = 1; n < argc; ++n)
+	{
+		if(!strcmp(argv[n], "-k") && n + 1 < argc)
+			key = atoi(argv[++n]);
+		else if(!strcmp(argv[n], "-e") && n + 1 < argc)
+		{
+			const char* name = argv[++n];
+			for(unsigned int e = 0; e < kNumTraceEvents; ++e)
+			{
+				if(!strcmp(name, kTraceEvents[e].name))
+					event = e;
+			}
+			if(event < 0)
+				event = atoi(name);
+		}
+		else if(!path && argv[n][0] != '-')
+			path = argv[n];
+		else
+			usage = true;
+	}
+	if(!path || usage)
+	{
+		fprintf(stderr, "Usage: %s [-k <key>] [-e <event>] <trace dump file>\n", argv[0]);
+		return 1;
+	}
+	FILE* file = fopen(path, "rb");
+	if(!file)
+	{
+		fprintf(stderr, "Error opening %s\n", path);
+		return 1;
+	}
+	char magic[8];
+	uint32_t header[2];
+	if(1 != fread(magic, sizeof(magic), 1, file) || memcmp(magic, "KEYTRACE", sizeof(magic))
+		|| 1 != fread(header, sizeof(header), 1, file))
+	{
+		fprintf(stderr, "%s is not a trace dump\n", path);
+		return 1;
+	}
+	if(header[0] != sizeof(TraceRecord))
+	{
+		fprintf(stderr, "%s has records of %u bytes, expected %zu\n", path, header[0], sizeof(TraceRecord));
+		return 1;
+	}
+	for(unsigned int r = 0; r < header[1]; ++r)
+	{
+		uint32_t count;
+		if(1 != fread(&count, sizeof(count), 1, file))
+		{
+			fprintf(stderr, "%s is truncated\n", path);
+			return 1;
+		}
+		std::vector<TraceRecord> records(count);
+		if(count && 1 != fread(records.data(), sizeof(TraceRecord) * count, 1, file))
+		{
+			fprintf(stderr, "%s is truncated\n", path);
+			return 1;
+		}
+		printf("Thread %u: %u records", r, count);
+		if(count)
+			printf(", from %u to %u", records.front().sequence, records.back().sequence);
+		printf("\n");
+		for(size_t n = 0; n < records.size(); ++n)
+		{
+			const TraceRecord& record = records[n];
+			if(n && record.sequence != records[n - 1].sequence + 1)
+				printf("   (%d records missing)\n", (int)(record.sequence - records[n - 1].sequence - 1));
+			if((key < 0 || record.key == key) && (event < 0 || record.event == event))
+				printRecord(record);
+		}
+	}
+	fclose(file);
+	return 0;
+}
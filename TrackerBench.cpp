@@ -0,0 +1,276 @@
+// Microbenchmarks of the tracker hot paths.
+//
+// Drives the tracking pipeline with synthetic gestures (see
+// SyntheticGestures.h) for keyboards of 25, 49 and 88 keys and reports the
+// average time per call and per frame of:
+// - KeyBuffers::postCallback(), and the same ingest into one vector of
+//   positions and one of timestamps per key, as KeyBuffers stored frames
+//   before it became a single frame-major ring
+// - KeyPositionTracker::triggerReceived(), split by the state the tracker
+//   was in, with onsets (which run findKeyPressStart()) reported separately
+// - pressVelocity(), releaseVelocity() and pressPercussiveness(), timed when
+//   the matching feature becomes available
+// - KeyboardTracker::processFrame() and KeyboardState::render()
+// - KeyboardTracker::processFrame() with the keys split across 2 and 4
+//   threads, where there are at least as many cores online
+//
+// Usage: bench [<frames per run>]
+// Anything the code under test prints is discarded while the benchmarks run.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include "KeyboardTracker.h"
+#include "KeyboardState.h"
+#include "SyntheticGestures.h"
+
+static int gOut = STDOUT_FILENO;
+
+static inline double now()
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time taken by now() itself, subtracted from single-call measurements
+static double gTimerOverhead = 0;
+
+static void measureTimerOverhead()
+{
+	const int reps = 100000;
+	double start = now();
+	for(int n = 0; n < reps; ++n)
+		now();
+	gTimerOverhead = (now() - start) / reps;
+}
+
+class Stat
+{
+public:
+	void add(double ns, unsigned int count = 1) { total += ns; calls += count; }
+	double total = 0;
+	size_t calls = 0;
+};
+
+// KeyBuffers as it was before the frame-major ring, kept only to compare
+// ingest against it
+class PerKeyBuffers
+{
+public:
+	PerKeyBuffers(unsigned int numKeys, unsigned int bufferLength) :
+		positionBuffer(numKeys, std::vector<float>(bufferLength)),
+		timestamps(numKeys, std::vector<timestamp_type>(bufferLength))
+	{}
+	void postCallback(const float* buffer, unsigned int length, timestamp_type timestamp)
+	{
+		for(unsigned int n = 0; n < std::min<size_t>(positionBuffer.size(), length); ++n)
+		{
+			positionBuffer[n][writeIdx] = buffer[n];
+			timestamps[n][writeIdx] = timestamp;
+		}
+		++writeIdx;
+		if(writeIdx >= positionBuffer[0].size())
+		{
+			writeIdx = 0;
+			full = true;
+		}
+		if(full)
+			++firstSampleIndex;
+	}
+	std::vector<std::vector<float>> positionBuffer;
+	std::vector<std::vector<timestamp_type>> timestamps;
+	size_t writeIdx = 0;
+	size_t firstSampleIndex = 0;
+	bool full = false;
+};
+
+static void report(unsigned int numKeys, int gesture, const char* name, const Stat& stat, bool singleCalls)
+{
+	if(!stat.calls)
+		return;
+	double perCall = stat.total / stat.calls;
+	if(singleCalls)
+		perCall = std::max(0.0, perCall - gTimerOverhead);
+	dprintf(gOut, "%4u  %-15s %-64s %9zu %10.1f\n", numKeys, kGestureNames[gesture], name, stat.calls, perCall);
+}
+
+static void benchmark(unsigned int numKeys, int gesture, size_t numFrames)
+{
+	const unsigned int bufferLength = 1000;
+	std::vector<float> frames(numKeys * numFrames);
+	SyntheticGestures gestures(numKeys, gesture);
+	for(size_t n = 0; n < numFrames; ++n)
+		gestures.render(frames.data() + n * numKeys);
+
+	// Ingest alone
+	Stat ingest;
+	{
+		KeyBuffers keyBuffers;
+		keyBuffers.setup(numKeys, bufferLength);
+		double start = now();
+		for(size_t n = 0; n < numFrames; ++n)
+			keyBuffers.postCallback(frames.data() + n * numKeys, numKeys, n);
+		ingest.add(now() - start, numFrames);
+	}
+	Stat ingestPerKey;
+	{
+		PerKeyBuffers keyBuffers(numKeys, bufferLength);
+		double start = now();
+		for(size_t n = 0; n < numFrames; ++n)
+			keyBuffers.postCallback(frames.data() + n * numKeys, numKeys, n);
+		ingestPerKey.add(now() - start, numFrames);
+	}
+
+	// Individual calls into the trackers
+	Stat trigger[kPositionTrackerStateReleaseFinished + 1];
+	Stat onset;
+	Stat pressVelocity, releaseVelocity, percussiveness;
+	{
+		KeyboardTracker keyboardTracker(numKeys, bufferLength);
+		KeyBuffers& keyBuffers = keyboardTracker.getBuffers();
+		auto& trackers = keyboardTracker.getTrackers();
+		for(size_t n = 0; n < numFrames; ++n)
+		{
+			const float* frame = frames.data() + n * numKeys;
+			keyBuffers.postCallback(frame, numKeys, n);
+			for(unsigned int k = 0; k < numKeys; ++k)
+			{
+				if(trackers[k].idle(keyBuffers.latestFrame()[k]))
+					continue;
+				int state = trackers[k].currentState();
+				double start = now();
+				trackers[k].triggerReceived(n);
+				double elapsed = now() - start;
+				if(kPositionTrackerStateUnknown == state && kPositionTrackerStateUnknown != trackers[k].currentState())
+					onset.add(elapsed);
+				else
+					trigger[state].add(elapsed);
+			}
+			KeyPositionTrackerNotification notification;
+			while(keyboardTracker.popNotification(notification))
+			{
+				KeyPositionTracker& tracker = trackers[notification.key];
+				double start = now();
+				switch(notification.type)
+				{
+				case KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity:
+					tracker.pressVelocity();
+					pressVelocity.add(now() - start);
+					break;
+				case KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableReleaseVelocity:
+					tracker.releaseVelocity();
+					releaseVelocity.add(now() - start);
+					break;
+				case KeyPositionTrackerNotification::kNotificationTypeFeatureAvailablePercussiveness:
+					tracker.pressPercussiveness();
+					percussiveness.add(now() - start);
+					break;
+				}
+			}
+		}
+	}
+
+	// Whole frames
+	Stat processFrame, render, renderPolyphonic, renderWideBends;
+	{
+		KeyboardTracker keyboardTracker(numKeys, bufferLength);
+		KeyboardState keyboardState(numKeys);
+		KeyboardState polyphonicState(numKeys, 4);
+		KeyboardState wideBendsState(numKeys);
+		KeyboardStateParameters wideBends;
+		wideBends.bendMaxDistance = 12;
+		wideBendsState.setParameters(wideBends);
+		for(size_t n = 0; n < numFrames; ++n)
+		{
+			const float* frame = frames.data() + n * numKeys;
+			double start = now();
+			keyboardTracker.processFrame(frame, n);
+			double middle = now();
+			keyboardState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, keyboardTracker.getActiveKeys());
+			double end = now();
+			polyphonicState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, keyboardTracker.getActiveKeys());
+			processFrame.add(middle - start);
+			render.add(end - middle);
+			double endPolyphonic = now();
+			renderPolyphonic.add(endPolyphonic - end);
+			wideBendsState.render(keyboardTracker.getBuffers().latestFrame(), keyboardTracker.getTrackers(), 0, -1, keyboardTracker.getActiveKeys());
+			renderWideBends.add(now() - endPolyphonic);
+			KeyPositionTrackerNotification notification;
+			while(keyboardTracker.popNotification(notification))
+				;
+		}
+	}
+
+	// Whole frames, sharded
+	std::vector<std::pair<unsigned int, Stat>> sharded;
+	for(unsigned int numShards : {2, 4})
+	{
+		if(sysconf(_SC_NPROCESSORS_ONLN) < numShards)
+			continue;
+		KeyboardTracker keyboardTracker;
+		keyboardTracker.setup(numKeys, bufferLength, 1024, numShards);
+		Stat stat;
+		for(size_t n = 0; n < numFrames; ++n)
+		{
+			const float* frame = frames.data() + n * numKeys;
+			double start = now();
+			keyboardTracker.processFrame(frame, n);
+			stat.add(now() - start);
+			KeyPositionTrackerNotification notification;
+			while(keyboardTracker.popNotification(notification))
+				;
+		}
+		sharded.emplace_back(numShards, stat);
+	}
+
+	report(numKeys, gesture, "KeyBuffers::postCallback (per frame)", ingest, false);
+	report(numKeys, gesture, "KeyBuffers::postCallback, per-key vectors (per frame)", ingestPerKey, false);
+	for(unsigned int n = 0; n <= kPositionTrackerStateReleaseFinished; ++n)
+		report(numKeys, gesture, ("triggerReceived in " + statesDesc[n]).c_str(), trigger[n], true);
+	report(numKeys, gesture, "triggerReceived at onset (findKeyPressStart)", onset, true);
+	report(numKeys, gesture, "pressVelocity", pressVelocity, true);
+	report(numKeys, gesture, "releaseVelocity", releaseVelocity, true);
+	report(numKeys, gesture, "pressPercussiveness", percussiveness, true);
+	report(numKeys, gesture, "KeyboardTracker::processFrame (per frame)", processFrame, true);
+	report(numKeys, gesture, "KeyboardState::render (per frame)", render, true);
+	report(numKeys, gesture, "KeyboardState::render, 4 voices (per frame)", renderPolyphonic, true);
+	report(numKeys, gesture, "KeyboardState::render, bends over 12 keys (per frame)", renderWideBends, true);
+	for(auto& stat : sharded)
+		report(numKeys, gesture, ("KeyboardTracker::processFrame, " + std::to_string(stat.first) + " threads (per frame)").c_str(), stat.second, true);
+}
+
+int main(int argc, char** argv)
+{
+	size_t numFrames = 20000;
+	if(argc > 1)
+		numFrames = strtoul(argv[1], NULL, 0);
+	if(!numFrames)
+	{
+		fprintf(stderr, "Usage: %s [<frames per run>]\n", argv[0]);
+		return 1;
+	}
+	// keep our own output, and silence the code under test
+	gOut = dup(STDOUT_FILENO);
+	int devNull = open("/dev/null", O_WRONLY);
+	if(gOut < 0 || devNull < 0)
+	{
+		perror("Error redirecting output");
+		return 1;
+	}
+	fflush(stdout);
+	dup2(devNull, STDOUT_FILENO);
+	dup2(devNull, STDERR_FILENO);
+
+	measureTimerOverhead();
+	dprintf(gOut, "%zu frames per run, timer overhead %.1f ns (subtracted from single calls)\n", numFrames, gTimerOverhead);
+	dprintf(gOut, "%4s  %-15s %-64s %9s %10s\n", "keys", "gesture", "benchmark", "calls", "ns/call");
+	for(unsigned int numKeys : {25, 49, 88})
+		for(int gesture = 0; gesture < kNumGestures; ++gesture)
+			benchmark(numKeys, gesture, numFrames);
+	return 0;
+}
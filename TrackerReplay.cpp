@@ -0,0 +1,187 @@
+// Offline replay of recorded key positions through the trackers.
+//
+// Reads a recording of the whole keyboard, feeds it to a KeyboardTracker as
+// fast as possible and writes out every notification (state transitions and
+// features) as text, so that changes to the tracker can be regression-tested
+// and profiled on a normal workstation.
+//
+// Input: either a capture file (see KeyCapture.h), replayed straight from
+// memory with the frame index as the timestamp, or a text file with one
+// frame per line: the frame number followed by the position of each key. Empty
+// lines and lines starting with '#' are ignored.
+// Output: one notification per line:
+// frame key type state velocity percussiveness
+// where missing values are printed as "-".
+// With -s, the keys are split across that many threads (see KeyboardTracker),
+// which must not change the output.
+// With -t, the trace records (see Trace.h) are written to that file at the end.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "KeyboardTracker.h"
+#include "KeyCapture.h"
+#include "Trace.h"
+
+static bool readFrames(const char* path, unsigned int& numKeys, std::vector<frame_type>& timestamps, std::vector<float>& frames)
+{
+	std::ifstream file(path);
+	if(!file.is_open())
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	numKeys = 0;
+	std::string line;
+	std::vector<float> frame;
+	unsigned int lineNumber = 0;
+	while(std::getline(file, line))
+	{
+		++lineNumber;
+		if(line.empty() || '#' == line[0])
+			continue;
+		std::istringstream fields(line);
+		frame_type timestamp;
+		if(!(fields >> timestamp))
+			continue;
+		frame.clear();
+		float value;
+		while(fields >> value)
+			frame.push_back(value);
+		if(0 == numKeys)
+			numKeys = frame.size();
+		if(0 == numKeys || frame.size() != numKeys)
+		{
+			fprintf(stderr, "%s:%u: expected %u keys, found %zu\n", path, lineNumber, numKeys, frame.size());
+			return false;
+		}
+		timestamps.push_back(timestamp);
+		frames.insert(frames.end(), frame.begin(), frame.end());
+	}
+	return true;
+}
+
+static void printValue(FILE* out, float value)
+{
+	if(missing_value<float>::isMissing(value))
+		fprintf(out, " -");
+	else
+		fprintf(out, " %.6f", value);
+}
+
+static void printVelocity(FILE* out, key_velocity velocity)
+{
+	if(missing_value<key_velocity>::isMissing(velocity))
+		fprintf(out, " -");
+	else
+		fprintf(out, " %.6f", key_velocity_to_float(velocity));
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int numShards = 1;
+	const char* tracePath = NULL;
+	while(argc > 2 && (!strcmp(argv[1], "-s") || !strcmp(argv[1], "-t")))
+	{
+		if(!strcmp(argv[1], "-s"))
+			numShards = strtoul(argv[2], NULL, 0);
+		else
+			tracePath = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+	if(argc < 2 || !numShards)
+	{
+		fprintf(stderr, "Usage: %s [-s <shards>] [-t <trace file>] <positions> [<notifications>]\n", argv[0]);
+		return 1;
+	}
+	unsigned int numKeys;
+	size_t numFrames;
+	std::vector<frame_type> timestamps;
+	std::vector<float> frames;
+	KeyCaptureReader capture;
+	if(capture.open(argv[1]))
+	{
+		numKeys = capture.getNumKeys();
+		numFrames = capture.getNumFrames();
+		// float captures are processed in place, int16 ones are converted
+		// one frame at a time straight into the tracker's buffers
+	} else {
+		if(!readFrames(argv[1], numKeys, timestamps, frames))
+			return 1;
+		numFrames = timestamps.size();
+	}
+	FILE* out = stdout;
+	if(argc > 2)
+	{
+		out = fopen(argv[2], "w");
+		if(!out)
+		{
+			fprintf(stderr, "Error opening %s: %s\n", argv[2], strerror(errno));
+			return 1;
+		}
+	}
+	KeyboardTracker keyboardTracker;
+	if(!keyboardTracker.setup(numKeys, 1000, 1024, numShards))
+	{
+		fprintf(stderr, "Empty recording\n");
+		return 1;
+	}
+
+	// drain the notifications after every frame so that the queue never
+	// overflows, but only format them once the timed section is over
+	std::vector<KeyPositionTrackerNotification> notifications;
+	notifications.reserve(numFrames);
+	auto start = std::chrono::steady_clock::now();
+	for(size_t n = 0; n < numFrames; ++n)
+	{
+		if(capture.getNumFrames())
+		{
+			if(const float* frame = capture.getFloatFrame(n))
+			{
+				keyboardTracker.processFrame(frame, n);
+			} else {
+#ifdef FIXED_POINT_PIANO_SAMPLES
+				// int16 captures have the same scale as key_sample
+				memcpy(keyboardTracker.nextFrame(), capture.getInt16Frame(n), numKeys * sizeof(key_sample));
+#else /* FIXED_POINT_PIANO_SAMPLES */
+				capture.getFrame(n, keyboardTracker.nextFrame());
+#endif /* FIXED_POINT_PIANO_SAMPLES */
+				keyboardTracker.processFrame(n);
+			}
+		} else {
+			keyboardTracker.processFrame(frames.data() + n * numKeys, timestamps[n]);
+		}
+		KeyPositionTrackerNotification notification;
+		while(keyboardTracker.popNotification(notification))
+			notifications.push_back(notification);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	for(auto& notification : notifications)
+	{
+		fprintf(out, "%llu %d %s %s", (unsigned long long)notification.timestamp, notification.key,
+				KeyPositionTrackerNotification::desc[notification.type].c_str(),
+				statesDesc[notification.state].c_str());
+		printVelocity(out, notification.velocity);
+		printValue(out, notification.percussiveness);
+		fprintf(out, "\n");
+	}
+	if(out != stdout)
+		fclose(out);
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	fprintf(stderr, "%zu frames of %u keys on %u threads in %.3f s: %.0f frames per second, %zu notifications\n",
+			numFrames, numKeys, keyboardTracker.getNumShards(), seconds, seconds > 0 ? numFrames / seconds : 0, notifications.size());
+	if(keyboardTracker.getDroppedNotifications())
+		fprintf(stderr, "%zu notifications dropped\n", keyboardTracker.getDroppedNotifications());
+	if(tracePath && !traceDump(tracePath))
+		return 1;
+	return 0;
+}
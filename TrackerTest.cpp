@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,83 +12,188 @@
 #include <poll.h>
 
 // example application
-#include <signal.h>
 #include <stdint.h>
 #include <pthread.h>
 
-#include <Keys.h>
-#include "KeyPositionTracker.h"
-int gShouldStop = 0;
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include "KeyboardTracker.h"
+#include "KeyCapture.h"
+#include "EventLoop.h"
+#include "ScanSource.h"
+#include "Trace.h"
+#ifndef HOST_BUILD
+#include "KeysScanSource.h"
 int gXenomaiInited = 0; // required by libbelaextra
 unsigned int gAuxiliaryTaskStackSize  = 1 << 17; // required by libbelaextra
-BoardsTopology bt;
-Keys* keys;
-unsigned int octaves;
+#endif /* HOST_BUILD */
 
-void interrupt_handler(int)
+KeyboardTracker keyboardTracker;
+KeyCaptureWriter captureWriter;
+bool gCapture = false;
+EventLoop gEventLoop;
+// how long processFrame() takes, only accessed by the scanning thread
+// until it stops
+static size_t gFramesProcessed = 0;
+static double gProcessingTime = 0;
+static double gProcessingTimeMax = 0;
+void postCallback(void* arg, float* buffer, unsigned int length)
 {
-	gShouldStop = 1;
+	static frame_type frame = 0;
+	if(length < keyboardTracker.getNumKeys())
+		return;
+	if(gCapture)
+		captureWriter.write(buffer);
+	auto start = std::chrono::steady_clock::now();
+	keyboardTracker.processFrame(buffer, frame);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	gProcessingTime += elapsed;
+	gProcessingTimeMax = std::max(gProcessingTimeMax, elapsed);
+	++gFramesProcessed;
+	frame++;
+	// at most once per wake-up of the main thread, i.e.: per burst of
+	// notifications, and without leaving primary mode, see EventLoop
+	if(keyboardTracker.getPendingNotifications())
+		gEventLoop.notifyRt();
 }
 
-extern "C" int rt_printf(const char *format, ...);
-KeyBuffers keyBuffers;
-std::vector<KeyBuffer> keyBuffer;
-std::vector<KeyPositionTracker> keyPositionTrackers;
-void postCallback(void* arg, float* buffer, unsigned int length)
+static void sourceEnded(void*)
+{
+	gEventLoop.stop();
+}
+
+static void printNotifications(void*)
 {
-	Keys* keys = (Keys*)arg;
-	static int count = 0;
-	keyBuffers.postCallback(buffer, length);
-	for(unsigned int n = 0; n < length; ++n)
+	KeyPositionTrackerNotification notification;
+	while(keyboardTracker.popNotification(notification))
 	{
-		if(n >= 45 && n < 82)
-		{
-			keyPositionTrackers[n].triggerReceived(count);
-		}
+		printf("%.3f key %d: %s, %s", framesToSeconds(notification.timestamp), notification.key,
+				KeyPositionTrackerNotification::desc[notification.type].c_str(),
+				statesDesc[notification.state].c_str());
+		if(!missing_value<key_velocity>::isMissing(notification.velocity))
+			printf(", velocity: %7.5f", key_velocity_to_float(notification.velocity));
+		if(!missing_value<float>::isMissing(notification.percussiveness))
+			printf(", percussiveness: %7.5f", notification.percussiveness);
+		printf("\n");
+	}
+	static size_t dropped = 0;
+	if(keyboardTracker.getDroppedNotifications() != dropped)
+	{
+		dropped = keyboardTracker.getDroppedNotifications();
+		fprintf(stderr, "%zu notifications dropped so far\n", dropped);
 	}
-	count++;
 }
 
-int main()
+// Usage: tracker [-g <gesture> [-k <keys>] | -p <capture file>] [-s <scan rate>] [-u] [-t <trace file>] [<capture file>]
+// Scans come from the Keys board or, without it, from a synthetic gesture
+// (-g, see SyntheticGestures) on the given number of keys, or from a
+// capture file (-p) played once. -s sets the rate of the synthetic gesture,
+// -u runs either as fast as possible. -t writes the trace records (see
+// Trace.h) to a file on exit. The last argument is a file to capture the
+// scans to.
+int main(int argc, char** argv)
 {
-	int dummy = 0;
+	int gesture = -1;
+	unsigned int numKeys = 88;
+	const char* playbackPath = NULL;
+	float scanRate = kKeyScanFrameRate;
+	bool paced = true;
+	const char* capturePath = NULL;
+	const char* tracePath = NULL;
+	for(int n = 1; n < argc; ++n)
+	{
+		if(!strcmp(argv[n], "-g") && n + 1 < argc)
+		{
+			gesture = gestureFromName(argv[++n]);
+			if(gesture < 0)
+			{
+				fprintf(stderr, "Unknown gesture %s\n", argv[n]);
+				return 1;
+			}
+		}
+		else if(!strcmp(argv[n], "-k") && n + 1 < argc)
+			numKeys = strtoul(argv[++n], NULL, 0);
+		else if(!strcmp(argv[n], "-p") && n + 1 < argc)
+			playbackPath = argv[++n];
+		else if(!strcmp(argv[n], "-s") && n + 1 < argc)
+			scanRate = atof(argv[++n]);
+		else if(!strcmp(argv[n], "-u"))
+			paced = false;
+		else if(!strcmp(argv[n], "-t") && n + 1 < argc)
+			tracePath = argv[++n];
+		else if(!capturePath && argv[n][0] != '-')
+			capturePath = argv[n];
+		else {
+			fprintf(stderr, "Usage: %s [-g <gesture> [-k <keys>] | -p <capture file>] [-s <scan rate>] [-u] [-t <trace file>] [<capture file>]\n", argv[0]);
+			return 1;
+		}
+	}
 	auto path = "/root/out.calib";
-	keys = new Keys;
-	bt.setLowestNote(0);
-	bt.setBoard(0, 0, 24);
-	bt.setBoard(1, 0, 23);
-	bt.setBoard(2, 0, 23);
-
-	int ret = keys->start(&bt, NULL);
-	int bottomKey = bt.getLowestNote();
-	int topKey = bt.getHighestNote();
-	int bottomOctave = bottomKey / 12;
-	int topOctave = topKey / 12;
-	int numKeys = topKey - bottomKey + 1;
-	keyBuffers.setup(numKeys, 1000);
-	keyBuffer.reserve(numKeys); // avoid reallocation in the loop below
-	for(unsigned int n = 0; n < numKeys; ++n)
+	// before any other thread is started, see EventLoop::setup()
+	if(!gEventLoop.setup())
+		return 1;
+	gEventLoop.setNotifyHandler(printNotifications, NULL);
+	std::unique_ptr<ScanSource> source;
+	if(playbackPath)
+	{
+		FileScanSource* file = new FileScanSource;
+		source.reset(file);
+		if(!file->setup(playbackPath, paced))
+		{
+			fprintf(stderr, "Error opening %s\n", playbackPath);
+			return 1;
+		}
+	} else if(gesture >= 0) {
+		SyntheticScanSource* synthetic = new SyntheticScanSource;
+		source.reset(synthetic);
+		if(!synthetic->setup(numKeys, gesture, scanRate, paced))
+		{
+			fprintf(stderr, "Invalid number of keys or scan rate\n");
+			return 1;
+		}
+	} else {
+#ifdef HOST_BUILD
+		fprintf(stderr, "No Keys board in host builds: use -g or -p\n");
+		return 1;
+#else /* HOST_BUILD */
+		KeysScanSource* keys = new KeysScanSource;
+		source.reset(keys);
+		BoardsTopology& bt = keys->getTopology();
+		bt.setLowestNote(0);
+		bt.setBoard(0, 0, 24);
+		bt.setBoard(1, 0, 23);
+		bt.setBoard(2, 0, 23);
+#endif /* HOST_BUILD */
+	}
+	numKeys = source->getNumKeys();
+	keyboardTracker.setup(numKeys, 1000);
+	if(capturePath)
 	{
-		keyBuffer.emplace_back(
-			keyBuffers.positionBuffer[n],
-			keyBuffers.timestamps[n],
-			keyBuffers.firstSampleIndex,
-			keyBuffers.writeIdx
-		);
-		keyPositionTrackers.emplace_back(
-				10, keyBuffer[n]
-				);
-		keyPositionTrackers.back().engage();
+		// the scan rate of the board is nominal: the post callback does not report it
+		gCapture = captureWriter.setup(capturePath, numKeys, source->getLowestNote(), source->getScanRate(), calibrationIdFromFile(path));
+		if(gCapture)
+			printf("Capturing to %s\n", capturePath);
 	}
-	keys->setPostCallback(postCallback, keys);
-	keys->startTopCalibration();
-	keys->loadInverseSquareCalibrationFile(path, 0);
-	signal(SIGINT, interrupt_handler);
-	signal(SIGTERM, interrupt_handler);
-	while(!gShouldStop)
+	source->setEndCallback(sourceEnded, NULL);
+	if(!source->start(postCallback, NULL))
+		return 1;
+#ifndef HOST_BUILD
+	if(KeysScanSource* keys = dynamic_cast<KeysScanSource*>(source.get()))
 	{
-		usleep(100000);
+		keys->getKeys()->startTopCalibration();
+		keys->getKeys()->loadInverseSquareCalibrationFile(path, 0);
 	}
-	keys->stopAndWait();
-	delete keys;
+#endif /* HOST_BUILD */
+	gEventLoop.run();
+	source->stop();
+	printNotifications(NULL);
+	captureWriter.cleanup();
+	if(gFramesProcessed)
+		printf("%zu frames, processFrame() took %.1f us on average, %.1f us at most\n", gFramesProcessed,
+				gProcessingTime / gFramesProcessed * 1e6, gProcessingTimeMax * 1e6);
+	if(ThreadedScanSource* threaded = dynamic_cast<ThreadedScanSource*>(source.get()))
+		printf("%zu frames generated, %zu late\n", threaded->getFrames(), threaded->getOverruns());
+	if(tracePath && !traceDump(tracePath))
+		return 1;
 }
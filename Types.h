@@ -29,11 +29,12 @@
 #endif
 
 #include <limits>
+#include <stdint.h>
 #include <cstdlib>
 #include <cmath>
 #include <utility>
 
-#undef FIXED_POINT_TIME
+// Define FIXED_POINT_TIME (e.g.: with -D) for integer timestamps
 
 // The following template specializations give the "missing" values for each kind of data that can be used in a Node.
 // If an unknown type is added, its "missing" value is whatever comes back from the default constructor.  Generally speaking, new
@@ -122,5 +123,11 @@ typedef double timestamp_diff_type;
 
 #endif /* FIXED_POINT_TIME */
 
+// Frame clock: the number of scans of the keyboard since the start. This is
+// the clock of the key tracking pipeline: it is exact and, at 64 bits, never
+// wraps. Convert it to seconds only where times leave the pipeline.
+typedef uint64_t frame_type;
+typedef int64_t frame_diff_type;
+
 
 #endif /* KEYCONTROL_TYPES_H */
@@ -0,0 +1,27 @@
+#pragma once
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+
+// On the board, RT_CALL(f) calls the Cobalt (Xenomai) version of the POSIX
+// function f from libcobalt, so that threads it creates are real-time and
+// what real-time threads call on them does not leave primary mode. Host
+// builds (HOST_BUILD), which do not link against Xenomai, call f itself.
+#ifdef HOST_BUILD
+#define RT_CALL(call) call
+#else /* HOST_BUILD */
+#define RT_CALL(call) __wrap_##call
+extern "C" {
+int __wrap_pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start)(void*), void* arg);
+int __wrap_pthread_join(pthread_t thread, void** ret);
+int __wrap_sem_init(sem_t* sem, int pshared, unsigned int value);
+int __wrap_sem_destroy(sem_t* sem);
+int __wrap_sem_post(sem_t* sem);
+int __wrap_sem_wait(sem_t* sem);
+int __wrap_socket(int family, int type, int protocol);
+int __wrap_setsockopt(int fd, int level, int name, const void* value, socklen_t length);
+int __wrap_bind(int fd, const struct sockaddr* address, socklen_t length);
+ssize_t __wrap_sendto(int fd, const void* buffer, size_t length, int flags, const struct sockaddr* address, socklen_t addressLength);
+int __wrap_close(int fd);
+}
+#endif /* HOST_BUILD */